@@ -0,0 +1,461 @@
+#include "DnsResolver.h"
+#include "IOManager.h"
+#include "Timer.h"
+#include "hook.h"
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+/// DNS报文头长度
+static const size_t DNS_HEADER_SIZE = 12;
+/// UDP回包的最大长度(没有EDNS)
+static const size_t DNS_MAX_UDP_SIZE = 512;
+/// A记录
+static const uint16_t DNS_TYPE_A = 1;
+/// CNAME记录
+static const uint16_t DNS_TYPE_CNAME = 5;
+/// IN类
+static const uint16_t DNS_CLASS_IN = 1;
+/// 默认DNS端口
+static const uint16_t DNS_PORT = 53;
+
+static std::string ToLower(const std::string& s) {
+    std::string rt(s);
+    std::transform(rt.begin(), rt.end(), rt.begin(), ::tolower);
+    return rt;
+}
+
+static uint16_t ReadU16(const uint8_t* p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t ReadU32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @brief 解析"ip[:port]"形式的服务器地址
+*/
+static bool ParseServer(const std::string& str, sockaddr_in& addr) {
+    std::string host = str;
+    uint16_t port = DNS_PORT;
+    size_t pos = str.find(':');
+    if (pos != std::string::npos) {
+        host = str.substr(0, pos);
+        port = (uint16_t)atoi(str.c_str() + pos + 1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    return inet_pton(AF_INET, host.c_str(), &addr.sin_addr) == 1;
+}
+
+/**
+ * @brief 构造查询A记录的报文
+ * @return 域名不合法返回false
+*/
+static bool BuildQuery(const std::string& name, uint16_t id, std::string& packet) {
+    if (name.size() > 253) {
+        return false;
+    }
+    packet.clear();
+    uint8_t header[DNS_HEADER_SIZE] = {0};
+    header[0] = id >> 8;
+    header[1] = id & 0xff;
+    // 期望递归查询
+    header[2] = 0x01;
+    // 一个问题
+    header[5] = 1;
+    packet.append((const char*)header, sizeof(header));
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t end = name.find('.', start);
+        if (end == std::string::npos) {
+            end = name.size();
+        }
+        size_t len = end - start;
+        if (len == 0 || len > 63) {
+            return false;
+        }
+        packet.push_back((char)len);
+        packet.append(name, start, len);
+        start = end + 1;
+    }
+    packet.push_back(0);
+    const uint8_t tail[4] = {0, DNS_TYPE_A, 0, DNS_CLASS_IN};
+    packet.append((const char*)tail, sizeof(tail));
+    return true;
+}
+
+/**
+ * @brief 跳过报文中的一个名字，名字可能以压缩指针结尾
+*/
+static bool SkipName(const uint8_t* data, size_t len, size_t& pos) {
+    while (pos < len) {
+        uint8_t c = data[pos];
+        if (c == 0) {
+            ++pos;
+            return true;
+        }
+        if ((c & 0xc0) == 0xc0) {
+            pos += 2;
+            return pos <= len;
+        }
+        pos += c + 1;
+    }
+    return false;
+}
+
+/**
+ * @brief 解析回包
+ * @return 不是这次查询的回包或者报文不完整返回-1，回包被截断返回EIO，否则返回查询结果
+*/
+static int ParseResponse(const uint8_t* data, size_t len, uint16_t id,
+                         std::vector<in_addr>& addrs, uint32_t& ttl) {
+    if (len < DNS_HEADER_SIZE || ReadU16(data) != id || !(data[2] & 0x80)) {
+        return -1;
+    }
+    // 截断(TC)的回包只带了一部分记录，不能当成完整答案缓存，按服务器出错换下一个服务器
+    if (data[2] & 0x02) {
+        return EIO;
+    }
+    int rcode = data[3] & 0x0f;
+    uint16_t qdcount = ReadU16(data + 4);
+    uint16_t ancount = ReadU16(data + 6);
+    size_t pos = DNS_HEADER_SIZE;
+    for (uint16_t i = 0; i < qdcount; ++i) {
+        if (!SkipName(data, len, pos) || pos + 4 > len) {
+            return -1;
+        }
+        pos += 4;
+    }
+    if (rcode == 3) {
+        return ENOENT;
+    }
+    if (rcode != 0) {
+        return EIO;
+    }
+    addrs.clear();
+    ttl = UINT32_MAX;
+    for (uint16_t i = 0; i < ancount; ++i) {
+        if (!SkipName(data, len, pos) || pos + 10 > len) {
+            return -1;
+        }
+        uint16_t type = ReadU16(data + pos);
+        uint16_t cls = ReadU16(data + pos + 2);
+        uint32_t record_ttl = ReadU32(data + pos + 4);
+        uint16_t rdlen = ReadU16(data + pos + 8);
+        pos += 10;
+        if (pos + rdlen > len) {
+            return -1;
+        }
+        // 别名链上的每一环都要算进TTL
+        if (cls == DNS_CLASS_IN && (type == DNS_TYPE_A || type == DNS_TYPE_CNAME)) {
+            ttl = std::min(ttl, record_ttl);
+        }
+        if (cls == DNS_CLASS_IN && type == DNS_TYPE_A && rdlen == 4) {
+            in_addr addr;
+            memcpy(&addr, data + pos, 4);
+            addrs.push_back(addr);
+        }
+        pos += rdlen;
+    }
+    if (addrs.empty()) {
+        ttl = 0;
+        return ENOENT;
+    }
+    return 0;
+}
+
+DnsResolver::DnsResolver() {
+    loadResolvConf();
+    loadHosts();
+}
+
+bool DnsResolver::loadResolvConf(const std::string& path) {
+    std::ifstream ifs(path);
+    std::vector<sockaddr_in> servers;
+    uint64_t timeout_ms = 0;
+    int attempts = 0;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::istringstream iss(line);
+        std::string key;
+        if (!(iss >> key) || key[0] == '#' || key[0] == ';') {
+            continue;
+        }
+        std::string value;
+        if (key == "nameserver") {
+            sockaddr_in addr;
+            // 只支持IPv4的服务器
+            if (iss >> value && ParseServer(value, addr)) {
+                servers.push_back(addr);
+            }
+        } else if (key == "options") {
+            while (iss >> value) {
+                if (value.compare(0, 8, "timeout:") == 0) {
+                    timeout_ms = atoi(value.c_str() + 8) * 1000;
+                } else if (value.compare(0, 9, "attempts:") == 0) {
+                    attempts = atoi(value.c_str() + 9);
+                }
+            }
+        }
+    }
+    // 没有配置服务器时和glibc一样用本机
+    if (servers.empty()) {
+        sockaddr_in addr;
+        ParseServer("127.0.0.1", addr);
+        servers.push_back(addr);
+    }
+    MutexType::Lock lock(m_mutex);
+    m_servers.swap(servers);
+    if (timeout_ms) {
+        m_timeoutMs = timeout_ms;
+    }
+    if (attempts > 0) {
+        m_attempts = attempts;
+    }
+    return ifs.is_open();
+}
+
+bool DnsResolver::loadHosts(const std::string& path) {
+    std::ifstream ifs(path);
+    std::unordered_map<std::string, std::vector<in_addr>> hosts;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream iss(line);
+        std::string ip;
+        in_addr addr;
+        if (!(iss >> ip) || inet_pton(AF_INET, ip.c_str(), &addr) != 1) {
+            continue;
+        }
+        std::string name;
+        while (iss >> name) {
+            hosts[ToLower(name)].push_back(addr);
+        }
+    }
+    MutexType::Lock lock(m_mutex);
+    m_hosts.swap(hosts);
+    return ifs.is_open();
+}
+
+void DnsResolver::setNameservers(const std::vector<std::string>& servers) {
+    std::vector<sockaddr_in> addrs;
+    for (auto& i: servers) {
+        sockaddr_in addr;
+        if (ParseServer(i, addr)) {
+            addrs.push_back(addr);
+        }
+    }
+    MutexType::Lock lock(m_mutex);
+    m_servers.swap(addrs);
+}
+
+void DnsResolver::setTimeout(uint64_t timeout_ms) {
+    MutexType::Lock lock(m_mutex);
+    m_timeoutMs = timeout_ms;
+}
+
+void DnsResolver::setAttempts(int attempts) {
+    MutexType::Lock lock(m_mutex);
+    m_attempts = std::max(attempts, 1);
+}
+
+int DnsResolver::resolve(const std::string& name, std::vector<in_addr>& addrs) {
+    ++m_lookups;
+    addrs.clear();
+    in_addr addr;
+    if (inet_pton(AF_INET, name.c_str(), &addr) == 1) {
+        addrs.push_back(addr);
+        return 0;
+    }
+    std::string key = ToLower(name);
+    if (!key.empty() && key.back() == '.') {
+        key.pop_back();
+    }
+    if (key.empty()) {
+        return EINVAL;
+    }
+
+    Scheduler* scheduler = Scheduler::GetThis();
+    bool in_fiber = scheduler && Fiber::GetThis()->isRunInScheduler();
+    std::shared_ptr<Pending> pending;
+    bool leader = false;
+    {
+        PreemptGuard guard;
+        {
+            MutexType::Lock lock(m_mutex);
+            auto hosts = m_hosts.find(key);
+            if (hosts != m_hosts.end()) {
+                ++m_hostsHits;
+                addrs = hosts->second;
+                return 0;
+            }
+            auto cache = m_cache.find(key);
+            if (cache != m_cache.end()) {
+                if (cache->second.expireMs > GetCurrentMS()) {
+                    ++m_cacheHits;
+                    addrs = cache->second.addrs;
+                    return 0;
+                }
+                m_cache.erase(cache);
+            }
+            auto it = m_pending.find(key);
+            if (it == m_pending.end()) {
+                pending.reset(new Pending);
+                m_pending[key] = pending;
+                leader = true;
+            } else if (in_fiber) {
+                // 已经有人在查这个名字，挂起等它的结果
+                pending = it->second;
+                pending->waiters.push_back(Waiter{Fiber::GetThis(), scheduler});
+                ++m_coalesced;
+            }
+            // 不在协程里的线程不能挂起，自己再查一次
+        }
+        if (pending && !leader) {
+            Fiber* raw_ptr = Fiber::GetThis().get();
+            raw_ptr->yield();
+            addrs = pending->addrs;
+            return pending->result;
+        }
+    }
+
+    uint32_t ttl = 0;
+    std::vector<in_addr> result;
+    int rt = query(key, result, ttl);
+    std::list<Waiter> waiters;
+    {
+        MutexType::Lock lock(m_mutex);
+        if (rt == 0 && ttl > 0) {
+            m_cache[key] = CacheEntry{result, GetCurrentMS() + ttl * 1000ULL};
+        }
+        if (leader) {
+            pending->result = rt;
+            pending->addrs = result;
+            waiters.swap(pending->waiters);
+            m_pending.erase(key);
+        }
+    }
+    for (auto& i: waiters) {
+        i.scheduler->schedule(i.fiber);
+    }
+    addrs.swap(result);
+    return rt;
+}
+
+int DnsResolver::query(const std::string& name, std::vector<in_addr>& addrs, uint32_t& ttl) {
+    std::vector<sockaddr_in> servers;
+    uint64_t timeout_ms;
+    int attempts;
+    {
+        MutexType::Lock lock(m_mutex);
+        servers = m_servers;
+        timeout_ms = m_timeoutMs;
+        attempts = m_attempts;
+    }
+    // 开了hook却不在IOManager上时没有epoll可以等，这次查询临时关掉hook，用阻塞socket
+    bool disable_hook = is_hook_enable() && !IOManager::GetThis();
+    if (disable_hook) {
+        set_hook_enable(false);
+    }
+    int rt = ETIMEDOUT;
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock >= 0) {
+        bool done = false;
+        for (int i = 0; i < attempts && !done; ++i) {
+            for (auto& server: servers) {
+                int r = queryServer(sock, server, name, timeout_ms, addrs, ttl);
+                if (r == 0 || r == ENOENT || r == EINVAL) {
+                    rt = r;
+                    done = true;
+                    break;
+                }
+                // 服务器出错就换下一个，都出错时返回EIO
+                if (r == EIO) {
+                    rt = EIO;
+                }
+            }
+        }
+        close(sock);
+    } else {
+        rt = EIO;
+    }
+    if (disable_hook) {
+        set_hook_enable(true);
+    }
+    return rt;
+}
+
+int DnsResolver::queryServer(int sock, const sockaddr_in& server, const std::string& name,
+                             uint64_t timeout_ms, std::vector<in_addr>& addrs, uint32_t& ttl) {
+    uint16_t id = 0;
+    {
+        // 生成器是线程局部的，生成到一半被抢占的话同一线程上的其他协程会看到改了一半的状态
+        PreemptGuard guard;
+        // 查询id不可预测，防止伪造回包
+        static thread_local std::mt19937 t_rand(std::random_device{}());
+        id = (uint16_t)t_rand();
+    }
+    std::string packet;
+    if (!BuildQuery(name, id, packet)) {
+        return EINVAL;
+    }
+    if (sendto(sock, packet.data(), packet.size(), 0,
+               (const sockaddr*)&server, sizeof(server)) != (ssize_t)packet.size()) {
+        return EIO;
+    }
+    ++m_queriesSent;
+    uint64_t deadline = GetCurrentMS() + timeout_ms;
+    uint8_t buf[DNS_MAX_UDP_SIZE];
+    while (true) {
+        uint64_t now = GetCurrentMS();
+        if (now >= deadline) {
+            break;
+        }
+        // 超时设在socket上，hook的recvfrom用定时器等，否则由内核计时
+        uint64_t left = deadline - now;
+        struct timeval tv = {(time_t)(left / 1000), (suseconds_t)(left % 1000 * 1000)};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(sock, buf, sizeof(buf), 0, (sockaddr*)&from, &fromlen);
+        if (n < 0) {
+            break;
+        }
+        // 丢掉别处来的包和过期查询的回包
+        if (from.sin_addr.s_addr != server.sin_addr.s_addr || from.sin_port != server.sin_port) {
+            continue;
+        }
+        int rt = ParseResponse(buf, n, id, addrs, ttl);
+        if (rt >= 0) {
+            return rt;
+        }
+    }
+    ++m_timeouts;
+    return ETIMEDOUT;
+}
+
+void DnsResolver::clearCache() {
+    MutexType::Lock lock(m_mutex);
+    m_cache.clear();
+}
+
+DnsResolver::Stats DnsResolver::getStats() const {
+    Stats stats;
+    stats.lookups = m_lookups;
+    stats.hostsHits = m_hostsHits;
+    stats.cacheHits = m_cacheHits;
+    stats.coalesced = m_coalesced;
+    stats.queriesSent = m_queriesSent;
+    stats.timeouts = m_timeouts;
+    return stats;
+}
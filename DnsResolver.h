@@ -0,0 +1,173 @@
+#pragma once
+#include "Fiber.h"
+#include "Scheduler.h"
+#include "mutex.h"
+#include "singleton.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief 协程版的DNS存根解析器
+ * @details 直接向/etc/resolv.conf里的服务器发UDP查询，只解析IPv4的A记录。
+ * 在开启hook的IOManager线程上查询走hook的sendto/recvfrom，等待回包时挂起协程，
+ * 超时由IOManager的定时器负责；其他情况下用阻塞的socket和内核超时。
+ * 先查/etc/hosts，再查按TTL过期的进程内缓存，同一个名字同时只发一次查询，
+ * 其他查询这个名字的协程挂起等结果
+*/
+class DnsResolver {
+public:
+    using ptr = std::shared_ptr<DnsResolver>;
+    using MutexType = Mutex;
+
+    /**
+     * @brief 解析器统计信息
+    */
+    struct Stats {
+        /// 解析请求数
+        uint64_t lookups;
+        /// 命中hosts的次数
+        uint64_t hostsHits;
+        /// 命中缓存的次数
+        uint64_t cacheHits;
+        /// 合并到进行中查询的次数
+        uint64_t coalesced;
+        /// 发出的查询报文数
+        uint64_t queriesSent;
+        /// 查询超时的次数，每个服务器每次尝试算一次
+        uint64_t timeouts;
+    };
+
+    /**
+     * @brief 构造函数，读取/etc/resolv.conf和/etc/hosts
+    */
+    DnsResolver();
+
+    DnsResolver(const DnsResolver&) = delete;
+
+    DnsResolver& operator = (const DnsResolver&) = delete;
+
+    /**
+     * @brief 读取resolv.conf，支持nameserver和options timeout:/attempts:
+     * @return 文件能否打开
+    */
+    bool loadResolvConf(const std::string& path = "/etc/resolv.conf");
+
+    /**
+     * @brief 读取hosts文件，只保留IPv4地址，替换原来的hosts记录
+     * @return 文件能否打开
+    */
+    bool loadHosts(const std::string& path = "/etc/hosts");
+
+    /**
+     * @brief 设置DNS服务器
+     * @param[in] servers 形如"8.8.8.8"或"127.0.0.1:5353"，不写端口时为53
+    */
+    void setNameservers(const std::vector<std::string>& servers);
+
+    /**
+     * @brief 设置每次尝试等待回包的超时时间(毫秒)
+    */
+    void setTimeout(uint64_t timeout_ms);
+
+    /**
+     * @brief 设置每个服务器的尝试次数
+    */
+    void setAttempts(int attempts);
+
+    /**
+     * @brief 解析域名的IPv4地址
+     * @param[in] name 域名，也可以直接是点分十进制地址
+     * @param[out] addrs 解析出的地址
+     * @return 成功返回0，域名不合法返回EINVAL，域名不存在或者没有A记录返回ENOENT，
+     * 服务器都返回错误返回EIO，所有服务器都没有应答返回ETIMEDOUT
+    */
+    int resolve(const std::string& name, std::vector<in_addr>& addrs);
+
+    /**
+     * @brief 清空缓存
+    */
+    void clearCache();
+
+    /**
+     * @brief 获取统计信息
+    */
+    Stats getStats() const;
+
+private:
+    /**
+     * @brief 缓存项
+    */
+    struct CacheEntry {
+        /// 地址
+        std::vector<in_addr> addrs;
+        /// 过期时间(毫秒)
+        uint64_t expireMs;
+    };
+
+    /**
+     * @brief 等待进行中查询的协程
+    */
+    struct Waiter {
+        /// 等待的协程
+        Fiber::ptr fiber;
+        /// 协程所在的调度器
+        Scheduler* scheduler;
+    };
+
+    /**
+     * @brief 进行中的查询
+    */
+    struct Pending {
+        /// 等结果的协程
+        std::list<Waiter> waiters;
+        /// 查询结果
+        int result = ETIMEDOUT;
+        /// 解析出的地址
+        std::vector<in_addr> addrs;
+    };
+
+    /**
+     * @brief 依次向各个服务器查询
+     * @param[out] ttl 结果可以缓存的秒数
+    */
+    int query(const std::string& name, std::vector<in_addr>& addrs, uint32_t& ttl);
+
+    /**
+     * @brief 向一个服务器发一次查询并等待回包
+     * @return 同query，没有收到合法回包返回ETIMEDOUT
+    */
+    int queryServer(int sock, const sockaddr_in& server, const std::string& name,
+                    uint64_t timeout_ms, std::vector<in_addr>& addrs, uint32_t& ttl);
+
+private:
+    /// 互斥锁
+    mutable MutexType m_mutex;
+    /// DNS服务器
+    std::vector<sockaddr_in> m_servers;
+    /// 每次尝试的超时时间(毫秒)
+    uint64_t m_timeoutMs = 5000;
+    /// 每个服务器的尝试次数
+    int m_attempts = 2;
+    /// hosts记录，名字统一转成小写
+    std::unordered_map<std::string, std::vector<in_addr>> m_hosts;
+    /// 缓存，名字统一转成小写
+    std::unordered_map<std::string, CacheEntry> m_cache;
+    /// 进行中的查询
+    std::unordered_map<std::string, std::shared_ptr<Pending>> m_pending;
+    /// 统计
+    std::atomic<uint64_t> m_lookups = {0};
+    std::atomic<uint64_t> m_hostsHits = {0};
+    std::atomic<uint64_t> m_cacheHits = {0};
+    std::atomic<uint64_t> m_coalesced = {0};
+    std::atomic<uint64_t> m_queriesSent = {0};
+    std::atomic<uint64_t> m_timeouts = {0};
+};
+
+/// 默认解析器单例
+using DnsResolverMgr = Singleton<DnsResolver>;
@@ -7,15 +7,28 @@
 FdCtx::FdCtx(int fd) 
     :m_isInit(false)
     ,m_isSocket(false)
+    ,m_isFile(false)
+    ,m_isFifo(false)
+    ,m_isPollable(false)
     ,m_sysNonblock(false)
-    ,m_userNonblock(false)
     ,m_isClosed(false)
     ,m_fd(fd)
-    ,m_recvTimeout(-1)
-    ,m_sendTimeout(-1) {
+    ,m_desc(new Description) {
     init();        
 }
 
+FdCtx::FdCtx(int fd, const FdCtx& orig)
+    :m_isInit(orig.m_isInit)
+    ,m_isSocket(orig.m_isSocket)
+    ,m_isFile(orig.m_isFile)
+    ,m_isFifo(orig.m_isFifo)
+    ,m_isPollable(orig.m_isPollable)
+    ,m_sysNonblock(orig.m_sysNonblock)
+    ,m_isClosed(false)
+    ,m_fd(fd)
+    ,m_desc(orig.m_desc) {
+}
+
 FdCtx::~FdCtx() {
 
 }
@@ -24,19 +37,23 @@ bool FdCtx::init() {
     if (m_isInit) {
         return true;
     }
-    m_recvTimeout = -1;
-    m_sendTimeout = -1;
-
     struct stat fd_stat;
     if (-1 == fstat(m_fd, &fd_stat)) {
         m_isInit = false;
         m_isSocket = false;
+        m_isFile = false;
+        m_isFifo = false;
+        m_isPollable = false;
     } else {
         m_isInit = true;
         m_isSocket = S_ISSOCK(fd_stat.st_mode);
+        m_isFile = S_ISREG(fd_stat.st_mode);
+        m_isFifo = S_ISFIFO(fd_stat.st_mode);
+        int fd_flags = fcntl_f(m_fd, F_GETFD);
+        m_isPollable = m_isSocket || (m_isFifo && fd_flags != -1 && (fd_flags & FD_CLOEXEC));
     }
 
-    if (m_isSocket) {
+    if (isPollable()) {
         int flags = fcntl_f(m_fd, F_GETFL, 0);
         if (!(flags & O_NONBLOCK)) {
             fcntl_f(m_fd, F_SETFL, flags | O_NONBLOCK);
@@ -46,24 +63,23 @@ bool FdCtx::init() {
         m_sysNonblock = false;
     }
 
-    m_userNonblock = false;
     m_isClosed = false;
     return m_isInit;
 }
 
 void FdCtx::setTimeout(int type, uint64_t v) {
     if (type == SO_RCVTIMEO) {
-        m_recvTimeout = v;
+        m_desc->recvTimeout = v;
     } else {
-        m_sendTimeout = v;
+        m_desc->sendTimeout = v;
     }
 }
 
 uint64_t FdCtx::getTimeout(int type) {
     if (type == SO_RCVTIMEO) {
-        return m_recvTimeout;
+        return m_desc->recvTimeout;
     } else {
-        return m_sendTimeout;
+        return m_desc->sendTimeout;
     }
 }
 
@@ -103,4 +119,18 @@ void FdManager::del(int fd) {
         return;
     }
     m_datas[fd].reset();
+}
+
+FdCtx::ptr FdManager::dup(int oldfd, int newfd) {
+    FdCtx::ptr orig = get(oldfd);
+    if (!orig || newfd < 0) {
+        return nullptr;
+    }
+    RWMutextType::WriteLock lock(m_mutex);
+    FdCtx::ptr ctx(new FdCtx(newfd, *orig));
+    if (newfd >= (int)m_datas.size()) {
+        m_datas.resize(newfd * 1.5);
+    }
+    m_datas[newfd] = ctx;
+    return ctx;
 }
\ No newline at end of file
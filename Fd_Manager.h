@@ -4,6 +4,9 @@
 #include <vector>
 #include <memory>
 
+class WriteCoalescer;
+class ZeroCopySender;
+
 /**
  * @brief 文件句柄上下文类
  * @details 管理文件句柄类型(是否socket)
@@ -16,6 +19,12 @@ public:
      * @brief 通过文件句柄构造FdCtx
     */
     FdCtx(int fd);
+    /**
+     * @brief dup出来的文件句柄，和原句柄共享同一个打开文件描述
+     * @param[in] fd 新文件句柄
+     * @param[in] orig 原文件句柄的上下文
+    */
+    FdCtx(int fd, const FdCtx& orig);
     /**
      * @brief 析构函数
     */
@@ -28,6 +37,23 @@ public:
      * @brief 是否socket
     */
     bool isSocket() const {return m_isSocket;}
+    /**
+     * @brief 是否普通文件
+    */
+    bool isFile() const {return m_isFile;}
+    /**
+     * @brief 是否管道
+    */
+    bool isFifo() const {return m_isFifo;}
+    /**
+     * @brief 能否通过epoll等待就绪，socket和带FD_CLOEXEC的管道hook之后按非阻塞处理
+     * @details O_NONBLOCK属于打开文件描述，fork之后父子进程共享。不带FD_CLOEXEC的管道是留给子进程继承的，
+     * exec之后的程序按阻塞方式使用它，所以这种管道不设置非阻塞，读写直接调用原生函数。
+     * 是否带FD_CLOEXEC只在登记时看一次，之后用fcntl修改不会改变这里的判断。
+     * 带O_CLOEXEC的管道经hook的dup2放到0~2上时恢复阻塞模式，posix_spawn内部的dup2不经过hook，
+     * 交给它的管道要用不带O_CLOEXEC的pipe创建
+    */
+    bool isPollable() const {return m_isPollable;}
     /**
      * @brief 是否已关闭
     */
@@ -36,11 +62,11 @@ public:
      * @brief 设置用户主动设置非阻塞
      * @param[in] v 是否阻塞
     */
-    void setUserNonblock(bool v) {m_userNonblock = v;}
+    void setUserNonblock(bool v) {m_desc->userNonblock = v;}
     /**
      * @brief 获取是否用户主动设置的非阻塞
     */
-    bool getUserNonblock() {return m_userNonblock;}
+    bool getUserNonblock() {return m_desc->userNonblock;}
     /**
      * @brief 设置系统非阻塞
      * @param[in] v 是否阻塞
@@ -62,7 +88,40 @@ public:
      * @return 超时时间毫秒
     */
     uint64_t getTimeout(int type);
+    /**
+     * @brief 设置写合并器，为空表示关闭写合并
+     * @details 写合并器属于句柄而不是打开文件描述，dup出来的句柄不继承。
+     * 其他线程上的写操作同时在读，所以用原子操作读写这个shared_ptr
+    */
+    void setCoalescer(std::shared_ptr<WriteCoalescer> v) {std::atomic_store(&m_coalescer, v);}
+    /**
+     * @brief 获取写合并器
+    */
+    std::shared_ptr<WriteCoalescer> getCoalescer() const {return std::atomic_load(&m_coalescer);}
+    /**
+     * @brief 设置零拷贝发送器
+     * @details 完成通知的编号由内核按socket计数，发送器一旦创建就跟着句柄直到关闭。和写合并器一样原子读写
+    */
+    void setZeroCopy(std::shared_ptr<ZeroCopySender> v) {std::atomic_store(&m_zeroCopy, v);}
+    /**
+     * @brief 获取零拷贝发送器
+    */
+    std::shared_ptr<ZeroCopySender> getZeroCopy() const {return std::atomic_load(&m_zeroCopy);}
 private:
+    /**
+     * @brief 打开文件描述上的状态
+     * @details 非阻塞标志和socket超时都属于打开文件描述，dup出来的句柄共享同一份，
+     * 最后一个句柄关闭时释放
+    */
+    struct Description {
+        /// 是否用户主动设置非阻塞
+        bool userNonblock = false;
+        /// 读超时时间毫秒
+        uint64_t recvTimeout = -1;
+        /// 写超时时间毫秒
+        uint64_t sendTimeout = -1;
+    };
+
     /**
      * @brief 初始化
     */
@@ -72,18 +131,24 @@ private:
     bool m_isInit: 1;
     /// 是否socket
     bool m_isSocket: 1;
+    /// 是否普通文件
+    bool m_isFile: 1;
+    /// 是否管道
+    bool m_isFifo: 1;
+    /// 能否通过epoll等待就绪
+    bool m_isPollable: 1;
     /// 是否hook非阻塞
     bool m_sysNonblock: 1;
-    /// 是否用户主动设置非阻塞
-    bool m_userNonblock: 1;
     /// 是否关闭
     bool m_isClosed: 1;
     /// 文件句柄
     int m_fd;
-    /// 读超时时间毫秒
-    uint64_t m_recvTimeout;
-    /// 写超时时间毫秒
-    uint64_t m_sendTimeout;
+    /// 打开文件描述上的状态
+    std::shared_ptr<Description> m_desc;
+    /// 写合并器
+    std::shared_ptr<WriteCoalescer> m_coalescer;
+    /// 零拷贝发送器
+    std::shared_ptr<ZeroCopySender> m_zeroCopy;
 };
 
 /**
@@ -105,6 +170,15 @@ public:
     */
     FdCtx::ptr get(int fd, bool auto_create = false);
 
+    /**
+     * @brief 登记dup出来的文件句柄
+     * @details 原句柄没有登记时新句柄也不登记，和hook之前的行为一致
+     * @param[in] oldfd 原文件句柄
+     * @param[in] newfd 新文件句柄
+     * @return 新句柄的FdCtx，原句柄没有登记时返回空
+    */
+    FdCtx::ptr dup(int oldfd, int newfd);
+
     /**
      * @brief 删除文件句柄类
      * @param[in] fd 文件句柄
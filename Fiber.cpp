@@ -1,27 +1,95 @@
 #include "Fiber.h"
 #include "Scheduler.h"
+#include "thread.h"
 #include <assert.h>
 #include <atomic>
+#include <vector>
 #include <iostream>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 static std::atomic<uint64_t> s_fiber_id {0};
 static std::atomic<uint64_t> s_fiber_count{0};
 
 static thread_local Fiber* t_fiber = nullptr;
 static thread_local Fiber::ptr t_thread_fiber = nullptr;
+/// @brief 本线程上刚刚切出、切换完成后要清除在运行标志的协程
+static thread_local Fiber* t_switching_fiber = nullptr;
 
 static uint32_t g_fiber_stack_size {128 * 1024};
 
+/// @brief 每个NUMA节点最多缓存多少个默认大小的协程栈
+static const size_t MAX_CACHED_STACKS = 64;
+
 /**
  * @brief 栈空间分配器
+ * @details 多NUMA节点的机器上，栈用mmap申请并通过mbind优先放在申请线程所在的节点，
+ * 工作线程绑核之后协程栈和运行它的CPU就在同一个节点上。默认大小的栈释放后按节点缓存起来，
+ * 下次在同一节点上创建协程时直接复用，单节点机器上和原来一样用malloc
 */
 class StackAllocator {
 public:
-    static void* Alloc(size_t size) {
-        return malloc(size);
+    static void* Alloc(size_t size, int& node) {
+        node = IsNuma() ? GetCurrentNumaNode() : 0;
+        if (size == g_fiber_stack_size) {
+            StackPool& pool = GetPools()[node];
+            Mutex::Lock lock(pool.mutex);
+            if (!pool.stacks.empty()) {
+                void* vp = pool.stacks.back();
+                pool.stacks.pop_back();
+                return vp;
+            }
+        }
+        return AllocOnNode(size, node);
+    }
+    static void Dealloc(void* vp, size_t size, int node) {
+        if (size == g_fiber_stack_size) {
+            StackPool& pool = GetPools()[node];
+            Mutex::Lock lock(pool.mutex);
+            if (pool.stacks.size() < MAX_CACHED_STACKS) {
+                pool.stacks.push_back(vp);
+                return;
+            }
+        }
+        if (IsNuma()) {
+            munmap(vp, size);
+        } else {
+            free(vp);
+        }
     }
-    static void Dealloc(void* vp, size_t size) {
-        return free(vp);
+private:
+    /**
+     * @brief 单个NUMA节点的栈缓存
+    */
+    struct StackPool {
+        Mutex mutex;
+        std::vector<void*> stacks;
+    };
+
+    static bool IsNuma() {
+        static bool numa = GetNumaNodeCount() > 1;
+        return numa;
+    }
+
+    static StackPool* GetPools() {
+        // 不释放，避免静态对象析构之后还有协程析构
+        static StackPool* pools = new StackPool[GetNumaNodeCount()];
+        return pools;
+    }
+
+    static void* AllocOnNode(size_t size, int node) {
+        if (!IsNuma()) {
+            return malloc(size);
+        }
+        void* vp = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(vp != MAP_FAILED);
+        if (node < (int)sizeof(unsigned long) * 8) {
+            // MPOL_PREFERRED，节点内存不够时允许退到其他节点
+            unsigned long mask = 1UL << node;
+            syscall(SYS_mbind, vp, size, 1, &mask, sizeof(mask) * 8, 0);
+        }
+        return vp;
     }
 };
 
@@ -56,7 +124,7 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler)
     , m_runInScheduler(run_in_scheduler) {
     ++s_fiber_count;
     m_stacksize = stacksize ? stacksize : g_fiber_stack_size;
-    m_stack = StackAllocator::Alloc(m_stacksize);
+    m_stack = StackAllocator::Alloc(m_stacksize, m_stackNode);
 
     if (getcontext(&m_ctx)) {
         assert(("getcontext", false));
@@ -95,13 +163,36 @@ void Fiber::SetThis(Fiber* f) {
     t_fiber = f;
 }
 
+void Fiber::FinishSwitch() {
+    if (t_switching_fiber) {
+        t_switching_fiber->m_onCpu.store(false, std::memory_order_release);
+        t_switching_fiber = nullptr;
+    }
+}
+
+void Fiber::waitSwitched() {
+    while (m_onCpu.load(std::memory_order_acquire)) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield" ::: "memory");
+#endif
+    }
+}
+
 /**
  * @brief 将当前协程切到执行状态
  * @details 当前协程和正在运行的协程进行交换，前者状态变为RUNNING，后者状态变为READY
 */
 void Fiber::resume() {
+    // 刚被其他线程唤醒的协程可能还没切出，等它保存完上下文
+    waitSwitched();
     // 只能继续就绪的协程
     assert(m_state != TERM && m_state != RUNNING);
+    m_onCpu.store(true, std::memory_order_relaxed);
+    // 禁止抢占深度跟着协程走，切回来时恢复成本协程切出时的值
+    int preempt_disable = t_preempt_disable;
+    t_preempt_disable = m_preemptDisable;
     SetThis(this);
     m_state = RUNNING;
 
@@ -115,6 +206,8 @@ void Fiber::resume() {
             assert(("swapcontext", false));
         }
     }
+    FinishSwitch();
+    t_preempt_disable = preempt_disable;
 }
 
 /**
@@ -125,10 +218,13 @@ void Fiber::yield() {
     // 就绪态的协程无法yield，为什么结束态的进程也能yield呢？
     // 因为协程运行完毕之后自动yield一次用于回到主协程。
     assert(m_state == RUNNING || m_state == TERM);
+    m_preemptDisable = t_preempt_disable;
     SetThis(t_thread_fiber.get());
     if (m_state != TERM) {
         m_state = READY;
     }
+    // 唤醒方可能已经在其他线程上取到本协程，切换完成后才清除在运行标志
+    t_switching_fiber = this;
     // 与resume相反，如果该协程参与调度，也就是任务协程，那么其yield的对象应该是调度器主协程，
     // 也就是调度协程；否则其本身是调度线程，就应该yield到主协程
     if (m_runInScheduler) {
@@ -140,6 +236,47 @@ void Fiber::yield() {
             assert(("swapcontext", false));
         }
     }
+    FinishSwitch();
+}
+
+/**
+ * @brief 当前协程直接切换到next协程，不经过调度协程
+ * @details next之后yield时和普通的任务协程一样回到调度协程，
+ * 因为调度协程的上下文在resume当前协程时已经保存好了
+*/
+void Fiber::yieldTo(Fiber* next) {
+    assert(m_state == RUNNING && m_runInScheduler);
+    next->waitSwitched();
+    assert(next->m_state == READY && next->m_runInScheduler);
+    next->m_onCpu.store(true, std::memory_order_relaxed);
+    m_state = READY;
+    t_switching_fiber = this;
+    m_preemptDisable = t_preempt_disable;
+    // 先切换当前协程再换成next的深度，中途来的抢占信号看到的都是一致的状态
+    SetThis(next);
+    t_preempt_disable = next->m_preemptDisable;
+    next->m_state = RUNNING;
+    if (swapcontext(&m_ctx, &next->m_ctx)) {
+        assert(("swapcontext", false));
+    }
+    FinishSwitch();
+}
+
+bool Fiber::Preempt(uintptr_t sp) {
+    Fiber* cur = t_fiber;
+    if (!cur || !cur->m_runInScheduler || cur->m_state != RUNNING
+            || t_preempt_disable > 0 || !Scheduler::GetMainFiber()) {
+        return false;
+    }
+    // t_fiber在真正切换栈之前就改了，这段时间里运行的还是切换方的代码
+    uintptr_t stack = (uintptr_t)cur->m_stack;
+    if (sp <= stack || sp > stack + cur->m_stacksize) {
+        return false;
+    }
+    ++cur->m_preemptCount;
+    cur->m_preempted = true;
+    cur->yield();
+    return true;
 }
 
 /**
@@ -148,6 +285,8 @@ void Fiber::yield() {
  * 而且协程既然是用户线程，那么理应由用户来处理异常
 */
 void Fiber::MainFunc() {
+    // 新协程第一次运行，切换过来的协程上下文已经保存完
+    FinishSwitch();
     Fiber::ptr cur = GetThis();
     assert(cur);
 
@@ -180,6 +319,44 @@ void Fiber::reset(std::function<void()> cb) {
     makecontext(&m_ctx, &Fiber::MainFunc, 0);
     // 更换入口函数后，协程由终止变为就绪
     m_state = READY;
+    // 复用的协程是一个新任务，不继承上个任务的取消状态
+    m_cancelled = false;
+    m_group = nullptr;
+    m_schedGroup = -1;
+    m_deadline = 0;
+    m_wakeThread = -1;
+}
+
+/**
+ * @brief 取消协程
+ * @details 回调在锁外执行，因为回调会去操作IOManager和定时器，可能反过来调度本协程
+*/
+void Fiber::cancel() {
+    m_cancelled = true;
+    std::function<void()> cb;
+    {
+        MutexType::Lock lock(m_cancelMutex);
+        cb.swap(m_cancelCb);
+    }
+    if (cb) {
+        cb();
+    }
+}
+
+bool Fiber::setCancelCallback(std::function<void()> cb) {
+    MutexType::Lock lock(m_cancelMutex);
+    // 加锁后再检查，保证cancel要么看到回调，要么在这里被发现
+    if (m_cancelled) {
+        return false;
+    }
+    m_cancelCb.swap(cb);
+    return true;
+}
+
+void Fiber::clearCancelCallback() {
+    std::function<void()> cb;
+    MutexType::Lock lock(m_cancelMutex);
+    cb.swap(m_cancelCb);
 }
 
 /**
@@ -189,7 +366,7 @@ Fiber::~Fiber() {
     --s_fiber_count;
     if (m_stack) {
         assert(m_state == TERM);
-        StackAllocator::Dealloc(m_stack, m_stacksize);
+        StackAllocator::Dealloc(m_stack, m_stacksize, m_stackNode);
     }
     // std::cout << "Fiber::~Fiber() main id = " << m_id
     //           << " total=" << s_fiber_count << std::endl;
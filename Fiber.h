@@ -1,8 +1,12 @@
 #pragma once
+#include "mutex.h"
 #include <memory>
+#include <atomic>
 #include <functional>
 #include <ucontext.h>
 
+class TaskGroup;
+
 
 /**
  * @brief 协程类
@@ -10,6 +14,7 @@
 class Fiber: public std::enable_shared_from_this<Fiber> {
 public:
     using ptr = std::shared_ptr<Fiber>;
+    using MutexType = Mutex;
 
     /**
      * @brief 协程状态
@@ -66,6 +71,14 @@ public:
     */
     void yield();
 
+    /**
+     * @brief 当前协程直接切换到next协程，不经过调度协程
+     * @details 只需一次swapcontext，当前协程变为READY，next变为RUNNING，next让出执行权时回到调度协程
+     * @attention 两个协程都必须参与调度器调度，当前协程由Scheduler::yieldTo负责重新加入调度
+     * @param[in] next 要切换到的协程，必须是READY状态
+    */
+    void yieldTo(Fiber* next);
+
     /**
      * @brief 获取协程Id
     */
@@ -76,6 +89,98 @@ public:
     */
     State getState() const {return m_state;}
 
+    /**
+     * @brief 本协程是否参与调度器调度
+    */
+    bool isRunInScheduler() const {return m_runInScheduler;}
+
+    /**
+     * @brief 取消协程
+     * @details 只设置取消标志，协程需要自己检查标志退出；如果协程正阻塞在hook的IO或者sleep上，
+     * 则执行其登记的取消回调，将其立即唤醒，被唤醒的hook函数返回ECANCELED
+     * @note 可以在任意线程调用，对已经结束的协程没有影响
+    */
+    void cancel();
+
+    /**
+     * @brief 协程是否已被取消
+    */
+    bool isCancelled() const {return m_cancelled;}
+
+    /**
+     * @brief 登记取消回调，协程被取消时执行一次
+     * @details 由hook层在协程挂起前登记，用于撤销事件注册并唤醒协程
+     * @param[in] cb 取消回调
+     * @return 协程已被取消时不登记并返回false
+    */
+    bool setCancelCallback(std::function<void()> cb);
+
+    /**
+     * @brief 清除取消回调，协程被唤醒后调用
+    */
+    void clearCancelCallback();
+
+    /**
+     * @brief 获取协程所属的任务组，不属于任何任务组时返回nullptr
+    */
+    TaskGroup* getTaskGroup() const {return m_group;}
+
+    /**
+     * @brief 设置协程所属的任务组，由TaskGroup::spawn调用
+    */
+    void setTaskGroup(TaskGroup* group) {m_group = group;}
+
+    /**
+     * @brief 获取协程所属的调度组id，还没有加入过调度时返回-1
+    */
+    int getSchedGroup() const {return m_schedGroup;}
+
+    /**
+     * @brief 设置协程所属的调度组id，由调度器在协程第一次加入调度时设置
+    */
+    void setSchedGroup(int group) {m_schedGroup = group;}
+
+    /**
+     * @brief 获取协程的截止时间(毫秒，GetCurrentMS的时间)，0表示没有截止时间
+    */
+    uint64_t getDeadline() const {return m_deadline;}
+
+    /**
+     * @brief 设置协程的截止时间
+     * @details 有截止时间的协程每次加入调度都按截止时间最早优先排队，
+     * hook的IO和connect等待的时间不会超过截止时间，过了截止时间直接返回ETIMEDOUT
+     * @param[in] deadline_ms 截止时间(毫秒，GetCurrentMS的时间)，0表示清除
+    */
+    void setDeadline(uint64_t deadline_ms) {m_deadline = deadline_ms;}
+
+    /**
+     * @brief 获取协程被IO事件唤醒后运行的线程，-1表示任意线程
+    */
+    int getWakeThread() const {return m_wakeThread;}
+
+    /**
+     * @brief 设置协程被IO事件唤醒后运行的线程
+     * @details 等IO事件的协程每次被唤醒都排到这个线程上，适合需要线程局部性的常驻协程。
+     * 线程退出之后(弹性线程池)改为任意线程。定时器、取消等其他唤醒不受影响
+     * @param[in] thread 线程id，-1表示任意线程
+    */
+    void setWakeThread(int thread) {m_wakeThread = thread;}
+
+    /**
+     * @brief 获取协程被抢占的次数
+    */
+    uint64_t getPreemptCount() const {return m_preemptCount;}
+
+    /**
+     * @brief 取出并清除被抢占标志，由调度协程在resume返回后调用
+     * @return 协程是不是因为被抢占才回到调度协程的
+    */
+    bool consumePreempted() {
+        bool preempted = m_preempted;
+        m_preempted = false;
+        return preempted;
+    }
+
 public:
     /**
      * @brief 设置当前正在运行的协程，即设置thread_local局部变量t_fiber值
@@ -106,6 +211,31 @@ public:
     */
     static uint64_t GetFiberId();
 
+    /**
+     * @brief 在抢占信号处理函数里切走当前协程
+     * @details 只切走调度器中正在运行、没有持锁也不在PreemptGuard作用域内的任务协程，
+     * 被切走的协程状态变为READY并打上被抢占标志，回到调度协程由调度器重新排队。
+     * 切换发生在信号处理函数的栈帧上，协程下次resume时从信号处理函数返回，继续执行被打断的指令
+     * @attention 协程必须回到被抢占时的线程上恢复，因为被打断的代码可能缓存了线程局部变量的地址
+     * @param[in] sp 被打断时的栈指针，不在当前协程的栈上说明正处于resume/yieldTo切换的中途，不能抢占
+     * @return 当前协程不能被抢占时返回false，被抢占并恢复之后返回true
+    */
+    static bool Preempt(uintptr_t sp);
+
+private:
+    /**
+     * @brief 切换完成后清除刚切出的协程的在运行标志
+     * @details 在每次swapcontext返回之后以及新协程的入口调用，此时切出方的上下文已经保存完毕
+    */
+    static void FinishSwitch();
+
+    /**
+     * @brief 等待协程在其他线程上切出完毕
+     * @details 协程登记唤醒之后到上下文保存完之前，可能被其他线程唤醒并取出，
+     * resume前要等切出方保存完上下文，这个窗口通常只有几条指令
+    */
+    void waitSwitched();
+
 private:
     /// 协程ID
     uint64_t m_id = 0;
@@ -117,8 +247,32 @@ private:
     ucontext_t m_ctx;
     /// 协程栈地址
     void *m_stack = nullptr;
+    /// 协程栈所在的NUMA节点
+    int m_stackNode = 0;
     /// 协程入口函数
     std::function<void()> m_cb;
     /// 本协程是否参与调度器调度
     bool m_runInScheduler;
+    /// 是否已被取消
+    std::atomic<bool> m_cancelled = {false};
+    /// 取消回调的锁
+    MutexType m_cancelMutex;
+    /// 取消回调，协程挂起在hook的IO上时才有
+    std::function<void()> m_cancelCb;
+    /// 协程所属的任务组
+    TaskGroup* m_group = nullptr;
+    /// 协程所属的调度组id
+    int m_schedGroup = -1;
+    /// 截止时间(毫秒)，0表示没有
+    uint64_t m_deadline = 0;
+    /// IO事件唤醒后运行的线程，-1表示任意线程
+    int m_wakeThread = -1;
+    /// 切出时保存的禁止抢占深度，持锁或者在PreemptGuard里yield时不为0
+    int m_preemptDisable = 0;
+    /// 是否因为被抢占而回到调度协程
+    bool m_preempted = false;
+    /// 被抢占的次数
+    std::atomic<uint64_t> m_preemptCount = {0};
+    /// 是否在某个线程上运行，从切入开始到切出后上下文保存完为止
+    std::atomic<bool> m_onCpu = {false};
 };
\ No newline at end of file
@@ -0,0 +1,55 @@
+#include "FileIo.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <algorithm>
+
+FileIoPool::FileIoPool()
+    : OffloadPool(1, "file_io") {
+    Scheduler::ElasticPolicy policy;
+    policy.minThreads = 1;
+    policy.maxThreads = 16;
+    // 磁盘IO排队时马上加线程，到上限之后排队等
+    policy.growAfterMs = 0;
+    policy.retireIdleMs = 10000;
+    getScheduler()->setElastic(policy);
+}
+
+AlignedBuffer::AlignedBuffer(size_t size, size_t align)
+    : m_size(RoundUp(size, align))
+    , m_align(align) {
+    assert(align && !(align & (align - 1)));
+    int rt = posix_memalign(&m_data, align, m_size ? m_size : align);
+    assert(rt == 0);
+    (void)rt;
+}
+
+AlignedBuffer::~AlignedBuffer() {
+    free(m_data);
+}
+
+size_t AlignedBuffer::GetDirectIoAlign(int fd) {
+#ifdef STATX_DIOALIGN
+    // 6.1之后的内核直接报告O_DIRECT要求的内存和偏移对齐，不支持的文件系统不会置上这一位
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+            && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+        size_t align = std::max(stx.stx_dio_offset_align, stx.stx_dio_mem_align);
+        if (!(align & (align - 1))) {
+            return align;
+        }
+    }
+#endif
+    // st_blksize只是建议的IO大小，不是逻辑块大小；块设备可以直接问逻辑块大小
+    struct stat st;
+    int sector = 0;
+    if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)
+            && ioctl(fd, BLKSSZGET, &sector) == 0
+            && sector > 0 && !(sector & (sector - 1))) {
+        return sector;
+    }
+    return DEFAULT_ALIGN;
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include "OffloadPool.h"
+#include "singleton.h"
+#include <stddef.h>
+
+/**
+ * @brief 普通文件IO用的辅助线程池
+ * @details 普通文件的fd永远是"就绪"的，epoll帮不上忙，读写磁盘时会卡住整个工作线程。
+ * 开启BLOCKING_HOOK_FILE_IO后，hook的read/write/readv/writev/pread/pwrite/fsync
+ * 遇到普通文件时交给这个线程池执行，协程挂起到IO完成。
+ * 线程数有上限，避免磁盘慢的时候无限扩容，可以通过getScheduler()->setElastic()调整
+*/
+class FileIoPool : public OffloadPool {
+public:
+    FileIoPool();
+};
+
+using FileIoPoolMgr = Singleton<FileIoPool>;
+
+/**
+ * @brief O_DIRECT用的对齐缓冲区
+ * @details O_DIRECT要求缓冲区地址、长度和文件偏移都按设备的逻辑块大小对齐，
+ * 缓冲区长度会向上取整到对齐大小
+*/
+class AlignedBuffer {
+public:
+    /**
+     * @brief 构造函数
+     * @param[in] size 需要的长度
+     * @param[in] align 对齐大小，必须是2的幂
+    */
+    AlignedBuffer(size_t size, size_t align = DEFAULT_ALIGN);
+
+    AlignedBuffer(const AlignedBuffer&) = delete;
+
+    AlignedBuffer& operator = (const AlignedBuffer&) = delete;
+
+    ~AlignedBuffer();
+
+    /**
+     * @brief 缓冲区地址
+    */
+    void* data() const {return m_data;}
+
+    /**
+     * @brief 对齐之后的长度
+    */
+    size_t size() const {return m_size;}
+
+    /**
+     * @brief 对齐大小
+    */
+    size_t align() const {return m_align;}
+
+    /**
+     * @brief 把长度或偏移向上取整到对齐大小
+    */
+    static size_t RoundUp(size_t v, size_t align = DEFAULT_ALIGN) {
+        return (v + align - 1) & ~(align - 1);
+    }
+
+    /**
+     * @brief 获取fd做O_DIRECT需要的对齐大小
+     * @details 优先用statx的STATX_DIOALIGN，块设备用BLKSSZGET查逻辑块大小，都拿不到时返回DEFAULT_ALIGN
+    */
+    static size_t GetDirectIoAlign(int fd);
+
+public:
+    /// 默认对齐大小，覆盖常见的512和4096字节逻辑块
+    static const size_t DEFAULT_ALIGN = 4096;
+
+private:
+    /// 缓冲区地址
+    void* m_data = nullptr;
+    /// 长度
+    size_t m_size;
+    /// 对齐大小
+    size_t m_align;
+};
@@ -1,4 +1,5 @@
 #include "IOManager.h"
+#include "hook.h"
 /// epoll头文件
 #include <sys/epoll.h>
 /// pipe头文件
@@ -7,53 +8,161 @@
 #include <cstring>
 /// 文件操作头文件
 #include <fcntl.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <assert.h>
+#include <algorithm>
 
 enum EpollCtlOp {
 };
 
+/// 可以单独等待的事件
+static const IOManager::Event s_events[] = {
+    IOManager::READ, IOManager::WRITE, IOManager::PRIORITY,
+    IOManager::ERROR, IOManager::PEER_CLOSED
+};
+
+/**
+ * @brief 事件集合对应的epoll事件
+ * @details 总是关注EPOLLRDHUP，对端关闭时能记下来并且让阻塞的写马上重试
+*/
+static uint32_t epoll_events(int events) {
+    return EPOLLET | EPOLLRDHUP | events;
+}
+
 IOManager::FdContext::EventContext& IOManager::FdContext::getEventContext(IOManager::Event event) {
     switch(event) {
         case IOManager::READ:
             return read;
         case IOManager::WRITE:
             return write;
+        case IOManager::PRIORITY:
+            return priority;
+        case IOManager::ERROR:
+            return error;
+        case IOManager::PEER_CLOSED:
+            return peerClosed;
         default:
             assert(("getContext", false));
     }
     throw std::invalid_argument("getContext invalid event");
 }
 
-void IOManager::FdContext::resetEventContext(EventContext& ctx) {
-    ctx.scheduler = nullptr;
-    ctx.fiber.reset();
-    ctx.cb = nullptr;
+bool IOManager::FdContext::EventContext::contains(uint64_t id) const {
+    if (first.id == id) {
+        return !empty();
+    }
+    for (const auto& waiter : rest) {
+        if (waiter.id == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void IOManager::FdContext::EventContext::push(Waiter&& waiter) {
+    if (empty()) {
+        first = std::move(waiter);
+    } else {
+        rest.push_back(std::move(waiter));
+    }
+}
+
+bool IOManager::FdContext::EventContext::take(uint64_t id, Waiter& waiter) {
+    if (!empty() && first.id == id) {
+        waiter = std::move(first);
+        first = Waiter();
+        // 后面的等待者顶上来
+        if (!rest.empty()) {
+            first = std::move(rest.front());
+            rest.erase(rest.begin());
+        }
+        return true;
+    }
+    for (auto it = rest.begin(); it != rest.end(); ++it) {
+        if (it->id == id) {
+            waiter = std::move(*it);
+            rest.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t IOManager::FdContext::resetEventContext(EventContext& ctx) {
+    size_t count = ctx.size();
+    ctx.first = Waiter();
+    ctx.rest.clear();
+    return count;
+}
+
+void IOManager::FdContext::wakeWaiter(Waiter& waiter, Scheduler::Priority priority) {
+    if (waiter.cb) {
+        waiter.scheduler->schedule(&waiter.cb, -1, priority);
+    } else {
+        int thread = waiter.fiber->getWakeThread();
+        waiter.scheduler->schedule(&waiter.fiber, thread, priority);
+    }
+    waiter.scheduler = nullptr;
 }
 
-void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+size_t IOManager::FdContext::triggerEvent(IOManager::Event event, Scheduler::Priority priority, bool all) {
     // Fd上下文必须有注册该事件
     assert(events & event);
 
-    events = (Event)(events & ~event);
     EventContext& ctx = getEventContext(event);
-    if (ctx.cb) {
-        ctx.scheduler->schedule(&ctx.cb);
-    } else {
-        ctx.scheduler->schedule(&ctx.fiber);
+    bool woke_one = false;
+    auto should_wake = [all, &woke_one](const Waiter& waiter) {
+        if (all || waiter.mode == WAKE_ALL) {
+            return true;
+        }
+        if (!woke_one) {
+            woke_one = true;
+            return true;
+        }
+        return false;
+    };
+    size_t woken = 0;
+    if (should_wake(ctx.first)) {
+        wakeWaiter(ctx.first, priority);
+        ++woken;
     }
-
-    ctx.scheduler = nullptr;
-    return;
+    // 留下来的等待者原地前移，保持注册顺序
+    size_t kept = 0;
+    for (size_t i = 0; i < ctx.rest.size(); ++i) {
+        if (should_wake(ctx.rest[i])) {
+            wakeWaiter(ctx.rest[i], priority);
+            ++woken;
+        } else {
+            if (kept != i) {
+                ctx.rest[kept] = std::move(ctx.rest[i]);
+            }
+            ++kept;
+        }
+    }
+    ctx.rest.resize(kept);
+    if (ctx.empty() && !ctx.rest.empty()) {
+        ctx.first = std::move(ctx.rest.front());
+        ctx.rest.erase(ctx.rest.begin());
+    }
+    if (ctx.empty()) {
+        events = (Event)(events & ~event);
+    }
+    return woken;
 }
 
-IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
-    : Scheduler(threads, use_caller, name) {
+IOManager::IOManager(size_t threads, bool use_caller, const std::string &name,
+                     const AffinityPolicy& affinity)
+    : Scheduler(threads, use_caller, name, affinity) {
     // 创建epoll实例
     m_epfd = epoll_create(5000);
     assert(m_epfd > 0);
 
     // 创建pipe，获取m_tickleFds[2]，其中0是读端，1是写端
-    int rt = pipe(m_tickleFds);
+    // 直接调用原生函数，hook的pipe会把两端登记进FdMgr，写端满了时tickle会把协程挂在调度器自己的管道上。
+    // 两端都是非阻塞的，读端配合边缘触发要循环读完，写端满了说明已经有没读走的通知，不用再写
+    int rt = pipe2_f(m_tickleFds, O_NONBLOCK | O_CLOEXEC);
     assert(!rt);
 
     // 注册pipe读端的可读事件，用于tickle调度协程，通过epool_event.data.fd保存描述符
@@ -62,17 +171,15 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
     event.events = EPOLLIN | EPOLLOUT;
     event.data.fd = m_tickleFds[0];
 
-    // 非阻塞方式，配合边缘触发，因为边缘触发必须要循环读取
-    // 这就意味着，在循环中不应该阻塞，那就必须使用非阻塞方式
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    assert(!rt);
-
     // 将管道的读描述符加入epoll多路复用，如果管道可读，idle中的epoll_wait会返回
     rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
     assert(!rt);
 
     contextResize(32);
 
+    // 自旋的线程会占住一个CPU，最多让一半的CPU用来自旋，单核机器上自旋只会拖慢别的线程
+    m_maxSpinningThreads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+
     // 开启调度器
     start();
 }
@@ -87,8 +194,76 @@ void IOManager::tickle() {
     if (!hasIdleThreads()) {
         return;
     }
-    int rt = write(m_tickleFds[1], "T", 1);
-    assert(rt == 1);
+    // 有idle线程正在自旋，它马上就能看到新任务，不用写pipe
+    if (m_spinningThreadCount > 0) {
+        ++m_tickleSkipCount;
+        return;
+    }
+    int rt = write_f(m_tickleFds[1], "T", 1);
+    assert(rt == 1 || errno == EAGAIN);
+    (void)rt;
+    ++m_tickleWriteCount;
+}
+
+void IOManager::tickleAll() {
+    for (size_t i = getIdleThreadCount(); i > 0; --i) {
+        int rt = write_f(m_tickleFds[1], "T", 1);
+        assert(rt == 1 || errno == EAGAIN);
+        (void)rt;
+        ++m_tickleWriteCount;
+    }
+}
+
+/**
+ * @brief 在自旋窗口内轮询任务队列和epoll
+ * @details 自旋期间计入m_spinningThreadCount，tickle看到后不会写pipe，
+ * 所以退出自旋之后要再检查一次任务队列；窗口根据本次是否等到工作自适应调整
+*/
+int IOManager::spinWait(epoll_event* events, int max_events) {
+    uint64_t window = m_spinWindowUs;
+    uint64_t start = GetCurrentUS();
+    int rt = 0;
+    ++m_spinningThreadCount;
+    while (!hasPendingTasks()) {
+        rt = epoll_wait_f(m_epfd, events, max_events, 0);
+        if (rt > 0 || GetCurrentUS() - start >= window) {
+            break;
+        }
+    }
+    --m_spinningThreadCount;
+    rt = std::max(rt, 0);
+    bool hit = rt > 0 || hasPendingTasks();
+
+    ++m_spinCount;
+    m_spinTimeUs += GetCurrentUS() - start;
+    if (hit) {
+        ++m_spinHitCount;
+        window = std::min<uint64_t>(std::max<uint64_t>(window * 2, 1), m_maxSpinUs);
+    } else {
+        window = std::max<uint64_t>(window / 2, m_minSpinUs);
+    }
+    m_spinWindowUs = window;
+    return rt;
+}
+
+void IOManager::setSpinPolicy(uint64_t min_us, uint64_t max_us, size_t max_spinning) {
+    min_us = std::min(min_us, max_us);
+    m_maxSpinningThreads = max_spinning;
+    m_minSpinUs = min_us;
+    m_maxSpinUs = max_us;
+    m_spinWindowUs = std::min(std::max<uint64_t>(m_spinWindowUs, min_us), max_us);
+}
+
+IOManager::SpinStats IOManager::getSpinStats() const {
+    SpinStats stats;
+    stats.spins = m_spinCount;
+    stats.hits = m_spinHitCount;
+    stats.spinTimeUs = m_spinTimeUs;
+    stats.blockingWaits = m_blockingWaitCount;
+    stats.tickleSkipped = m_tickleSkipCount;
+    stats.tickleWritten = m_tickleWriteCount;
+    stats.windowUs = m_spinWindowUs;
+    return stats;
 }
 
 /**
@@ -106,17 +281,37 @@ void IOManager::idle() {
     std::shared_ptr<epoll_event> shared_events(events, [](epoll_event *ptr) {
         delete[] ptr;
     });
+    // idle协程不是普通任务，不能被抢占后排进任务队列
+    PreemptGuard guard;
+    // 上一轮是否处理了工作，刚处理完工作的线程很可能马上又有工作，值得先自旋一会
+    bool worked = true;
     while (true) {
         // 获取下一个定时器超时时间，顺便判断调度器是否停止
         uint64_t next_timeout = 0;
-        if (stopping(next_timeout)) {
+        if (stopping(next_timeout) || shouldRetire()) {
             // std::cout << "name=" << getName() << "idle stopping exit" << std::endl;
             break;
         }
 
         int rt = 0;
-        do {
-            // 阻塞在epoll_wait上，等到事件发生
+        bool ready = false;
+        // 已经有定时器到期就不用自旋了，自旋的线程已经够多也不再自旋
+        if (worked && next_timeout != 0 && m_maxSpinUs > 0
+                && m_spinningThreadCount < m_maxSpinningThreads) {
+            rt = spinWait(events, MAX_EVENTS);
+            ready = rt > 0 || hasPendingTasks();
+            if (!ready) {
+                // 自旋期间插入的定时器不会tickle本线程，重新取一次超时时间
+                next_timeout = getNextTimer();
+            }
+        }
+        if (!ready) {
+            // 有调度组被限流时最多睡到它恢复，之后重新去取它的任务
+            next_timeout = std::min(next_timeout, getThrottleTimeout());
+        }
+        while (!ready) {
+            ++m_blockingWaitCount;
+            // 阻塞在epoll_wait上，等到事件发生；hook的epoll_wait会挂起协程，调度器自己要用原生的
             static const int MAX_TIMEOUT = 5000;
             // 还有定时器，那么距离下一次超时的时间就是min(最大超时时间，当前时间距离首个定时器的时间间隔)
             if (next_timeout != ~0ull) {
@@ -126,85 +321,17 @@ void IOManager::idle() {
             } else {
                 next_timeout = MAX_TIMEOUT;
             }
-            rt = epoll_wait(m_epfd, events, MAX_EVENTS, (int)next_timeout);
+            rt = epoll_wait_f(m_epfd, events, MAX_EVENTS, (int)next_timeout);
             if (rt < 0 && errno == EINTR) {
                 continue;
             } else {
                 break;
             }
-        } while (true);
-
-        // 收集所有的已超时定时器，执行回调函数
-        std::vector<std::function<void()>> cbs;
-        // 这是TimerManager执行并检查超时的唯一机会
-        listExpiredCb(cbs);
-        if (!cbs.empty()) {
-            for (const auto& cb: cbs) {
-                schedule(cb);
-            }
-            cbs.clear();
         }
 
-        // 遍历发生事件，根据epoll_event.data.ptr找到对应的FdContext，进行事件处理
-        for (int i = 0; i < rt; ++i) {
-            epoll_event &event = events[i];
-            if (event.data.fd == m_tickleFds[0]) {
-                // 管道读端用于通知协程调度，这时只需要把管道里的内容读完即可
-                // 本轮idle结束之后，调度器的run方法会重新执行协程调度
-                uint8_t dummy[256];
-                while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
-                continue;
-            }
-            // 通过epoll_event的数据指针获取FdContext
-            FdContext *fd_ctx = (FdContext *)event.data.ptr;
-            // 锁住这个fd上下文
-            FdContext::MutexType::Lock lock(fd_ctx->mutex);
-            /**
-             * EPOLLERR: 出错，比如写读端已关闭的pipe
-             * EPOLLHUP：套接字对端关闭
-             * 出现此两种情况，应该同时触发fd的读和写事件，否则有可能出现注册的事件永远执行不到的情况
-             * 所以还要和注册事件做一个&，也就是在这两种情况下，文件上下文注册的读/写事件总会被触发
-            */
-            if (event.events & (EPOLLERR | EPOLLHUP)) {
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
-            }
-            int real_events = NONE;
-            if (event.events & EPOLLIN) {
-                real_events |= READ;
-            }
-            if (event.events & EPOLLOUT) {
-                real_events |= WRITE;
-            }
-            // 如果实际收到的事件和等待事件完全不一样，就找下一个就绪socket
-            if ((fd_ctx->events & real_events) == NONE) {
-                continue;
-            }
+        bool expired = handleEvents(events, rt);
+        worked = ready || rt > 0 || expired;
 
-            // 剔除已经发生的事件，将剩下的事件重新加入epoll_wait，
-            // 如果剩下的事件为0，表示这个fd已经不需要关注了，直接从epoll中删除
-            int left_events = (fd_ctx->events & ~real_events);
-            int op = left_events ? EPOLL_CTL_MOD: EPOLL_CTL_DEL;
-            // 使用ET边缘触发模式，由于fd上下文只有读/写事件，要额外加上ET标志
-            event.events = EPOLLET | left_events;
-
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if (rt2) {
-                std::cerr << "epoll_ctl(" << m_epfd << ", "
-                          << (EpollCtlOp)op << ", " << fd_ctx->fd << ", "
-                          << (EPOLL_EVENTS)event.events << "):" << rt2
-                          << " (" << errno << ") (" << strerror(errno) << ")";
-                continue;
-            }
-            // 处理已经发生的事件
-            if (real_events & READ) {
-                fd_ctx->triggerEvent(READ);
-                --m_pendingEventCount;
-            }
-            if (real_events & WRITE) {
-                fd_ctx->triggerEvent(WRITE);
-                --m_pendingEventCount;
-            }
-        }
         /**
          * 一旦处理完毕所有事件，idle协程yield，这样可以让调度协程调用Scheduler::run方法
          * 重新检查是否有新任务要调度，triggerEvent本质上是把任务协程加入调度，要执行的话需要等idle退出。
@@ -217,6 +344,113 @@ void IOManager::idle() {
     }
 }
 
+/**
+ * @brief 报告EPOLLERR时socket本身是不是出错了
+ * @details 错误队列里有通知(比如MSG_ZEROCOPY的完成通知)时也会报告EPOLLERR。SO_ERROR读一次就清掉了，
+ * 被唤醒的读写方重试时就拿不到真正的错误码，所以TCP看连接状态，被重置或者超时的连接状态是CLOSE。
+ * 其他socket区分不出来，按出错处理
+*/
+static bool IsSocketFailed(int fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt_f(fd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+        return true;
+    }
+    return info.tcpi_state == TCP_CLOSE;
+}
+
+bool IOManager::handleEvents(epoll_event* events, int rt) {
+    // 收集所有的已超时定时器，执行回调函数
+    std::vector<std::function<void()>> cbs;
+    // 定时器只在idle和poll里检查超时
+    listExpiredCb(cbs);
+    bool expired = !cbs.empty();
+    if (expired) {
+        for (const auto& cb: cbs) {
+            schedule(cb);
+        }
+        cbs.clear();
+    }
+
+    // 遍历发生事件，根据epoll_event.data.ptr找到对应的FdContext，进行事件处理
+    for (int i = 0; i < rt; ++i) {
+        epoll_event &event = events[i];
+        if (event.data.fd == m_tickleFds[0]) {
+            // 管道读端用于通知协程调度，这时只需要把管道里的内容读完即可
+            // 本轮idle结束之后，调度器的run方法会重新执行协程调度
+            uint8_t dummy[256];
+            while (read_f(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
+            continue;
+        }
+        // 通过epoll_event的数据指针获取FdContext
+        FdContext *fd_ctx = (FdContext *)event.data.ptr;
+        // 锁住这个fd上下文
+        FdContext::MutexType::Lock lock(fd_ctx->mutex);
+        /**
+         * EPOLLERR: 出错，比如写读端已关闭的pipe
+         * EPOLLHUP：套接字对端关闭
+         * 出现此两种情况，应该同时触发fd上注册的所有事件，否则有可能出现注册的事件永远执行不到的情况，
+         * 所有等待者都会读到结果，全部唤醒。有ERROR等待者时EPOLLERR可能只是错误队列里有通知，
+         * 这时socket本身没出错的话只唤醒ERROR等待者
+        */
+        // Event的取值就是epoll的事件位
+        int real_events = event.events & (READ | WRITE | PRIORITY | ERROR | PEER_CLOSED);
+        // 这些事件不管唤醒方式唤醒全部等待者
+        int all_events = ERROR | PEER_CLOSED;
+        if ((event.events & EPOLLHUP)
+                || ((event.events & EPOLLERR)
+                    && (!(fd_ctx->events & ERROR) || IsSocketFailed(fd_ctx->fd)))) {
+            real_events |= fd_ctx->events;
+            all_events = fd_ctx->events;
+        }
+        if (event.events & (EPOLLRDHUP | EPOLLHUP)) {
+            // 第一次发现对端关闭时唤醒阻塞的写，对端已经不在的话重试马上拿到EPIPE/ECONNRESET，
+            // 只是半关闭的话重试还是EAGAIN，继续等；之后MOD重新报告的EPOLLRDHUP不再唤醒写
+            if (!fd_ctx->peerGone) {
+                fd_ctx->peerGone = true;
+                real_events |= WRITE;
+                all_events |= WRITE;
+            }
+        }
+        real_events &= fd_ctx->events;
+        // 如果实际收到的事件和等待事件完全不一样，就找下一个就绪socket
+        if (real_events == NONE) {
+            continue;
+        }
+
+        // 处理已经发生的事件，WAKE_ONE的等待者每次只唤醒一个，其余的留在事件上
+        for (Event ev : s_events) {
+            if (real_events & ev) {
+                m_pendingEventCount -= fd_ctx->triggerEvent(ev, m_eventPriority, all_events & ev);
+            }
+        }
+
+        // 剩下的事件重新加入epoll_wait，如果剩下的事件为0，表示这个fd已经不需要关注了，直接从epoll中删除。
+        // 边缘触发下MOD会重新检查一次就绪状态，还没读完的话留下的等待者下一轮会被唤醒，不会丢失唤醒
+        int left_events = fd_ctx->events;
+        int op = left_events ? EPOLL_CTL_MOD: EPOLL_CTL_DEL;
+        // 使用ET边缘触发模式
+        event.events = epoll_events(left_events);
+
+        int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+        if (rt2) {
+            std::cerr << "epoll_ctl(" << m_epfd << ", "
+                      << (EpollCtlOp)op << ", " << fd_ctx->fd << ", "
+                      << (EPOLL_EVENTS)event.events << "):" << rt2
+                      << " (" << errno << ") (" << strerror(errno) << ")";
+        }
+    }
+    return expired;
+}
+
+void IOManager::poll() {
+    // 只是插空处理一下，不阻塞，事件多的话剩下的留给idle
+    const int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    int rt = epoll_wait_f(m_epfd, events, MAX_EVENTS, 0);
+    handleEvents(events, rt > 0 ? rt : 0);
+}
+
 void IOManager::contextResize (size_t size) {
     m_fdContexts.resize(size);
 
@@ -234,9 +468,11 @@ void IOManager::contextResize (size_t size) {
  * @param[in] fd socket句柄
  * @param[in] event 事件类型
  * @param[in] cb 事件回调函数，如果空，则默认将当前协程当前回调执行体
+ * @param[in] mode 唤醒方式
+ * @param[out] id 等待者编号
  * @return 添加成功返回0，否则返回-1
 */
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
+int IOManager::addEvent(int fd, Event event, std::function<void()> cb, WakeMode mode, uint64_t* id) {
     // 找到fd对应的FdContext，如果不存在，那就分配一个
     FdContext* fd_ctx = nullptr;
     // 防止并发修改m_fdContexts，但允许并发读取
@@ -254,18 +490,13 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         fd_ctx = m_fdContexts[fd];
     }
 
-    // 同一个fd不允许重复添加相同的事件，只锁fd上下文
+    // 只锁fd上下文，同一个事件可以有多个等待者
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (fd_ctx->events & event) {
-        std::cerr << "addEvent assert fd=" << fd
-        << " event=" << (EPOLL_EVENTS)event
-        << " fd_ctx.event=" << (EPOLL_EVENTS)fd_ctx->events;
-        assert(!(fd_ctx->events & event));
-    }
-    // 将新的事件加入epoll_wait，使用epoll_event的私有指针储存FdContext的位置
+    // 将新的事件加入epoll_wait，使用epoll_event的私有指针储存FdContext的位置。
+    // 事件已经注册过也MOD一次，让内核重新检查就绪状态
     int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     epoll_event epevent;
-    epevent.events = EPOLLET | fd_ctx->events | event;
+    epevent.events = epoll_events(fd_ctx->events | event);
     epevent.data.ptr = fd_ctx;
 
     int rt = epoll_ctl(m_epfd, op, fd, &epevent);
@@ -282,20 +513,23 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
     // 待执行IO事件数+1
     ++m_pendingEventCount;
 
-    // 找到这个fd的event事件对应的EventContext，对其中的scheduler, cb, fiber进行赋值
-    fd_ctx->events = (Event)(fd_ctx->events | event);
-    FdContext::EventContext &event_ctx = fd_ctx->getEventContext(event);
-    assert(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
-
     // 赋值scheduler和回调函数，如果回调函数为空，则把当前协程当成回调执行体
-    event_ctx.scheduler = Scheduler::GetThis();
+    fd_ctx->events = (Event)(fd_ctx->events | event);
+    FdContext::Waiter waiter;
+    waiter.scheduler = Scheduler::GetThis();
+    waiter.mode = mode;
+    waiter.id = ++m_nextWaiterId;
+    if (id) {
+        *id = waiter.id;
+    }
     if (cb) {
-        event_ctx.cb.swap(cb);
+        waiter.cb.swap(cb);
     } else {
-        event_ctx.fiber = Fiber::GetThis();
+        waiter.fiber = Fiber::GetThis();
         // 当前协程必须正在运行
-        assert(("state=" + event_ctx.fiber->getState(), event_ctx.fiber->getState() == Fiber::RUNNING));
+        assert(("state=" + waiter.fiber->getState(), waiter.fiber->getState() == Fiber::RUNNING));
     }
+    fd_ctx->getEventContext(event).push(std::move(waiter));
     return 0;
 }
 
@@ -303,52 +537,26 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
  * @brief 删除事件
  * @param[in] fd socket 句柄
  * @param[in] event 事件类型
+ * @param[in] id 等待者编号，为0时删除全部等待者
  * @attention 不会触发任何事件
 */
-bool IOManager::delEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
-        return false;
-    }
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!(fd_ctx->events & event)) {
-        return false;
-    }
-
-    Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        std::cerr << "epoll_ctl(" << m_epfd << ", "
-        << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
-        << rt << " (" << errno << ") (" << strerror(errno) << ")";
-        return false;
-    }
-
-    --m_pendingEventCount;
-    // fd上下文中不再含有该事件
-    fd_ctx->events = new_events;
-    // 同时将fd上下文中对应的event上下文也删除
-    FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
-    fd_ctx->resetEventContext(event_ctx);
-    return true;
+bool IOManager::delEvent(int fd, Event event, uint64_t id) {
+    return removeEvent(fd, event, id, false);
 }
 
 /**
 * @brief 取消事件
 * @param[in] fd socket句柄
 * @param[in] event 事件类型
+* @param[in] id 等待者编号，为0时取消全部等待者
 * @attention 如果该事件被注册过回调，那就触发⼀次回调事件
 * @return 是否取消成功
 */
-bool IOManager::cancelEvent(int fd, Event event) {
+bool IOManager::cancelEvent(int fd, Event event, uint64_t id) {
+    return removeEvent(fd, event, id, true);
+}
+
+bool IOManager::removeEvent(int fd, Event event, uint64_t id, bool wake) {
     // 找到fd对应的FdContext
     RWMutexType::ReadLock lock(m_mutex);
     // 如果fd超出范围，直接返回false
@@ -363,27 +571,49 @@ bool IOManager::cancelEvent(int fd, Event event) {
     if (!(fd_ctx->events & event)) {
         return false;
     }
+    FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
+    if (id && !event_ctx.contains(id)) {
+        return false;
+    }
 
-    // 删除事件
-    Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
+    // 删掉的是最后的等待者时才从epoll里删除事件
+    if (!id || event_ctx.size() == 1) {
+        Event new_events = (Event)(fd_ctx->events & ~event);
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = epoll_events(new_events);
+        epevent.data.ptr = fd_ctx;
+
+        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        if (rt) {
+            std::cerr << "epoll_ctl(" << m_epfd << ", "
+            << (EpollCtlOp)op << ", " << fd << ", " <<
+            (EPOLL_EVENTS)epevent.events << "):"
+            << rt << " (" << errno << ") (" << strerror(errno) <<
+            ")";
+            return false;
+        }
+    }
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if (rt) {
-        std::cerr << "epoll_ctl(" << m_epfd << ", "
-        << (EpollCtlOp)op << ", " << fd << ", " <<
-        (EPOLL_EVENTS)epevent.events << "):"
-        << rt << " (" << errno << ") (" << strerror(errno) <<
-        ")";
-        return false;
+    if (!id) {
+        // 活跃事件数减去等待者数
+        if (wake) {
+            m_pendingEventCount -= fd_ctx->triggerEvent(event, m_eventPriority, true);
+        } else {
+            m_pendingEventCount -= fd_ctx->resetEventContext(event_ctx);
+            fd_ctx->events = (Event)(fd_ctx->events & ~event);
+        }
+        return true;
     }
 
-    // 删除之前触发一次事件
-    fd_ctx->triggerEvent(event);
-    // 活跃事件数-1
+    FdContext::Waiter waiter;
+    event_ctx.take(id, waiter);
+    if (event_ctx.empty()) {
+        fd_ctx->events = (Event)(fd_ctx->events & ~event);
+    }
+    if (wake) {
+        FdContext::wakeWaiter(waiter, m_eventPriority);
+    }
     --m_pendingEventCount;
     return true;
 }
@@ -398,6 +628,8 @@ bool IOManager::cancelAll(int fd) {
     lock.unlock();
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    // fd要关闭了，句柄复用之后是新的连接
+    fd_ctx->peerGone = false;
     // 没有事件则返回false
     if (!fd_ctx->events) {
         return false;
@@ -421,24 +653,33 @@ bool IOManager::cancelAll(int fd) {
     }
 
     // 触发该fd上下文全部已注册事件
-    if (fd_ctx->events & READ) {
-        fd_ctx->triggerEvent(READ);
-        --m_pendingEventCount;
-    }
-    if (fd_ctx->events & WRITE) {
-        fd_ctx->triggerEvent(WRITE);
-        --m_pendingEventCount;
+    for (Event ev : s_events) {
+        if (fd_ctx->events & ev) {
+            m_pendingEventCount -= fd_ctx->triggerEvent(ev, m_eventPriority, true);
+        }
     }
 
     assert(fd_ctx->events == 0);
     return true;
 }
 
+bool IOManager::isPeerClosed(int fd) {
+    RWMutexType::ReadLock lock(m_mutex);
+    if ((int)m_fdContexts.size() <= fd) {
+        return false;
+    }
+    FdContext *fd_ctx = m_fdContexts[fd];
+    lock.unlock();
+
+    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
+    return fd_ctx->peerGone;
+}
+
 IOManager::~IOManager() {
     stop();
     close(m_epfd);
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
+    close_f(m_tickleFds[0]);
+    close_f(m_tickleFds[1]);
 
     for (size_t i = 0; i < m_fdContexts.size(); ++i) {
         if (m_fdContexts[i]) {
@@ -2,6 +2,7 @@
 #include "Scheduler.h"
 #include "Timer.h"
 #include "mutex.h"
+#include <sys/epoll.h>
 #include <memory>
 #include <functional>
 #include <atomic>
@@ -14,15 +15,53 @@ public:
     using RWMutexType = RWMutex;
     /**
      * @brief IO事件，继承自epoll对事件的定义
-     * @details 这里只关心socket fd的读写事件，为简化状态转移，其他事件归类到这两种事件中
+     * @details 挂断(EPOLLHUP)不单独等待，所有等待者都会被唤醒
     */
     enum Event {
         /// 无事件
         NONE = 0x0,
         /// 读事件(EPOLLIN)
         READ = 0x1,
+        /// 带外数据(EPOLLPRI)
+        PRIORITY = 0x2,
         /// 写事件(EPOLLOUT)
         WRITE = 0x4,
+        /// 出错或者错误队列里有通知(EPOLLERR)，比如MSG_ZEROCOPY的完成通知。
+        /// 有ERROR等待者而且socket本身没出错时EPOLLERR只唤醒它们，否则和挂断一样唤醒所有等待者
+        ERROR = 0x8,
+        /// 对端关闭或者关闭了写(EPOLLRDHUP)，可以用来不发系统调用发现空闲连接已经断开
+        PEER_CLOSED = 0x2000,
+    };
+
+    /**
+     * @brief 同一个事件上有多个等待者时，事件就绪唤醒谁
+    */
+    enum WakeMode {
+        /// 按注册顺序只唤醒一个，其余的等下一次就绪，适合抢着读同一个fd的协程
+        WAKE_ONE = 0,
+        /// 每次就绪都唤醒，适合poll这种只观察就绪状态的等待者
+        WAKE_ALL = 1,
+    };
+
+    /**
+     * @brief idle协程自旋等待的统计
+     * @details 用来权衡自旋消耗的CPU和唤醒延迟
+    */
+    struct SpinStats {
+        /// 自旋次数
+        uint64_t spins = 0;
+        /// 自旋期间等到任务或IO事件的次数
+        uint64_t hits = 0;
+        /// 自旋累计耗时(微秒)
+        uint64_t spinTimeUs = 0;
+        /// 阻塞在epoll_wait上的次数
+        uint64_t blockingWaits = 0;
+        /// 因为有线程在自旋而省掉pipe写的tickle次数
+        uint64_t tickleSkipped = 0;
+        /// 写pipe的tickle次数
+        uint64_t tickleWritten = 0;
+        /// 当前的自旋窗口(微秒)
+        uint64_t windowUs = 0;
     };
 private:
     /**
@@ -32,16 +71,58 @@ private:
     struct FdContext {
         using MutexType = Mutex;
         /**
-         * @brief 事件上下文类
-         * @details fd的每个事件都有一个事件上下文，保存这个事件的回调函数以及执行回调函数的调度器
+         * @brief 事件的一个等待者
         */
-        struct EventContext {
-            /// 执行事件回调的调度器
+        struct Waiter {
+            /// 执行事件回调的调度器，为空表示没有等待者
             Scheduler *scheduler = nullptr;
             /// 事件回调协程
             Fiber::ptr fiber;
             /// 事件回调函数
             std::function<void()> cb;
+            /// 唤醒方式
+            WakeMode mode = WAKE_ONE;
+            /// 等待者编号，用来单独删除或取消
+            uint64_t id = 0;
+        };
+
+        /**
+         * @brief 事件上下文类
+         * @details fd的每个事件都有一个事件上下文，保存等待这个事件的协程或回调。
+         * 第一个等待者直接放在上下文里，只有一个等待者时不用分配内存，其余的按注册顺序放在rest里
+        */
+        struct EventContext {
+            /// 第一个等待者
+            Waiter first;
+            /// 其余的等待者
+            std::vector<Waiter> rest;
+
+            /**
+             * @brief 是否没有等待者
+            */
+            bool empty() const {return !first.scheduler;}
+
+            /**
+             * @brief 等待者数量
+            */
+            size_t size() const {return empty() ? 0 : 1 + rest.size();}
+
+            /**
+             * @brief 是否有编号为id的等待者
+            */
+            bool contains(uint64_t id) const;
+
+            /**
+             * @brief 在末尾加入一个等待者
+            */
+            void push(Waiter&& waiter);
+
+            /**
+             * @brief 摘下编号为id的等待者
+             * @param[out] waiter 摘下的等待者
+             * @return 有没有这个等待者
+            */
+            bool take(uint64_t id, Waiter& waiter);
         };
 
         /**
@@ -52,22 +133,40 @@ private:
         EventContext &getEventContext(Event event);
 
         /**
-         * @brief 重置事件上下文
+         * @brief 重置事件上下文，删除全部等待者
          * @param[in, out] ctx 待重置的事件上下文对象
+         * @return 删除的等待者数量
         */
-        void resetEventContext(EventContext &ctx);
+        size_t resetEventContext(EventContext &ctx);
 
         /**
          * @brief 触发事件
-         * @details 根据事件类型调用上下文结构中的调度器去调度回调协程或回调函数
+         * @details 根据等待者的唤醒方式调度回调协程或回调函数：WAKE_ALL的都唤醒，
+         * WAKE_ONE的只唤醒最早注册的一个。没有等待者之后从events里去掉这个事件
          * @param[in] event 事件类型
+         * @param[in] priority 回调任务的优先级
+         * @param[in] all 是否不管唤醒方式唤醒全部等待者，出错、对端关闭和取消时使用
+         * @return 唤醒的等待者数量
+        */
+        size_t triggerEvent(Event event, Scheduler::Priority priority, bool all);
+
+        /**
+         * @brief 调度一个等待者并清空它
         */
-        void triggerEvent(Event event);
+        static void wakeWaiter(Waiter& waiter, Scheduler::Priority priority);
 
         /// 读事件上下文
         EventContext read;
         /// 写事件上下文
         EventContext write;
+        /// 带外数据事件上下文
+        EventContext priority;
+        /// 出错事件上下文
+        EventContext error;
+        /// 对端关闭事件上下文
+        EventContext peerClosed;
+        /// 是否已经收到过对端关闭，fd关闭时由cancelAll清除
+        bool peerGone = false;
         /// 事件关联的句柄
         int fd = 0;
         /// 该fd添加了哪些事件的回调函数，或者说该fd关心哪些事件
@@ -81,8 +180,10 @@ public:
      * @param[in] threads 线程数量
      * @param[in] use_caller caller线程是否参与调度
      * @param[in] name 调度器的名称
+     * @param[in] affinity 工作线程的CPU亲和性策略
     */
-    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "");
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "",
+              const AffinityPolicy& affinity = AffinityPolicy());
 
     /**
      * @brief 析构函数
@@ -91,44 +192,85 @@ public:
 
     /**
      * @brief 添加事件
+     * @details 同一个fd的同一个事件可以有多个等待者，就绪时按各自的唤醒方式唤醒
      * @param[in] fd socket 句柄
      * @param[in] event 事件类型
      * @param[in] cb 事件回调函数
+     * @param[in] mode 唤醒方式
+     * @param[out] id 不为空时返回等待者编号，用于delEvent/cancelEvent只处理这一个等待者
      * @return 添加成功返回0，否则返回-1
     */
-    int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+    int addEvent(int fd, Event event, std::function<void()> cb = nullptr,
+                 WakeMode mode = WAKE_ONE, uint64_t* id = nullptr);
 
     /**
      * @brief 删除事件
      * @param[in] fd socket 句柄
      * @param[in] event 事件类型
+     * @param[in] id 等待者编号，为0时删除这个事件的全部等待者
      * @attention 不会触发任何事件
     */
-    bool delEvent(int fd, Event event);
+    bool delEvent(int fd, Event event, uint64_t id = 0);
 
     /**
      * @brief 取消事件
      * @param[in] fd socket 句柄
      * @param[in] event 事件类型
+     * @param[in] id 等待者编号，为0时取消这个事件的全部等待者
      * @attention 如果事件存在则触发事件
     */
-    bool cancelEvent(int fd, Event event); 
+    bool cancelEvent(int fd, Event event, uint64_t id = 0); 
 
     /**
      * @brief 取消所有事件
+     * @details 同时清除对端关闭的标记，fd关闭前要调用一次
      * @param[in] fd socket 句柄
      * @result 是否取消成功
     */
     bool cancelAll(int fd);   
 
+    /**
+     * @brief 不发系统调用判断对端是否已经关闭
+     * @details 只有fd在epoll里的时候收到EPOLLRDHUP或EPOLLHUP才会被记下来，
+     * 所以空闲连接要一直挂着一个PEER_CLOSED等待者才能及时知道
+    */
+    bool isPeerClosed(int fd);
+
+    /**
+     * @brief 设置idle协程的自旋窗口范围
+     * @details 刚处理完任务的idle协程先在窗口时间内轮询任务队列和epoll_wait(..., 0)，
+     * 等不到再阻塞在epoll_wait上。窗口在范围内自适应：自旋等到工作时加倍，否则减半
+     * @param[in] min_us 最小窗口(微秒)
+     * @param[in] max_us 最大窗口(微秒)，为0表示关闭自旋
+     * @param[in] max_spinning 同时自旋的线程数上限，默认是在线CPU数的一半，单核机器上不自旋
+    */
+    void setSpinPolicy(uint64_t min_us, uint64_t max_us, size_t max_spinning);
+
+    /**
+     * @brief 获取idle协程自旋等待的统计
+    */
+    SpinStats getSpinStats() const;
+
+    /**
+     * @brief 设置IO事件触发(包括被cancelEvent/cancelAll提前触发)时回调任务的优先级，默认为高优先级
+    */
+    void setEventPriority(Priority priority) {m_eventPriority = priority;}
+
     /**
      * @brief 返回当前的IOManager
     */
     static IOManager* GetThis();
 private:
     void tickle() override;
+
+    /**
+     * @brief 每个idle线程写一个字节，pipe的每次写入都会唤醒一个epoll_wait上的线程
+    */
+    void tickleAll() override;
+
     bool stopping() override;
     void idle() override;
+    void poll() override;
     void onTimerInsertedAtFront() override;
 
     /**
@@ -136,21 +278,70 @@ private:
      * @param[in] size 容量大小
     */
     void contextResize(size_t size);
+    /**
+     * @brief 删除或取消事件的等待者，见delEvent/cancelEvent
+     * @param[in] wake 是否触发被删除的等待者
+    */
+    bool removeEvent(int fd, Event event, uint64_t id, bool wake);
+
     /**
      * @brief 判断是否可以停止
      * @param[out] timeout 最近要出发的定时器事件间隔
      * @return 返回是否可以停止
      */
     bool stopping(uint64_t& timeout);
+
+    /**
+     * @brief 在自旋窗口内轮询任务队列和epoll
+     * @param[out] events epoll_wait的事件数组
+     * @param[in] max_events 事件数组大小
+     * @return epoll_wait返回的事件数，等到的是新任务时返回0
+    */
+    int spinWait(epoll_event* events, int max_events);
+
+    /**
+     * @brief 执行到期的定时器，分发epoll_wait返回的就绪事件
+     * @param[in] events epoll_wait的事件数组
+     * @param[in] rt 就绪事件数
+     * @return 是否有定时器到期
+    */
+    bool handleEvents(epoll_event* events, int rt);
 private:
     /// epoll文件句柄
     int m_epfd = 0;
     /// pipe文件句柄，fd[0]读端，fd[1]写端
     int m_tickleFds[2];
-    /// 当前等待执行的IO事件数量
+    /// 当前等待执行的IO事件数量，每个等待者算一个
     std::atomic<size_t> m_pendingEventCount = {0};
+    /// 下一个等待者编号
+    std::atomic<uint64_t> m_nextWaiterId = {0};
     /// IOManager的锁
     RWMutexType m_mutex;
     /// socket事件上下文的容器
     std::vector<FdContext* > m_fdContexts;
+
+    /// 正在自旋的idle线程数，不为0时tickle不用写pipe
+    std::atomic<size_t> m_spinningThreadCount = {0};
+    /// 最小自旋窗口(微秒)
+    std::atomic<uint64_t> m_minSpinUs = {10};
+    /// 最大自旋窗口(微秒)
+    std::atomic<uint64_t> m_maxSpinUs = {100};
+    /// 当前自旋窗口(微秒)
+    std::atomic<uint64_t> m_spinWindowUs = {50};
+    /// 同时自旋的线程数上限
+    std::atomic<size_t> m_maxSpinningThreads = {0};
+    /// IO事件回调任务的优先级
+    std::atomic<Priority> m_eventPriority = {HIGH};
+    /// 自旋次数
+    std::atomic<uint64_t> m_spinCount = {0};
+    /// 自旋等到工作的次数
+    std::atomic<uint64_t> m_spinHitCount = {0};
+    /// 自旋累计耗时(微秒)
+    std::atomic<uint64_t> m_spinTimeUs = {0};
+    /// 阻塞等待次数
+    std::atomic<uint64_t> m_blockingWaitCount = {0};
+    /// 省掉的tickle次数
+    std::atomic<uint64_t> m_tickleSkipCount = {0};
+    /// 写pipe的tickle次数
+    std::atomic<uint64_t> m_tickleWriteCount = {0};
 };
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include "OffloadPool.h"
+#include "Timer.h"
+#include "mutex.h"
+
+OffloadPool::OffloadPool(size_t threads, const std::string& name,
+                         const Scheduler::AffinityPolicy& affinity)
+    : m_scheduler(new Scheduler(threads, false, name, affinity)) {
+    m_scheduler->start();
+}
+
+OffloadPool::~OffloadPool() {
+    stop();
+}
+
+void OffloadPool::stop() {
+    if (m_stopped.exchange(true)) {
+        return;
+    }
+    m_scheduler->stop();
+}
+
+void OffloadPool::run(std::function<void()> fn) {
+    Scheduler* origin = Scheduler::GetThis();
+    if (!origin || origin == m_scheduler.get() || m_stopped
+            || !Fiber::GetThis()->isRunInScheduler()) {
+        ++m_inlined;
+        fn();
+        return;
+    }
+    ++m_submitted;
+    ++m_queued;
+    uint64_t start = GetCurrentNS();
+    Fiber::ptr cur = Fiber::GetThis();
+    Fiber* raw_ptr = cur.get();
+    PreemptGuard guard;
+    // 调用方不是卸载池的线程，任务走卸载池的收件箱
+    m_scheduler->schedule([this, fn, cur, origin, start]() mutable {
+        uint64_t begin = GetCurrentNS();
+        --m_queued;
+        fn();
+        record(begin - start, GetCurrentNS() - start);
+        // 调用方可能还没切出，resume时会等它切出
+        origin->schedule(&cur);
+    });
+    cur.reset();
+    raw_ptr->yield();
+}
+
+void OffloadPool::record(uint64_t queue_ns, uint64_t latency_ns) {
+    m_totalQueueNs += queue_ns;
+    m_totalLatencyNs += latency_ns;
+    uint64_t max = m_maxLatencyNs.load(std::memory_order_relaxed);
+    while (latency_ns > max && !m_maxLatencyNs.compare_exchange_weak(max, latency_ns));
+    ++m_completed;
+}
+
+OffloadPool::Stats OffloadPool::getStats() const {
+    Stats stats;
+    stats.submitted = m_submitted;
+    stats.completed = m_completed;
+    stats.inlined = m_inlined;
+    stats.queueDepth = m_queued;
+    stats.avgQueueDelayUs = stats.completed ? m_totalQueueNs / stats.completed / 1000 : 0;
+    stats.avgLatencyUs = stats.completed ? m_totalLatencyNs / stats.completed / 1000 : 0;
+    stats.maxLatencyUs = m_maxLatencyNs / 1000;
+    return stats;
+}
+
+BlockingPool::BlockingPool()
+    : OffloadPool(1, "blocking") {
+    Scheduler::ElasticPolicy policy;
+    policy.minThreads = 1;
+    policy.maxThreads = 64;
+    // 辅助线程都卡在阻塞调用里时，新来的调用不能排队等
+    policy.growAfterMs = 0;
+    policy.retireIdleMs = 10000;
+    getScheduler()->setElastic(policy);
+}
@@ -0,0 +1,153 @@
+#pragma once
+#include "Fiber.h"
+#include "Scheduler.h"
+#include "singleton.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @brief 计算任务卸载池
+ * @details 压缩、哈希、图像变换这类CPU密集的计算放在IO协程里跑，会占住IOManager的工作线程，
+ * 这个线程上所有连接都得等着。卸载池是一个不带epoll的独立调度器，可以把工作线程绑定到专用的CPU上。
+ * IO协程调用offload(fn)把计算交给卸载池，自己挂起，算完后回到原来的调度器继续运行。
+ * 整个过程没有线程阻塞，两边互相加任务都走调度器的无锁收件箱，不抢对方的m_mutex
+*/
+class OffloadPool {
+public:
+    using ptr = std::shared_ptr<OffloadPool>;
+
+    /**
+     * @brief 卸载池统计信息
+    */
+    struct Stats {
+        /// 交给卸载池的任务数
+        uint64_t submitted;
+        /// 已经算完的任务数
+        uint64_t completed;
+        /// 不在调度器协程里调用、直接在当前线程上算的任务数
+        uint64_t inlined;
+        /// 当前排队等待计算的任务数
+        uint64_t queueDepth;
+        /// 平均排队时间(微秒)，从交给卸载池到开始计算
+        uint64_t avgQueueDelayUs;
+        /// 平均卸载延迟(微秒)，从交给卸载池到算完
+        uint64_t avgLatencyUs;
+        /// 最大卸载延迟(微秒)
+        uint64_t maxLatencyUs;
+    };
+
+    /**
+     * @brief 构造函数，创建后立即启动
+     * @param[in] threads 计算线程数
+     * @param[in] name 卸载池名称
+     * @param[in] affinity 计算线程的CPU亲和性，一般用EXPLICIT绑定到和IO线程分开的CPU上
+    */
+    OffloadPool(size_t threads = 1, const std::string& name = "offload",
+                const Scheduler::AffinityPolicy& affinity = Scheduler::AffinityPolicy());
+
+    OffloadPool(const OffloadPool&) = delete;
+
+    OffloadPool& operator = (const OffloadPool&) = delete;
+
+    /**
+     * @brief 析构函数，等已经交进来的计算全部完成
+    */
+    ~OffloadPool();
+
+    /**
+     * @brief 在卸载池上执行fn并返回结果
+     * @details 在调度器的任务协程里调用时挂起当前协程，算完后放回原来的调度器继续运行；
+     * 不在调度器协程里、在卸载池自己的线程上或者卸载池已经停止时，直接在当前线程上执行
+     * @attention fn不能抛出异常；协程被取消不会打断正在进行的计算
+    */
+    template<class F, class R = decltype(std::declval<F&>()())>
+    typename std::enable_if<std::is_void<R>::value>::type offload(F fn) {
+        run(std::function<void()>(std::move(fn)));
+    }
+
+    template<class F, class R = decltype(std::declval<F&>()())>
+    typename std::enable_if<!std::is_void<R>::value, R>::type offload(F fn) {
+        // 调用方在计算完成前一直挂起，结果可以放在调用方的栈上
+        std::unique_ptr<R> result;
+        run([&result, &fn]() {
+            result.reset(new R(fn()));
+        });
+        return std::move(*result);
+    }
+
+    /**
+     * @brief 停止卸载池，等已经交进来的计算全部完成
+     * @attention 停止之后还在交计算的协程会直接在自己的线程上算，调用方要保证停止时没有并发的offload
+    */
+    void stop();
+
+    /**
+     * @brief 获取统计信息
+    */
+    Stats getStats() const;
+
+    /**
+     * @brief 获取计算用的调度器
+    */
+    Scheduler* getScheduler() const {return m_scheduler.get();}
+
+private:
+    /**
+     * @brief 在卸载池上执行fn，当前协程挂起到fn执行完
+    */
+    void run(std::function<void()> fn);
+
+    /**
+     * @brief 记录一次计算的排队时间和总延迟
+    */
+    void record(uint64_t queue_ns, uint64_t latency_ns);
+
+private:
+    /// 计算用的调度器，不带epoll
+    std::unique_ptr<Scheduler> m_scheduler;
+    /// 是否已经停止
+    std::atomic<bool> m_stopped = {false};
+    /// 交给卸载池的任务数
+    std::atomic<uint64_t> m_submitted = {0};
+    /// 已经算完的任务数
+    std::atomic<uint64_t> m_completed = {0};
+    /// 直接在当前线程上算的任务数
+    std::atomic<uint64_t> m_inlined = {0};
+    /// 排队等待计算的任务数
+    std::atomic<uint64_t> m_queued = {0};
+    /// 累计排队时间(纳秒)
+    std::atomic<uint64_t> m_totalQueueNs = {0};
+    /// 累计卸载延迟(纳秒)
+    std::atomic<uint64_t> m_totalLatencyNs = {0};
+    /// 最大卸载延迟(纳秒)
+    std::atomic<uint64_t> m_maxLatencyNs = {0};
+};
+
+/**
+ * @brief 阻塞调用用的辅助线程池
+ * @details 有些调用没法变成非阻塞的，比如慢速NFS上的open/stat、fsync、getaddrinfo、
+ * 闭源驱动的调用，直接在工作线程上调用会卡住这个线程上的所有协程。
+ * 辅助线程池是弹性的，积压时立即扩容，空闲一段时间后收缩，
+ * 可以通过getScheduler()->setElastic()调整线程数范围
+*/
+class BlockingPool : public OffloadPool {
+public:
+    BlockingPool();
+};
+
+using BlockingPoolMgr = Singleton<BlockingPool>;
+
+/**
+ * @brief 在辅助线程上执行阻塞调用fn并返回结果
+ * @details 在调度器的任务协程里调用时挂起当前协程，结果经调度器交回后继续运行，
+ * 其他情况下直接在当前线程上调用
+ * @attention fn在别的线程上执行，fn里设置的errno要自己带回来
+*/
+template<class F>
+auto blocking(F fn) -> decltype(fn()) {
+    return BlockingPoolMgr::GetInstance()->offload(std::move(fn));
+}
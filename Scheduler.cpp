@@ -1,5 +1,21 @@
 #include "Scheduler.h"
+#include "Timer.h"
 #include <assert.h>
+#include <algorithm>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <new>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
 /**
  * @brief 当前线程持有的调度器指针
@@ -9,13 +25,179 @@
 static thread_local Scheduler* t_scheduler = nullptr;
 /// @brief 当前线程的调度协程指针
 static thread_local Fiber* t_scheduler_fiber = nullptr;
+/// @brief 当前线程的run next槽位，被本线程唤醒的协程优先在这里运行
+static thread_local Fiber::ptr t_run_next = nullptr;
+/// @brief 连续从run next槽位取任务的次数
+static thread_local int t_run_next_streak = 0;
+/// @brief 通过yieldTo让出执行权，等待重新加入调度的协程
+static thread_local Fiber::ptr t_handoff_fiber = nullptr;
+/// @brief 通过yieldTo切换过去正在运行的协程，保证其运行期间不被释放
+static thread_local Fiber::ptr t_handoff_running = nullptr;
+
+/// @brief 当前线程上次执行完任务的时间(毫秒)，弹性模式下用来判断空闲时长
+static thread_local uint64_t t_last_busy_ms = 0;
+/// @brief 当前线程是否因为长时间空闲正在退出
+static thread_local bool t_retiring = false;
+
+/// @brief idle线程睡下之前自旋等待tickle的次数
+static const int IDLE_SPIN_COUNT = 500;
+/// @brief idle线程在futex上最长睡眠时间(毫秒)，兜底被唤醒错线程的情况
+static const int MAX_PARK_TIMEOUT = 5000;
+
+/// @brief 自旋等待时降低CPU占用和功耗
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+/// @brief 连续从run next槽位取任务的上限，超过后槽位里的协程要回到任务队列排队，避免饿死队列中的任务
+static const int MAX_RUN_NEXT_STREAK = 3;
+
+/// @brief 抢占用的信号
+static const int PREEMPT_SIGNAL = SIGURG;
+/// @brief 本线程切换到任务协程的次数，每resume一个任务协程加1
+static thread_local uint64_t t_resume_seq = 0;
+/// @brief 上次抢占信号到来时看到的切换次数，两次信号之间没变说明同一个协程至少跑了半个时间片
+static thread_local uint64_t t_preempt_seen_seq = 0;
+
+/// @brief 当前任务取出时的优先级
+static thread_local int t_task_priority = Scheduler::NORMAL;
+/// @brief 当前任务所属的调度组，任务里新加入调度的协程和函数默认归入这个组
+static thread_local int t_task_group = Scheduler::DEFAULT_GROUP;
+
+/**
+ * @brief 被抢占或者预算用完让出的协程重新排队时的优先级
+ * @details 让出说明协程在跑计算而不是等IO，不保留高优先级，低优先级的任务仍然是低优先级
+*/
+static Scheduler::Priority RequeuePriority() {
+    return t_task_priority == Scheduler::LOW ? Scheduler::LOW : Scheduler::NORMAL;
+}
+
+/// @brief 当前协程被调度以来完成的没有阻塞的IO次数
+static thread_local uint32_t t_coop_ops = 0;
+/// @brief 当前协程被调度以来第一次IO的时间(微秒)，0表示还没有计时
+static thread_local uint64_t t_coop_start_us = 0;
+
+/// 链接器提供的主程序代码段起止地址
+extern "C" char __executable_start;
+extern "C" char etext;
+
+/**
+ * @brief 取出被信号打断时的指令地址和栈指针
+*/
+static bool GetInterruptedContext(void* context, uintptr_t& pc, uintptr_t& sp) {
+    ucontext_t* uc = (ucontext_t*)context;
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    sp = uc->uc_mcontext.gregs[REG_RSP];
+    return true;
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    sp = uc->uc_mcontext.sp;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief 抢占信号处理函数
+ * @details 被打断的指令在libc等动态库里时不抢占，这些函数(malloc、stdio等)内部可能持有锁，
+ * 协程带着这些锁被切走，同一线程上的其他协程再去拿锁就会死锁
+*/
+static void PreemptHandler(int, siginfo_t*, void* context) {
+    int saved_errno = errno;
+    uintptr_t pc = 0;
+    uintptr_t sp = 0;
+    if (t_preempt_seen_seq != t_resume_seq) {
+        t_preempt_seen_seq = t_resume_seq;
+    } else if (GetInterruptedContext(context, pc, sp)
+            && pc >= (uintptr_t)&__executable_start && pc < (uintptr_t)&etext) {
+        // 协程恢复时回到这里，之后从信号处理函数返回继续执行
+        Fiber::Preempt(sp);
+    }
+    errno = saved_errno;
+}
+
+static bool InstallPreemptHandler() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = PreemptHandler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(PREEMPT_SIGNAL, &sa, nullptr) == 0;
+}
 
-Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name) {
+/**
+ * @brief 为当前线程创建抢占定时器
+ * @details 按线程CPU时间计时，线程阻塞在epoll或者futex上时不计时，空闲线程不会被信号打扰
+*/
+static bool CreatePreemptTimer(uint64_t slice_us, timer_t* timer) {
+    // 信号间隔取半个时间片，连续两次信号看到同一个协程时它运行了半个到一个时间片
+    uint64_t interval_us = std::max<uint64_t>(slice_us / 2, 1);
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = PREEMPT_SIGNAL;
+    sev.sigev_notify_thread_id = GetThreadId();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, timer)) {
+        std::cerr << "timer_create fail, errno=" << errno << std::endl;
+        return false;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval_us / 1000000;
+    its.it_interval.tv_nsec = interval_us % 1000000 * 1000;
+    its.it_value = its.it_interval;
+    if (timer_settime(*timer, 0, &its, nullptr)) {
+        timer_delete(*timer);
+        return false;
+    }
+    return true;
+}
+
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name,
+                     const AffinityPolicy& affinity) {
     assert(threads > 0);
 
     m_useCaller = use_caller;
     m_name = name;
 
+    m_groups[DEFAULT_GROUP] = new Group;
+    m_groups[DEFAULT_GROUP]->name = "default";
+    m_groupCount = 1;
+
+    // 按策略算出工作线程绑定CPU的顺序
+    const std::vector<std::vector<int>>& nodes = GetNumaCpus();
+    switch (affinity.type) {
+        case AffinityPolicy::COMPACT:
+            for (auto& cpus: nodes) {
+                m_cpuList.insert(m_cpuList.end(), cpus.begin(), cpus.end());
+            }
+            break;
+        case AffinityPolicy::SCATTER:
+            for (size_t i = 0; ; ++i) {
+                bool found = false;
+                for (auto& cpus: nodes) {
+                    if (i < cpus.size()) {
+                        m_cpuList.push_back(cpus[i]);
+                        found = true;
+                    }
+                }
+                if (!found) {
+                    break;
+                }
+            }
+            break;
+        case AffinityPolicy::EXPLICIT:
+            m_cpuList = affinity.cpus;
+            break;
+        default:
+            break;
+    }
+
     // 创建调度器的线程，如果作为调度线程，就无需新建调度线程
     // 并且该线程自身也不算做工作线程
     // 这意味着，如果use_caller为真，并且总的线程数为1，那么只有caller线程负责调度
@@ -52,6 +234,11 @@ Scheduler::~Scheduler() {
     if(GetThis() == this) {
         t_scheduler = nullptr;
     }
+    for (int i = 0; i < m_groupCount; ++i) {
+        delete m_groups[i];
+    }
+    // 停止之后才加入的任务不会再运行
+    FreeInboxNodes(m_inbox.exchange(nullptr));
 }
 
 void Scheduler::setThis() {
@@ -79,16 +266,912 @@ void Scheduler::start() {
         std::cerr << "Scheduler is stopped" << std::endl;
         return;
     }
-    assert(m_threads.empty());
-    // 初始化线程池大小
-    m_threads.resize(m_threadCount);
+    assert(!m_started);
+    m_started = true;
     for (size_t i = 0; i < m_threadCount; ++i) {
         // 多个工作线程执行的是同一个调度器的调度函数，因为需要共用一个任务队列
-        m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this),
-                                        m_name + "_" + std::to_string(i)));
-        // 线程通过同步已经保证创建完成时，其ID已经拿到。
-        m_threadIds.push_back(m_threads[i]->getId());
+        spawnThreadNoLock();
+    }
+}
+
+void Scheduler::spawnThreadNoLock() {
+    size_t index = m_nextThreadIndex++;
+    Thread::ptr thr(new Thread(std::bind(&Scheduler::run, this),
+                                m_name + "_" + std::to_string(index)));
+    if (!m_cpuList.empty()) {
+        thr->setAffinity(m_cpuList[index % m_cpuList.size()]);
+    }
+    m_threads.push_back(thr);
+    // 线程通过同步已经保证创建完成时，其ID已经拿到。
+    m_threadIds.push_back(thr->getId());
+    ++m_liveThreadCount;
+}
+
+void Scheduler::setPreemption(uint64_t slice_us) {
+    if (slice_us) {
+        static bool installed = InstallPreemptHandler();
+        if (!installed) {
+            std::cerr << "install preempt signal handler fail" << std::endl;
+            return;
+        }
+    }
+    m_preemptSliceUs = slice_us;
+}
+
+void Scheduler::setCoopBudget(uint32_t ops, uint64_t quantum_us) {
+    m_coopOps = ops;
+    m_coopQuantumUs = quantum_us;
+}
+
+void Scheduler::consumeBudget() {
+    uint32_t ops = m_coopOps;
+    uint64_t quantum_us = m_coopQuantumUs;
+    if (!ops && !quantum_us) {
+        return;
+    }
+    bool exhausted = false;
+    {
+        // 计数器是线程局部的，被抢占后同一线程上的其他协程会接着改
+        PreemptGuard guard;
+        exhausted = ops && ++t_coop_ops >= ops;
+        if (!exhausted && quantum_us) {
+            uint64_t now = GetCurrentUS();
+            if (!t_coop_start_us) {
+                t_coop_start_us = now;
+            } else {
+                exhausted = now - t_coop_start_us >= quantum_us;
+            }
+        }
+    }
+    if (!exhausted) {
+        return;
+    }
+    // 持锁让出会让同一线程上的其他协程拿锁时死锁
+    if (GetThis() != this || t_preempt_disable > 0) {
+        return;
+    }
+    Fiber::ptr cur = Fiber::GetThis();
+    if (!cur->isRunInScheduler()) {
+        return;
+    }
+    // 放进队列之后到yield之前不能被抢占
+    PreemptGuard guard;
+    poll();
+    // 固定在本线程继续运行，和被抢占的协程一样，不让协程在执行中途换线程
+    schedule(cur, GetThreadId(), RequeuePriority());
+    auto raw_ptr = cur.get();
+    cur.reset();
+    raw_ptr->yield();
+}
+
+void Scheduler::handlePreempted(const Fiber::ptr& fiber) {
+    // 被抢占的可能是resume的协程，也可能是它通过yieldTo切过去的协程
+    Fiber::ptr preempted;
+    if (fiber && fiber->consumePreempted()) {
+        preempted = fiber;
+    } else if (t_handoff_running && t_handoff_running->consumePreempted()) {
+        preempted = t_handoff_running;
+    }
+    if (!preempted) {
+        return;
+    }
+    // 先处理到期的定时器和IO事件，被唤醒的协程排在被抢占的协程前面
+    poll();
+    schedule(preempted, GetThreadId(), RequeuePriority());
+}
+
+void Scheduler::setElastic(const ElasticPolicy& policy) {
+    // 没有工作线程就没有线程去发现过载，所以下限至少为1
+    assert(policy.minThreads > 0 && policy.minThreads <= policy.maxThreads);
+    MutexType::Lock lock(m_mutex);
+    m_elasticMinThreads = policy.minThreads;
+    m_elasticMaxThreads = policy.maxThreads;
+    m_elasticGrowBacklog = policy.growBacklog;
+    m_elasticGrowAfterMs = policy.growAfterMs;
+    m_elasticRetireIdleMs = policy.retireIdleMs;
+    m_elastic = true;
+    if (!m_started) {
+        m_threadCount = std::min(std::max(m_threadCount, policy.minThreads), policy.maxThreads);
+        return;
+    }
+    while (!m_stopping && m_liveThreadCount < policy.minThreads) {
+        spawnThreadNoLock();
+    }
+}
+
+std::vector<int> Scheduler::getWorkerThreadIds() {
+    MutexType::Lock lock(m_mutex);
+    std::vector<int> ids;
+    for (int id: m_threadIds) {
+        if (id != m_rootThread) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+bool Scheduler::isLiveThreadNoLock(int thread) const {
+    return std::find(m_threadIds.begin(), m_threadIds.end(), thread) != m_threadIds.end();
+}
+
+/**
+ * @brief 过载持续时间足够长时扩容一个工作线程
+ * @details 过载指任务积压达到阈值，或者有任务在排队但没有空闲线程(所有线程都在忙)。
+ * 每个过载周期最多扩容一个线程，扩容时顺便回收已经退出的线程
+*/
+void Scheduler::maybeGrow() {
+    // 所有线程都卡在任务里时没人取收件箱，收件箱里的任务也要算积压
+    size_t backlog = m_taskCount + m_inboxCount;
+    bool overloaded = backlog >= m_elasticGrowBacklog
+                    || (backlog > 0 && m_idleThreadCount == 0);
+    if (!overloaded) {
+        if (m_overloadSince) {
+            m_overloadSince = 0;
+        }
+        return;
+    }
+    uint64_t now = GetCurrentMS();
+    uint64_t since = m_overloadSince;
+    uint64_t grow_after = m_elasticGrowAfterMs;
+    // growAfterMs为0时不等过载持续，每次发现过载都立即扩容
+    if (since == 0 && grow_after > 0) {
+        m_overloadSince.compare_exchange_strong(since, now);
+        return;
+    }
+    if (now - since < grow_after || m_liveThreadCount >= m_elasticMaxThreads) {
+        return;
+    }
+    std::vector<Thread::ptr> retired;
+    {
+        MutexType::Lock lock(m_mutex);
+        // 别的线程已经在这个过载周期里扩容过了
+        if (m_stopping || m_overloadSince != since
+                || m_liveThreadCount >= m_elasticMaxThreads) {
+            return;
+        }
+        m_overloadSince = now;
+        spawnThreadNoLock();
+        retired.swap(m_retiredThreads);
+    }
+    for (auto& i: retired) {
+        i->join();
+    }
+}
+
+bool Scheduler::shouldRetire() {
+    if (!m_elastic || GetThreadId() == m_rootThread) {
+        return false;
+    }
+    if (GetCurrentMS() - t_last_busy_ms < m_elasticRetireIdleMs) {
+        return false;
+    }
+    {
+        // 被抢占的协程必须回到原来的线程上运行，还有任务固定在本线程上时不能退出
+        MutexType::Lock lock(m_mutex);
+        if (hasPinnedTaskNoLock(GetThreadId())) {
+            return false;
+        }
+    }
+    // 抢到名额才退出，保证线程数不低于下限
+    size_t min_threads = m_elasticMinThreads;
+    size_t live = m_liveThreadCount;
+    while (live > min_threads) {
+        if (m_liveThreadCount.compare_exchange_weak(live, live - 1)) {
+            t_retiring = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::retireThreadNoLock() {
+    int thread_id = GetThreadId();
+    // 线程退出后就没人执行指定在本线程上的任务了，改为任意线程可运行
+    for (int i = 0; i < m_groupCount; ++i) {
+        for (auto& tasks: m_groups[i]->tasks) {
+            for (auto& task: tasks) {
+                if (task.thread == thread_id) {
+                    task.thread = -1;
+                }
+            }
+        }
+    }
+    auto it = m_deadlineHeaps.find(thread_id);
+    if (it != m_deadlineHeaps.end()) {
+        std::vector<DeadlineTask>& shared = m_deadlineHeaps[-1];
+        for (auto& i: it->second) {
+            i.task.thread = -1;
+            shared.push_back(i);
+            std::push_heap(shared.begin(), shared.end());
+        }
+        m_deadlineHeaps.erase(thread_id);
+    }
+    m_threadIds.erase(std::remove(m_threadIds.begin(), m_threadIds.end(), thread_id),
+                      m_threadIds.end());
+    // 线程不能join自己，交给下次扩容或者stop去join
+    Thread* self = Thread::GetThis();
+    for (auto it = m_threads.begin(); it != m_threads.end(); ++it) {
+        if (it->get() == self) {
+            m_retiredThreads.push_back(*it);
+            m_threads.erase(it);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief 回收的收件箱节点内存
+ * @details 所有收件箱节点大小相同，回收后只当作一块内存串起来
+*/
+struct InboxNodeBlock {
+    InboxNodeBlock* next;
+};
+
+/// 全局空闲链表，工作线程把用完的节点整串挂上来，生产者整串取走，两边都不会遇到ABA
+static std::atomic<InboxNodeBlock*> s_free_inbox_blocks = {nullptr};
+
+/**
+ * @brief 生产者线程的节点缓存，线程退出时还回全局空闲链表
+*/
+struct InboxBlockCache {
+    InboxNodeBlock* head = nullptr;
+
+    ~InboxBlockCache() {
+        if (!head) {
+            return;
+        }
+        InboxNodeBlock* tail = head;
+        while (tail->next) {
+            tail = tail->next;
+        }
+        tail->next = s_free_inbox_blocks.load(std::memory_order_relaxed);
+        while (!s_free_inbox_blocks.compare_exchange_weak(tail->next, head,
+                    std::memory_order_release, std::memory_order_relaxed));
+    }
+};
+
+static thread_local InboxBlockCache t_inbox_block_cache;
+
+Scheduler::InboxNode* Scheduler::AllocInboxNode() {
+    // 缓存是线程局部的，取到一半被抢占的话同一线程上的下一个协程会拿到同一个节点。
+    // 地址判断放过了本库自己的代码，这里要自己禁止抢占
+    PreemptGuard guard;
+    InboxNodeBlock*& cache = t_inbox_block_cache.head;
+    if (!cache) {
+        cache = s_free_inbox_blocks.exchange(nullptr, std::memory_order_acquire);
+    }
+    void* mem = cache;
+    if (cache) {
+        cache = cache->next;
+    } else {
+        mem = ::operator new(std::max(sizeof(InboxNode), sizeof(InboxNodeBlock)));
+    }
+    return new (mem) InboxNode();
+}
+
+void Scheduler::FreeInboxNodes(InboxNode* head) {
+    if (!head) {
+        return;
+    }
+    InboxNodeBlock* first = nullptr;
+    InboxNodeBlock* last = nullptr;
+    while (head) {
+        InboxNode* next = head->next;
+        head->~InboxNode();
+        InboxNodeBlock* block = reinterpret_cast<InboxNodeBlock*>(head);
+        block->next = first;
+        first = block;
+        if (!last) {
+            last = block;
+        }
+        head = next;
+    }
+    last->next = s_free_inbox_blocks.load(std::memory_order_relaxed);
+    while (!s_free_inbox_blocks.compare_exchange_weak(last->next, first,
+                std::memory_order_release, std::memory_order_relaxed));
+}
+
+bool Scheduler::pushInbox(ScheduleTask&& task, Priority priority, int group, uint64_t deadline) {
+    if (!task.fiber && !task.cb) {
+        return false;
+    }
+    // 不在本调度器的线程上，没有当前任务的组可以继承
+    if (group < 0 && task.fiber) {
+        group = task.fiber->getSchedGroup();
+    }
+    if (group < 0) {
+        group = DEFAULT_GROUP;
+    }
+    InboxNode* node = AllocInboxNode();
+    node->task = std::move(task);
+    node->task.deadline = deadline;
+    node->priority = priority;
+    node->group = group;
+    ++m_inboxCount;
+    // 节点一挂上去就可能被取走并回收，原来的栈顶要记在局部变量里
+    InboxNode* head = m_inbox.load(std::memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!m_inbox.compare_exchange_weak(head, node,
+                std::memory_order_release, std::memory_order_relaxed));
+    // 收件箱原来不为空时，已经有人tickle过，取的时候会一并取走
+    return head == nullptr;
+}
+
+void Scheduler::drainInboxNoLock() {
+    InboxNode* head = m_inbox.exchange(nullptr, std::memory_order_acquire);
+    if (!head) {
+        return;
+    }
+    // 收件箱是栈，反转成加入的顺序
+    InboxNode* fifo = nullptr;
+    size_t count = 0;
+    while (head) {
+        InboxNode* next = head->next;
+        head->next = fifo;
+        fifo = head;
+        head = next;
+        ++count;
+    }
+    m_inboxCount -= count;
+    for (InboxNode* node = fifo; node; node = node->next) {
+        scheduleTaskNoLock(node->task, node->priority, node->group, node->task.deadline);
+    }
+    FreeInboxNodes(fifo);
+}
+
+bool Scheduler::scheduleTaskNoLock(ScheduleTask& task, Priority priority, int group, uint64_t deadline) {
+    // 队列原来没有能运行的任务，或者有线程已经睡下(睡下前没看到这个任务)，都需要通知
+    bool need_tickle = m_taskCount == m_throttledTaskCount || m_parkedThreadCount > 0;
+    // 弹性模式下指定的线程可能已经退出，改为任意线程
+    if (m_elastic && task.thread != -1 && !isLiveThreadNoLock(task.thread)) {
+        task.thread = -1;
+    }
+    if (task.fiber || task.cb) {
+        task.group = resolveGroupNoLock(task.fiber.get(), group);
+        task.deadline = deadline;
+        enqueueNoLock(task, priority);
+    }
+    return need_tickle;
+}
+
+int Scheduler::resolveGroupNoLock(Fiber* fiber, int group) {
+    if (group < 0 && fiber) {
+        group = fiber->getSchedGroup();
+    }
+    if (group < 0) {
+        group = GetThis() == this ? t_task_group : DEFAULT_GROUP;
+    }
+    assert(group < m_groupCount);
+    if (fiber) {
+        fiber->setSchedGroup(group);
+    }
+    return group;
+}
+
+void Scheduler::enqueueNoLock(ScheduleTask& task, Priority priority) {
+    // 协程记住截止时间，之后每次加入调度都按截止时间排队
+    if (task.fiber) {
+        if (task.deadline) {
+            task.fiber->setDeadline(task.deadline);
+        } else {
+            task.deadline = task.fiber->getDeadline();
+        }
+    }
+    if (task.deadline) {
+        std::vector<DeadlineTask>& heap = m_deadlineHeaps[task.thread];
+        heap.push_back(DeadlineTask{task.deadline, m_deadlineSeq++, task});
+        std::push_heap(heap.begin(), heap.end());
+        ++m_deadlineTaskCount;
+        ++m_taskCount;
+        return;
+    }
+    Group* group = m_groups[task.group];
+    // 组从空闲变为活跃，不能拿空闲期间落下的虚拟运行时间去插队
+    if (group->queued == 0 && group->vruntime < m_minVruntime) {
+        group->vruntime = m_minVruntime;
+    }
+    group->tasks[priority].push_back(task);
+    ++group->queued;
+    ++m_taskCount;
+    if (task.admitSeq) {
+        m_admitted[priority][task.admitSeq] = AdmitEntry{group, std::prev(group->tasks[priority].end())};
+        ++m_admittedCount;
+    }
+    if (group->throttled) {
+        ++m_throttledTaskCount;
+    }
+}
+
+bool Scheduler::takeFromGroupNoLock(Group* group, ScheduleTask& task, int& priority,
+                                    bool& tickle_me) {
+    int thread_id = GetThreadId();
+    // 第一轮只看还有额度的队列，取不到的话重新发放额度再取一轮
+    for (int round = 0; round < 2; ++round) {
+        for (int p = 0; p < PRIORITY_COUNT; ++p) {
+            if (round == 0 && group->credits[p] == 0) {
+                continue;
+            }
+            std::list<ScheduleTask>& tasks = group->tasks[p];
+            for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+                // 任务指定了线程，但不是当前线程，需要通知其他线程，然后去下一个任务
+                if (it->thread != -1 && it->thread != thread_id) {
+                    tickle_me = true;
+                    continue;
+                }
+                // 协程可能刚在其他线程上登记完唤醒、还没切出，resume时会等它切出
+                assert(it->fiber || it->cb);
+                task = *it;
+                tasks.erase(it);
+                --group->queued;
+                --m_taskCount;
+                if (task.admitSeq) {
+                    m_admitted[p].erase(task.admitSeq);
+                    // 队列排空后排队时间归零，否则一直停留在饱和状态
+                    m_queueDelayMs = --m_admittedCount ? GetCurrentMS() - task.admitMs : 0;
+                }
+                if (group->credits[p] > 0) {
+                    --group->credits[p];
+                }
+                priority = p;
+                // 当前线程拿完一个任务后，如果还有能运行的任务，需要通知其他线程
+                tickle_me |= m_taskCount > m_throttledTaskCount;
+                return true;
+            }
+        }
+        for (int p = 0; p < PRIORITY_COUNT; ++p) {
+            group->credits[p] = m_priorityWeights[p];
+        }
+    }
+    return false;
+}
+
+bool Scheduler::takeDeadlineTaskNoLock(ScheduleTask& task, bool& tickle_me) {
+    std::vector<DeadlineTask>* heap = nullptr;
+    size_t visible = 0;
+    for (int thread: {-1, GetThreadId()}) {
+        auto it = m_deadlineHeaps.find(thread);
+        if (it == m_deadlineHeaps.end() || it->second.empty()) {
+            continue;
+        }
+        visible += it->second.size();
+        // 堆顶比较用的是"晚于"，两个堆顶里截止时间更早的那个胜出
+        if (!heap || heap->front() < it->second.front()) {
+            heap = &it->second;
+        }
+    }
+    // 其他线程的堆里还有任务
+    if (visible < m_deadlineTaskCount) {
+        tickle_me = true;
+    }
+    if (!heap) {
+        return false;
+    }
+    std::pop_heap(heap->begin(), heap->end());
+    task = heap->back().task;
+    heap->pop_back();
+    --m_deadlineTaskCount;
+    --m_taskCount;
+    tickle_me |= m_taskCount > m_throttledTaskCount;
+    return true;
+}
+
+bool Scheduler::takeTaskNoLock(ScheduleTask& task, int& priority, bool& tickle_me) {
+    // 有截止时间的任务优先于普通任务
+    if (m_deadlineTaskCount > 0 && takeDeadlineTaskNoLock(task, tickle_me)) {
+        priority = NORMAL;
+        return true;
     }
+    int count = m_groupCount;
+    if (count == 1) {
+        return takeFromGroupNoLock(m_groups[DEFAULT_GROUP], task, priority, tickle_me);
+    }
+    if (m_quotaGroupCount > 0) {
+        refreshThrottleNoLock(GetCurrentNS());
+    }
+    // 虚拟运行时间由各线程不加锁地累加，先取快照再排序
+    std::pair<uint64_t, Group*> candidates[MAX_GROUPS];
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        Group* group = m_groups[i];
+        if (group->queued > 0 && !group->throttled) {
+            candidates[n++] = std::make_pair(group->vruntime.load(), group);
+        }
+    }
+    std::sort(candidates, candidates + n);
+    // 虚拟运行时间最小的组里的任务可能都指定了其他线程，依次尝试下一个组
+    for (int i = 0; i < n; ++i) {
+        if (takeFromGroupNoLock(candidates[i].second, task, priority, tickle_me)) {
+            m_minVruntime = std::max(m_minVruntime, candidates[i].first);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Scheduler::hasRunnableTaskNoLock(int thread) const {
+    for (int i: {-1, thread}) {
+        auto it = m_deadlineHeaps.find(i);
+        if (it != m_deadlineHeaps.end() && !it->second.empty()) {
+            return true;
+        }
+    }
+    for (int i = 0; i < m_groupCount; ++i) {
+        if (m_groups[i]->throttled) {
+            continue;
+        }
+        for (auto& tasks: m_groups[i]->tasks) {
+            for (auto& task: tasks) {
+                if (task.thread == -1 || task.thread == thread) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+bool Scheduler::hasPinnedTaskNoLock(int thread) const {
+    auto it = m_deadlineHeaps.find(thread);
+    if (it != m_deadlineHeaps.end() && !it->second.empty()) {
+        return true;
+    }
+    for (int i = 0; i < m_groupCount; ++i) {
+        for (auto& tasks: m_groups[i]->tasks) {
+            for (auto& task: tasks) {
+                if (task.thread == thread) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void Scheduler::refreshThrottleNoLock(uint64_t now_ns) {
+    for (int i = 0; i < m_groupCount; ++i) {
+        Group* group = m_groups[i];
+        if (!group->quotaUs) {
+            continue;
+        }
+        if (now_ns - group->periodStartNs >= group->periodUs * 1000) {
+            group->periodStartNs = now_ns;
+            group->periodUsedNs = 0;
+            if (group->throttled) {
+                group->throttled = false;
+                m_throttledTaskCount -= group->queued;
+            }
+        }
+        if (!group->throttled && group->periodUsedNs >= group->quotaUs * 1000) {
+            group->throttled = true;
+            ++group->throttledCount;
+            m_throttledTaskCount += group->queued;
+        }
+    }
+}
+
+uint64_t Scheduler::getThrottleTimeout() {
+    if (m_quotaGroupCount == 0) {
+        return ~0ull;
+    }
+    uint64_t now_ns = GetCurrentNS();
+    uint64_t timeout = ~0ull;
+    MutexType::Lock lock(m_mutex);
+    refreshThrottleNoLock(now_ns);
+    for (int i = 0; i < m_groupCount; ++i) {
+        Group* group = m_groups[i];
+        if (group->throttled) {
+            uint64_t end_ns = group->periodStartNs + group->periodUs * 1000;
+            // 向上取整到毫秒，醒来时周期一定已经结束
+            uint64_t ms = end_ns > now_ns ? (end_ns - now_ns + 999999) / 1000000 : 0;
+            timeout = std::min(timeout, ms);
+        }
+    }
+    return timeout;
+}
+
+void Scheduler::chargeGroup(int group, uint64_t ns) {
+    Group* g = m_groups[group];
+    g->cpuTimeNs += ns;
+    g->periodUsedNs += ns;
+    g->vruntime += ns * 1024 / g->weight;
+    ++g->runCount;
+}
+
+void Scheduler::setDeadlineDropCallback(std::function<void(Fiber::ptr, uint64_t)> cb) {
+    MutexType::Lock lock(m_mutex);
+    m_deadlineDropCb = cb;
+    m_hasDeadlineDropCb = (bool)m_deadlineDropCb;
+}
+
+bool Scheduler::dropExpired(ScheduleTask& task) {
+    std::function<void(Fiber::ptr, uint64_t)> cb;
+    {
+        MutexType::Lock lock(m_mutex);
+        cb = m_deadlineDropCb;
+    }
+    if (!cb) {
+        return false;
+    }
+    if (task.cb) {
+        ++m_deadlineDropCount;
+        cb(nullptr, task.deadline);
+        return true;
+    }
+    // 已经取消过的协程正在收尾，不再重复处理
+    if (!task.fiber->isCancelled()) {
+        ++m_deadlineDropCount;
+        cb(task.fiber, task.deadline);
+        task.fiber->cancel();
+    }
+    return false;
+}
+
+bool Scheduler::saturatedNoLock() const {
+    return (m_admissionPolicy.maxQueued && m_admittedCount >= m_admissionPolicy.maxQueued)
+        || (m_admissionPolicy.maxQueueDelayMs && m_queueDelayMs > m_admissionPolicy.maxQueueDelayMs);
+}
+
+bool Scheduler::shedOneNoLock(OverflowAction action, Priority incoming,
+                              std::function<void()>& victim) {
+    int priority = -1;
+    if (action == SHED_LOWEST) {
+        // 从低到高找第一个有submit任务的优先级，比新任务的优先级还高的话不丢弃
+        for (int p = PRIORITY_COUNT - 1; p >= incoming; --p) {
+            if (!m_admitted[p].empty()) {
+                priority = p;
+                break;
+            }
+        }
+    } else {
+        // 序号越小越早加入，比较各优先级里最早的那个
+        for (int p = 0; p < PRIORITY_COUNT; ++p) {
+            if (!m_admitted[p].empty() && (priority == -1
+                    || m_admitted[p].begin()->first < m_admitted[priority].begin()->first)) {
+                priority = p;
+            }
+        }
+    }
+    if (priority == -1) {
+        return false;
+    }
+    auto entry = m_admitted[priority].begin();
+    Group* group = entry->second.group;
+    victim.swap(entry->second.it->cb);
+    group->tasks[priority].erase(entry->second.it);
+    m_admitted[priority].erase(entry);
+    --group->queued;
+    --m_taskCount;
+    if (group->throttled) {
+        --m_throttledTaskCount;
+    }
+    --m_admittedCount;
+    ++m_shedTotal;
+    return true;
+}
+
+void Scheduler::updateSaturation(bool saturated) {
+    if (m_saturated.exchange(saturated) == saturated) {
+        return;
+    }
+    std::function<void(bool)> cb;
+    {
+        MutexType::Lock lock(m_mutex);
+        cb = m_saturationCb;
+    }
+    if (cb) {
+        cb(saturated);
+    }
+}
+
+bool Scheduler::submit(std::function<void()> cb, OverflowAction action,
+                       Priority priority, int group) {
+    // 被丢弃的任务在锁外析构，它捕获的资源析构时可能会再调用调度器
+    std::function<void()> victim;
+    bool need_tickle = false;
+    bool accepted = false;
+    bool saturated = false;
+    bool counted_block = false;
+    while (true) {
+        Fiber::ptr fiber;
+        Scheduler* scheduler = Scheduler::GetThis();
+        if (action == BLOCK && scheduler) {
+            fiber = Fiber::GetThis();
+            if (!fiber->isRunInScheduler()) {
+                fiber.reset();
+            }
+        }
+        // 登记成等待者之后到yield之前不能被抢占
+        PreemptGuard guard;
+        std::unique_ptr<Semaphore> sem;
+        {
+            MutexType::Lock lock(m_mutex);
+            bool full = saturatedNoLock();
+            if (full && action == BLOCK) {
+                if (!fiber) {
+                    sem.reset(new Semaphore);
+                }
+                m_admissionWaiters.push_back(AdmissionWaiter{fiber, scheduler, sem.get()});
+                ++m_admissionWaiterCount;
+            } else if (!full || ((action == SHED_OLDEST || action == SHED_LOWEST)
+                        && shedOneNoLock(action, priority, victim))) {
+                need_tickle = m_taskCount == m_throttledTaskCount || m_parkedThreadCount > 0;
+                ScheduleTask task(&cb, -1);
+                task.group = resolveGroupNoLock(nullptr, group);
+                task.admitSeq = ++m_admitSeq;
+                task.admitMs = GetCurrentMS();
+                enqueueNoLock(task, priority);
+                accepted = true;
+            }
+            saturated = saturatedNoLock();
+            if (!full || action != BLOCK) {
+                break;
+            }
+        }
+        updateSaturation(saturated);
+        if (!counted_block) {
+            counted_block = true;
+            ++m_blockedTotal;
+        }
+        // 被唤醒后重新检查，空位可能又被别人占了
+        if (fiber) {
+            auto raw_ptr = fiber.get();
+            fiber.reset();
+            raw_ptr->yield();
+        } else {
+            sem->wait();
+        }
+    }
+    if (accepted) {
+        ++m_admittedTotal;
+    } else {
+        ++m_rejectedTotal;
+    }
+    updateSaturation(saturated);
+    if (need_tickle) {
+        tickle();
+    }
+    if (accepted && m_elastic) {
+        maybeGrow();
+    }
+    return accepted;
+}
+
+void Scheduler::onAdmittedTaskTaken() {
+    if (m_admissionWaiterCount == 0 && !m_saturated) {
+        return;
+    }
+    AdmissionWaiter waiter{nullptr, nullptr, nullptr};
+    bool saturated = false;
+    {
+        MutexType::Lock lock(m_mutex);
+        saturated = saturatedNoLock();
+        if (!saturated && !m_admissionWaiters.empty()) {
+            waiter = m_admissionWaiters.front();
+            m_admissionWaiters.pop_front();
+            --m_admissionWaiterCount;
+        }
+    }
+    updateSaturation(saturated);
+    if (waiter.fiber) {
+        waiter.scheduler->schedule(waiter.fiber);
+    } else if (waiter.sem) {
+        waiter.sem->notify();
+    }
+}
+
+void Scheduler::setAdmissionPolicy(const AdmissionPolicy& policy) {
+    std::list<AdmissionWaiter> waiters;
+    bool saturated = false;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_admissionPolicy = policy;
+        saturated = saturatedNoLock();
+        // 等待者被唤醒后自己重新检查，还饱和的话会再排队
+        waiters.swap(m_admissionWaiters);
+        m_admissionWaiterCount = 0;
+    }
+    updateSaturation(saturated);
+    for (auto& i: waiters) {
+        if (i.fiber) {
+            i.scheduler->schedule(i.fiber);
+        } else {
+            i.sem->notify();
+        }
+    }
+}
+
+void Scheduler::setSaturationCallback(std::function<void(bool)> cb) {
+    MutexType::Lock lock(m_mutex);
+    m_saturationCb = cb;
+}
+
+Scheduler::AdmissionStats Scheduler::getAdmissionStats() {
+    MutexType::Lock lock(m_mutex);
+    AdmissionStats stats;
+    stats.admitted = m_admittedTotal;
+    stats.rejected = m_rejectedTotal;
+    stats.shed = m_shedTotal;
+    stats.blocked = m_blockedTotal;
+    stats.queued = m_admittedCount;
+    stats.queueDelayMs = m_queueDelayMs;
+    stats.saturated = saturatedNoLock();
+    return stats;
+}
+
+void Scheduler::setPriorityWeights(uint32_t high, uint32_t normal, uint32_t low) {
+    assert(high > 0 && normal > 0 && low > 0);
+    MutexType::Lock lock(m_mutex);
+    m_priorityWeights[HIGH] = high;
+    m_priorityWeights[NORMAL] = normal;
+    m_priorityWeights[LOW] = low;
+    for (int i = 0; i < m_groupCount; ++i) {
+        for (int p = 0; p < PRIORITY_COUNT; ++p) {
+            m_groups[i]->credits[p] = m_priorityWeights[p];
+        }
+    }
+}
+
+int Scheduler::addGroup(const std::string& name, uint32_t weight,
+                        uint64_t quota_us, uint64_t period_us) {
+    MutexType::Lock lock(m_mutex);
+    int id = m_groupCount;
+    if (id >= MAX_GROUPS) {
+        return -1;
+    }
+    Group* group = new Group;
+    group->name = name;
+    for (int p = 0; p < PRIORITY_COUNT; ++p) {
+        group->credits[p] = m_priorityWeights[p];
+    }
+    m_groups[id] = group;
+    // 先放进数组再增加个数，不加锁按id访问组的线程看到的一定是完整的组
+    m_groupCount = id + 1;
+    lock.unlock();
+    setGroupPolicy(id, weight, quota_us, period_us);
+    return id;
+}
+
+void Scheduler::setGroupPolicy(int group, uint32_t weight, uint64_t quota_us,
+                               uint64_t period_us) {
+    assert(weight > 0 && period_us > 0);
+    MutexType::Lock lock(m_mutex);
+    assert(group >= 0 && group < m_groupCount);
+    Group* g = m_groups[group];
+    g->weight = weight;
+    if (!g->quotaUs != !quota_us) {
+        m_quotaGroupCount += quota_us ? 1 : -1;
+    }
+    g->quotaUs = quota_us;
+    g->periodUs = period_us;
+    // 按新配额重新开始一个周期
+    if (g->throttled) {
+        g->throttled = false;
+        m_throttledTaskCount -= g->queued;
+    }
+    g->periodStartNs = GetCurrentNS();
+    g->periodUsedNs = 0;
+}
+
+std::vector<Scheduler::GroupStats> Scheduler::getGroupStats() {
+    MutexType::Lock lock(m_mutex);
+    std::vector<GroupStats> stats(m_groupCount);
+    for (int i = 0; i < m_groupCount; ++i) {
+        Group* g = m_groups[i];
+        GroupStats& st = stats[i];
+        st.id = i;
+        st.name = g->name;
+        st.weight = g->weight;
+        st.quotaUs = g->quotaUs;
+        st.periodUs = g->periodUs;
+        st.cpuTimeUs = g->cpuTimeNs / 1000;
+        st.vruntime = g->vruntime;
+        st.queued = g->queued;
+        st.runCount = g->runCount;
+        st.throttledCount = g->throttledCount;
+        st.throttled = g->throttled;
+    }
+    return stats;
 }
 
 /**
@@ -105,6 +1188,13 @@ void Scheduler::run() {
         t_scheduler_fiber = Fiber::GetThis().get();
     }
 
+    t_last_busy_ms = GetCurrentMS();
+
+    // 本线程的抢占定时器，时间片设置变化时重建
+    timer_t preempt_timer;
+    bool has_preempt_timer = false;
+    uint64_t preempt_slice = 0;
+
     // 除了主协程和调度协程之外，还创建一个idle协程来处理任务队列空的情况
     // 这个idle协程会直接yield回调度协程，
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
@@ -113,57 +1203,132 @@ void Scheduler::run() {
     ScheduleTask task;
     while (true) {
         task.reset();
+        // 决定退出的线程不能再取任务，否则任务被抢占后会固定到一个马上要退出的线程上
+        if (t_retiring) {
+            break;
+        }
         bool tickle_me = false;
-        {
+        // 上个任务通过yieldTo把执行权交了出去，交出方的上下文此时已经保存，放进槽位接着运行
+        t_handoff_running.reset();
+        if (t_handoff_fiber) {
+            scheduleNext(nullptr);
+        }
+        // 优先运行run next槽位中的协程，不加锁也不经过任务队列
+        if (t_run_next && t_run_next_streak < MAX_RUN_NEXT_STREAK) {
+            task.fiber.swap(t_run_next);
+            ++t_run_next_streak;
+            ++m_activeThreadCount;
+            t_task_priority = HIGH;
+            // 槽位里的协程不经过队列，没有加入过调度的协程归入唤醒它的任务所在的组
+            if (task.fiber->getSchedGroup() < 0) {
+                task.fiber->setSchedGroup(t_task_group);
+            }
+            task.group = task.fiber->getSchedGroup();
+            task.deadline = task.fiber->getDeadline();
+        } else {
+            t_run_next_streak = 0;
             // 只在找任务过程中加锁
             MutexType::Lock lock(m_mutex);
-            auto it = m_tasks.begin();
-            // 遍历所有调度任务
-            while (it != m_tasks.end()) {
-                // 任务指定了线程，但不是当前线程，需要通知其他线程，然后去下一个任务
-                if (it->thread != -1 && it->thread != GetThreadId()) {
-                    ++it;
-                    tickle_me = true;
-                    continue;
-                }
-                
-                assert(it->fiber || it->cb);
-                if (it->fiber) {
-                    // 此时协程状态一定是READY
-                    assert(it->fiber->getState() == Fiber::READY);
-                }
-                // 当前调度线程找到一个任务，准备开始调度，将其从任务队列移除，然后活动线程数+1
-                task = *it;
-                m_tasks.erase(it++);
+            // 槽位连续运行次数到了上限，槽位中的协程放回任务队列排队
+            if (t_run_next) {
+                ScheduleTask next(&t_run_next, -1);
+                next.group = resolveGroupNoLock(next.fiber.get(), -1);
+                enqueueNoLock(next, HIGH);
+            }
+            // 其他线程加入的任务先从收件箱整批取进任务队列
+            drainInboxNoLock();
+            int priority = NORMAL;
+            if (takeTaskNoLock(task, priority, tickle_me)) {
+                // 当前调度线程找到一个任务，准备开始调度，活动线程数+1
                 ++m_activeThreadCount;
-                break;
+                t_task_priority = priority;
             }
-            // 当前线程拿完一个任务后，如果队列不为空，需要通知其他线程
-            tickle_me |= (it != m_tasks.end());
+        }
+
+        // 取走了submit任务，看看能不能唤醒阻塞在submit上的调用方
+        if (task.admitSeq) {
+            onAdmittedTaskTaken();
         }
 
         if (tickle_me) {
             tickle();
+            // 拿完任务队列还有积压，看看是否需要扩容
+            if (m_elastic) {
+                maybeGrow();
+            }
         }
 
+        // 过了截止时间的任务交给回调处理，被丢弃的函数任务不再执行
+        if (task.deadline && m_hasDeadlineDropCb && GetCurrentMS() > task.deadline
+                && dropExpired(task)) {
+            leaveActive();
+            continue;
+        }
+
+        uint64_t slice = m_preemptSliceUs;
+        if (slice != preempt_slice) {
+            if (has_preempt_timer) {
+                timer_delete(preempt_timer);
+            }
+            has_preempt_timer = slice > 0 && CreatePreemptTimer(slice, &preempt_timer);
+            preempt_slice = slice;
+        }
+
+        // 只有一个调度组时不需要统计各组的运行时间
+        bool grouped = m_groupCount > 1;
+        uint64_t start_ns = 0;
         if (task.fiber) {
             // 任务是协程，则resume协程
+            ++t_resume_seq;
+            t_coop_ops = 0;
+            t_coop_start_us = 0;
+            t_task_group = task.group;
+            if (grouped) {
+                start_ns = GetCurrentNS();
+            }
             task.fiber->resume();
+            if (grouped) {
+                chargeGroup(task.group, GetCurrentNS() - start_ns);
+            }
             // 从resume返回后，要么完成，要么半路yield，任务就算执行完毕，当前线程不再活跃
-            // 活跃线程数+1
-            --m_activeThreadCount;
+            // 活跃线程数-1
+            leaveActive();
+            // 被抢占的可能是它，也可能是它通过yieldTo切过去的协程
+            handlePreempted(task.fiber);
             task.reset();
+            t_task_group = DEFAULT_GROUP;
+            if (m_elastic) {
+                t_last_busy_ms = GetCurrentMS();
+            }
         } else if (task.cb) {
             if (cb_fiber) {
                 cb_fiber->reset(task.cb);
             } else {
                 cb_fiber.reset(new Fiber(task.cb));
             }
+            int group = task.group;
+            cb_fiber->setSchedGroup(group);
+            cb_fiber->setDeadline(task.deadline);
             task.reset();
             // 函数转协程再resume
+            ++t_resume_seq;
+            t_coop_ops = 0;
+            t_coop_start_us = 0;
+            t_task_group = group;
+            if (grouped) {
+                start_ns = GetCurrentNS();
+            }
             cb_fiber->resume();
-            --m_activeThreadCount;
+            if (grouped) {
+                chargeGroup(group, GetCurrentNS() - start_ns);
+            }
+            leaveActive();
+            handlePreempted(cb_fiber);
             cb_fiber.reset();
+            t_task_group = DEFAULT_GROUP;
+            if (m_elastic) {
+                t_last_busy_ms = GetCurrentMS();
+            }
         } else {
             // 任务队列空
             if (idle_fiber->getState() == Fiber::TERM) {
@@ -178,9 +1343,71 @@ void Scheduler::run() {
             --m_idleThreadCount;
         }
     }
+    if (has_preempt_timer) {
+        timer_delete(preempt_timer);
+    }
+    // 因为长时间空闲而退出的线程，把指定在本线程的任务交给其他线程
+    if (t_retiring) {
+        t_retiring = false;
+        {
+            MutexType::Lock lock(m_mutex);
+            // idle处理IO事件时可能放进了run next槽位，槽位里的协程没有固定线程
+            if (t_run_next) {
+                ScheduleTask next(&t_run_next, -1);
+                next.group = resolveGroupNoLock(next.fiber.get(), -1);
+                enqueueNoLock(next, HIGH);
+            }
+            retireThreadNoLock();
+        }
+        tickle();
+    }
     // std::cout << "Scheduler::run() exit" << std::endl;
 }
 
+void Scheduler::scheduleNext(Fiber::ptr fiber) {
+    if (GetThis() != this) {
+        schedule(fiber, -1, HIGH);
+        return;
+    }
+    // 槽位是和调度协程共享的线程局部变量，改到一半不能被切走
+    PreemptGuard guard;
+    // 没指定协程时放入的是通过yieldTo交出执行权的协程
+    if (!fiber) {
+        fiber.swap(t_handoff_fiber);
+    }
+    assert(fiber->getState() == Fiber::READY);
+    // 槽位里原有的协程挤回任务队列，它本来马上就要运行，按高优先级排队
+    t_run_next.swap(fiber);
+    if (fiber) {
+        schedule(fiber, -1, HIGH);
+    }
+}
+
+void Scheduler::yieldTo(Fiber::ptr fiber) {
+    assert(GetThis() == this);
+    Fiber::ptr cur = Fiber::GetThis();
+    assert(cur->isRunInScheduler() && cur != fiber);
+    // 登记交接状态到切换完成之间不能被抢占
+    PreemptGuard guard;
+    // 连续的yieldTo，上一个交出执行权的协程上下文早已保存，可以直接放回任务队列，
+    // 如果它就是要切换的目标，那就是两个协程互相交接，不需要再排队
+    if (t_handoff_fiber && t_handoff_fiber != fiber) {
+        schedule(t_handoff_fiber);
+    }
+    t_handoff_fiber = cur;
+    t_handoff_running = fiber;
+
+    // 手动释放栈上的引用，两个协程的生命周期由上面两个线程局部变量维持
+    auto raw_ptr = cur.get();
+    auto next = fiber.get();
+    cur.reset();
+    fiber.reset();
+    ++t_resume_seq;
+    t_coop_ops = 0;
+    t_coop_start_us = 0;
+    raw_ptr->yieldTo(next);
+}
+
 void Scheduler::stop() {
     // std::cout << "stop" << std::endl;
     if (stopping()) {
@@ -195,9 +1422,7 @@ void Scheduler::stop() {
         assert(GetThis() != this);
     }
 
-    for (size_t i = 0; i < m_threadCount; ++i) {
-        tickle();
-    }
+    tickleAll();
 
     if (m_rootFiber) {
         tickle();
@@ -213,6 +1438,8 @@ void Scheduler::stop() {
     {
         MutexType::Lock lock(m_mutex);
         thrs.swap(m_threads);
+        thrs.insert(thrs.end(), m_retiredThreads.begin(), m_retiredThreads.end());
+        m_retiredThreads.clear();
     }
     // 等待任务队列空，且每个线程的idle协程都结束为止(此时线程才可能结束)
     for (auto &i: thrs) {
@@ -222,7 +1449,43 @@ void Scheduler::stop() {
 
 void Scheduler::idle() {
     // std::cout << "idle" << std::endl;
-    while (!stopping()) {
+    static_assert(sizeof(m_parkSeq) == sizeof(int), "futex word must be 32 bits");
+    // idle协程不是普通任务，不能被抢占后排进任务队列
+    PreemptGuard guard;
+    while (!stopping() && !shouldRetire()) {
+        // 先记下序号再检查任务，这之后的tickle都会改变序号，futex不会错过
+        uint32_t seq = m_parkSeq;
+        bool tickled = false;
+        // 短暂自旋，任务很快到来时可以省掉睡眠和唤醒的系统调用
+        for (int i = 0; i < IDLE_SPIN_COUNT; ++i) {
+            if (m_parkSeq != seq) {
+                tickled = true;
+                break;
+            }
+            cpu_relax();
+        }
+        if (!tickled) {
+            ++m_parkedThreadCount;
+            bool has_task = false;
+            {
+                // 睡眠计数加1之后再检查一次任务队列，此后加入的任务都会tickle
+                MutexType::Lock lock(m_mutex);
+                // 停止期间其他线程还在执行任务时照样睡，最后一个任务结束时会tickleAll
+                has_task = hasRunnableTaskNoLock(GetThreadId())
+                        || m_inbox.load(std::memory_order_relaxed)
+                        || (m_stopping && m_taskCount == 0 && m_activeThreadCount == 0);
+            }
+            if (!has_task) {
+                // 有调度组被限流时睡到它恢复为止
+                uint64_t timeout = std::min<uint64_t>(MAX_PARK_TIMEOUT, getThrottleTimeout());
+                struct timespec ts;
+                ts.tv_sec = timeout / 1000;
+                ts.tv_nsec = (timeout % 1000) * 1000 * 1000;
+                syscall(SYS_futex, &m_parkSeq, FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+            }
+            --m_parkedThreadCount;
+        }
+
         auto cur = Fiber::GetThis();
         auto raw_ptr = cur.get();
         cur.reset();
@@ -233,13 +1496,31 @@ void Scheduler::idle() {
 
 void Scheduler::tickle() {
     // std::cout << "tickle" << std::endl;
+    ++m_parkSeq;
+    if (m_parkedThreadCount > 0) {
+        syscall(SYS_futex, &m_parkSeq, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+}
+
+void Scheduler::tickleAll() {
+    ++m_parkSeq;
+    if (m_parkedThreadCount > 0) {
+        syscall(SYS_futex, &m_parkSeq, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
+void Scheduler::leaveActive() {
+    if (--m_activeThreadCount == 0 && m_stopping && stopping()) {
+        tickleAll();
+    }
 }
 
 bool Scheduler::stopping() {
     MutexType::Lock lock(m_mutex);
     // 真正的停止必须要满足：
     // 1. 有线程调用了调度器的停止方法
-    // 2. 任务队列已经空，所有任务执行完毕
+    // 2. 任务队列和收件箱都已经空，所有任务执行完毕
     // 3. 当前没有活跃线程在执行任务
-    return m_stopping && m_tasks.empty() && m_activeThreadCount == 0;
+    return m_stopping && m_taskCount == 0 && m_activeThreadCount == 0
+            && !m_inbox.load(std::memory_order_relaxed);
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include <atomic>
 #include <list>
 #include <vector>
+#include <unordered_map>
+#include <map>
 #include <iostream>
 #include <functional>
 #include <memory>
@@ -18,13 +20,150 @@ public:
     using ptr = std::shared_ptr<Scheduler>;
     using MutexType = Mutex;
 
+    /**
+     * @brief 任务优先级
+     * @details 每个优先级一个任务队列，按权重轮转挑选，队列都不空时低优先级也能按权重分到执行机会
+    */
+    enum Priority {
+        /// 延迟敏感的任务，比如IO就绪后唤醒的协程、健康检查
+        HIGH = 0,
+        /// 默认优先级
+        NORMAL = 1,
+        /// 后台批量任务，比如刷新缓存、刷日志
+        LOW = 2,
+        /// 优先级个数
+        PRIORITY_COUNT = 3
+    };
+
+    /**
+     * @brief 弹性线程池策略
+     * @details 任务积压或者所有工作线程都在忙的状态持续一段时间后扩容一个线程，
+     * 工作线程连续空闲一段时间后退出，线程数始终在[minThreads, maxThreads]之间
+    */
+    struct ElasticPolicy {
+        /// 最少工作线程数，不包含use_caller的主线程
+        size_t minThreads = 1;
+        /// 最多工作线程数，不包含use_caller的主线程
+        size_t maxThreads = 1;
+        /// 任务队列积压到多少个任务算过载
+        size_t growBacklog = 64;
+        /// 过载持续多久(毫秒)扩容一个线程，0表示发现过载就扩容
+        uint64_t growAfterMs = 10;
+        /// 工作线程连续空闲多久(毫秒)后退出
+        uint64_t retireIdleMs = 10000;
+    };
+
+    /**
+     * @brief 工作线程的CPU亲和性策略
+     * @details 第i个工作线程绑定到放置顺序里的第i % n个CPU上，use_caller的主线程不绑定
+    */
+    struct AffinityPolicy {
+        enum Type {
+            /// 不绑定CPU
+            NONE,
+            /// 紧凑，按NUMA节点依次排列CPU，先占满一个节点再用下一个节点
+            COMPACT,
+            /// 分散，轮流从每个NUMA节点取CPU，让工作线程均匀分布在各节点上
+            SCATTER,
+            /// 显式指定CPU列表
+            EXPLICIT
+        };
+        /// 策略类型
+        Type type;
+        /// EXPLICIT时使用的CPU列表
+        std::vector<int> cpus;
+
+        AffinityPolicy(Type t = NONE, const std::vector<int>& c = std::vector<int>())
+            : type(t), cpus(c) {}
+    };
+
+    /**
+     * @brief 准入控制的限制
+     * @details 两个条件任意一个满足就算饱和，都为0表示不限制
+    */
+    struct AdmissionPolicy {
+        /// 通过submit加入、还在排队的任务数上限
+        size_t maxQueued = 0;
+        /// 排队时间上限(毫秒)，最近一个取出的submit任务排队超过这么久算饱和，排空后恢复
+        uint64_t maxQueueDelayMs = 0;
+    };
+
+    /**
+     * @brief 调度器饱和时submit的处理方式
+    */
+    enum OverflowAction {
+        /// 直接拒绝，submit返回false
+        REJECT,
+        /// 阻塞调用方直到有空位，在任务协程里调用时挂起协程，否则阻塞线程
+        BLOCK,
+        /// 丢弃排队最久的submit任务
+        SHED_OLDEST,
+        /// 丢弃优先级最低的submit任务里排队最久的，新任务的优先级更低时拒绝新任务
+        SHED_LOWEST
+    };
+
+    /**
+     * @brief 准入控制统计
+    */
+    struct AdmissionStats {
+        /// 接受的任务数
+        uint64_t admitted;
+        /// 拒绝的任务数
+        uint64_t rejected;
+        /// 丢弃的任务数
+        uint64_t shed;
+        /// 阻塞过的submit调用数
+        uint64_t blocked;
+        /// 还在排队的submit任务数
+        size_t queued;
+        /// 最近一个取出的submit任务的排队时间(毫秒)
+        uint64_t queueDelayMs;
+        /// 当前是否饱和
+        bool saturated;
+    };
+
+    /// 默认调度组id，没有指定调度组的任务都在这个组里
+    static const int DEFAULT_GROUP = 0;
+    /// 调度组个数上限，包括默认组
+    static const int MAX_GROUPS = 64;
+
+    /**
+     * @brief 调度组的运行统计
+    */
+    struct GroupStats {
+        /// 调度组id
+        int id;
+        /// 调度组名称
+        std::string name;
+        /// 权重
+        uint32_t weight;
+        /// 每个周期可用的CPU时间(微秒)，0表示不限制
+        uint64_t quotaUs;
+        /// 配额周期(微秒)
+        uint64_t periodUs;
+        /// 累计运行时间(微秒)
+        uint64_t cpuTimeUs;
+        /// 虚拟运行时间(纳秒)，运行时间按权重折算
+        uint64_t vruntime;
+        /// 排队中的任务数
+        size_t queued;
+        /// 执行过的任务数，协程每被resume一次算一个
+        uint64_t runCount;
+        /// 被限流的次数
+        uint64_t throttledCount;
+        /// 当前是否被限流
+        bool throttled;
+    };
+
     /**
      * @brief 创建调度器
      * @param threads 线程数
      * @param use_caller 是否将当前线程作为调度线程，如主线程不参与调度，就必须创建其他线程来调度
      * @param name 名称
+     * @param affinity 工作线程的CPU亲和性策略，默认不绑定
     */
-    Scheduler(size_t threads = 1, bool use_caller = true, const std::string &name = "Scheduler");
+    Scheduler(size_t threads = 1, bool use_caller = true, const std::string &name = "Scheduler",
+              const AffinityPolicy& affinity = AffinityPolicy());
 
     /**
      * @brief 析构函数
@@ -52,19 +191,185 @@ public:
      * @tparam FiberOrCb 调度任务类型，可以是协程对象或者函数指针
      * @param fc 协程对象或者指针
      * @param thread 指定运行该任务时的线程号，-1表示任意线程
+     * @param priority 任务优先级
+     * @param group 调度组id，-1表示协程沿用自己所属的组，
+     * 没有所属组的协程和函数归入当前任务的组，不在本调度器的任务里调用时归入默认组
     */
     template <class FiberOrCb>
-    void schedule(FiberOrCb fc, int thread = -1) {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            need_tickle = scheduleNoLock(fc, thread);
-        }
-        if (need_tickle) {
-            tickle(); // 唤醒idle协程
-        }
+    void schedule(FiberOrCb fc, int thread = -1, Priority priority = NORMAL, int group = -1) {
+        scheduleImpl(fc, thread, priority, group, 0);
+    }
+
+    /**
+     * @brief 添加有截止时间的调度任务
+     * @details 有截止时间的任务放在按截止时间排序的堆里，指定了线程的任务在该线程自己的堆里，
+     * 调度线程先从公共堆和自己的堆里取截止时间最早的任务，都没有时才按调度组和优先级取普通任务，
+     * 不受调度组配额限制。协程会记住截止时间，之后被IO唤醒、被抢占重新排队时仍然按截止时间排队，
+     * 在协程里调用的hook IO也以截止时间为限，见Fiber::setDeadline
+     * @param fc 协程对象或者指针
+     * @param deadline_ms 截止时间(毫秒，GetCurrentMS的时间)，0等同于schedule
+     * @param thread 指定运行该任务时的线程号，-1表示任意线程
+     * @param group 调度组id，用于统计运行时间，规则同schedule
+    */
+    template <class FiberOrCb>
+    void scheduleWithDeadline(FiberOrCb fc, uint64_t deadline_ms, int thread = -1, int group = -1) {
+        scheduleImpl(fc, thread, NORMAL, group, deadline_ms);
     }
 
+    /**
+     * @brief 设置过期任务的处理回调
+     * @details 调度线程取到已经过了截止时间的任务时调用，回调在调度协程里执行，不能阻塞。
+     * 函数任务直接丢弃不再执行，回调的协程参数为空；
+     * 协程任务可能已经执行了一半，不能直接丢弃，回调之后取消协程并照常运行，
+     * 协程阻塞在hook的IO上时以ECANCELED返回，由协程自己收尾。
+     * 不设置回调时过期任务照常运行
+     * @param[in] cb 回调，参数是过期的协程和它的截止时间
+    */
+    void setDeadlineDropCallback(std::function<void(Fiber::ptr, uint64_t)> cb);
+
+    /**
+     * @brief 获取因为过期被丢弃或者取消的任务数
+    */
+    uint64_t getDeadlineDropCount() const {return m_deadlineDropCount;}
+
+    /**
+     * @brief 设置准入控制的限制
+     * @details 只约束submit加入的任务，schedule不受限制，IO唤醒、定时器等内部调度永远不会被拒绝或丢弃。
+     * 放宽限制时唤醒所有阻塞在submit上的调用方
+    */
+    void setAdmissionPolicy(const AdmissionPolicy& policy);
+
+    /**
+     * @brief 受准入控制的添加任务
+     * @details 没有饱和时等同于schedule。饱和时按action处理，
+     * 被丢弃的任务不会执行，函数对象直接析构，捕获的资源(比如连接)随之释放
+     * @param[in] cb 任务函数
+     * @param[in] action 饱和时的处理方式
+     * @param[in] priority 任务优先级
+     * @param[in] group 调度组id，规则同schedule
+     * @return 任务是否被接受
+    */
+    bool submit(std::function<void()> cb, OverflowAction action = REJECT,
+                Priority priority = NORMAL, int group = -1);
+
+    /**
+     * @brief 调度器是否饱和，accept循环可以据此暂停接受新连接
+    */
+    bool isSaturated() const {return m_saturated;}
+
+    /**
+     * @brief 设置饱和状态变化的回调
+     * @details 进入饱和和退出饱和时各调用一次，在调用submit或者取出任务的线程上执行，不能阻塞
+     * @param[in] cb 回调，参数为变化后是否饱和
+    */
+    void setSaturationCallback(std::function<void(bool)> cb);
+
+    /**
+     * @brief 获取准入控制统计
+    */
+    AdmissionStats getAdmissionStats();
+
+    /**
+     * @brief 把协程放到当前线程的run next槽位
+     * @details 槽位中的协程在当前任务让出执行权后立即在本线程运行，不经过任务队列也不用加锁，
+     * 适合唤醒刚等到结果的协程；槽位里原有的协程被挤回高优先级队列。
+     * 不是在本调度器的线程上调用时，等同于按高优先级schedule
+     * @param[in] fiber 要运行的协程，必须是READY状态
+    */
+    void scheduleNext(Fiber::ptr fiber);
+
+    /**
+     * @brief 当前协程把执行权直接交给fiber
+     * @details 只需一次上下文切换，不经过调度协程和任务队列。
+     * 当前协程等fiber让出执行权后放进run next槽位，接着在本线程继续运行
+     * @attention 只能在本调度器的任务协程中调用，fiber必须是READY状态且不在任何任务队列里
+     * @param[in] fiber 要切换到的协程
+    */
+    void yieldTo(Fiber::ptr fiber);
+
+    /**
+     * @brief 开启弹性线程池
+     * @details 可以在调度器启动前后调用，当前线程数少于下限时立即补足。
+     * 退出的线程上指定了线程号的任务改为任意线程可运行
+     * @param[in] policy 弹性策略
+    */
+    void setElastic(const ElasticPolicy& policy);
+
+    /**
+     * @brief 获取当前的工作线程数，不包含use_caller的主线程
+    */
+    size_t getThreadCount() const {return m_liveThreadCount;}
+
+    /**
+     * @brief 获取工作线程的id，不包含use_caller的主线程
+    */
+    std::vector<int> getWorkerThreadIds();
+
+    /**
+     * @brief 开启抢占式调度
+     * @details 每个调度线程创建一个按线程CPU时间计时的定时器，每半个时间片给自己发一次SIGURG。
+     * 同一个任务协程连续运行跨过两次信号时，信号处理函数把它切回调度协程，
+     * 重新排到任务队列末尾，并固定在本线程上继续运行。协程被抢占的次数见Fiber::getPreemptCount
+     * @attention 可以随时调用，各线程在下次调度任务时生效。以下情况不会抢占，等下一个时间片再试：
+     * 持有Mutex/RWMutex、处于PreemptGuard作用域内、被打断的指令不在主程序的代码段里
+     * (比如正在malloc或者其他动态库函数里，这些函数内部可能持有锁)。
+     * 持有std::mutex等其他锁，或者正在读改写线程局部的缓存时需要自己加PreemptGuard，
+     * 否则同一线程上接着运行的协程会看到改了一半的状态。程序静态链接libc时不能开启
+     * @param[in] slice_us 时间片(微秒)，0表示关闭
+    */
+    void setPreemption(uint64_t slice_us);
+
+    /**
+     * @brief 设置协作式让出预算
+     * @details 数据一直就绪时hook的IO不会阻塞，协程可以一直占着线程。
+     * 协程从被调度起连续完成ops次没有阻塞的hook IO，或者运行时间超过quantum_us，
+     * 下一次IO完成后自动让出，重新排到任务队列末尾。两个都为0表示关闭
+     * @param[in] ops 连续IO次数上限，默认128
+     * @param[in] quantum_us 运行时间上限(微秒)，默认0不限制
+    */
+    void setCoopBudget(uint32_t ops, uint64_t quantum_us = 0);
+
+    /**
+     * @brief 设置各优先级的权重
+     * @details 每个优先级按权重发放额度，取一个任务扣一次额度，有任务可取的队列额度都用完后重新发放。
+     * 默认8:4:1，也就是所有队列都积压时，每13个任务里高、中、低优先级分别占8、4、1个
+    */
+    void setPriorityWeights(uint32_t high, uint32_t normal, uint32_t low);
+
+    /**
+     * @brief 创建调度组
+     * @details 调度器在有任务的组之间挑虚拟运行时间最小的组取任务，组内再按优先级权重轮转。
+     * 任务运行的时间按1024/weight折算后计入所属组的虚拟运行时间，
+     * 所以各组积压时分到的CPU时间和权重成正比。
+     * 设置了配额的组在一个周期内用完配额后被限流，直到下个周期开始才会再被调度
+     * @param[in] name 调度组名称
+     * @param[in] weight 权重，默认组是1024
+     * @param[in] quota_us 每个周期可用的CPU时间(微秒)，0表示不限制
+     * @param[in] period_us 配额周期(微秒)
+     * @return 调度组id，组数达到上限时返回-1
+    */
+    int addGroup(const std::string& name, uint32_t weight = 1024,
+                 uint64_t quota_us = 0, uint64_t period_us = 100000);
+
+    /**
+     * @brief 修改调度组的权重和配额，包括默认组
+    */
+    void setGroupPolicy(int group, uint32_t weight, uint64_t quota_us = 0,
+                        uint64_t period_us = 100000);
+
+    /**
+     * @brief 获取所有调度组的运行统计
+    */
+    std::vector<GroupStats> getGroupStats();
+
+    /**
+     * @brief 消耗一次协作预算，预算用完时让出当前协程
+     * @details 由hook的IO函数在没有阻塞直接完成时调用。让出前先非阻塞地处理一遍IO事件和定时器，
+     * 被唤醒的协程排在当前协程前面，当前协程固定在本线程继续运行。
+     * 不在本调度器的任务协程中或者持有锁时不让出
+    */
+    void consumeBudget();
+
     /**
      * @brief 启动调度器
     */
@@ -78,11 +383,18 @@ public:
 protected:
     /**
      * @brief 通知协程调度有任务了
+     * @details 唤醒一个睡在futex上的idle线程，没有线程睡下时不产生系统调用
      * @note 设置为虚拟函数是因为子类要重新实现，
      * 不同的子类有不同的tickle操作
     */
     virtual void tickle();
 
+    /**
+     * @brief 唤醒所有idle线程
+     * @details 停止期间idle线程照常睡眠，执行完最后一个任务的线程用它叫醒大家退出
+    */
+    virtual void tickleAll();
+
     /**
      * @brief 协程调度函数
     */
@@ -90,9 +402,17 @@ protected:
 
     /**
      * @brief 无任务调度时执行idle协程
+     * @details 先短暂自旋等待tickle，然后睡在futex上，直到tickle或者超时
     */
     virtual void idle();
 
+    /**
+     * @brief 任务一直排满、idle协程没有机会运行时，由run插空调用
+     * @details 协程被抢占说明本线程一直有任务可跑，IO调度器借此机会非阻塞地处理定时器和IO事件，
+     * 避免它们被饿住。基类没有需要处理的事情
+    */
+    virtual void poll() {}
+
     /**
      * @brief 返回是否可以停止
     */
@@ -108,20 +428,110 @@ protected:
      * @details 当调度协程进入idel时空闲线程数+1，从idle协程返回时空闲线程数-1
     */
     bool hasIdleThreads() {return m_idleThreadCount > 0;}
+
+    /**
+     * @brief 返回空闲线程数
+    */
+    size_t getIdleThreadCount() const {return m_idleThreadCount;}
+
+    /**
+     * @brief 任务队列中是否有任务
+     * @details 不加锁，只用于自旋等待时快速判断，队列中的任务可能指定了其他线程，
+     * 被限流的调度组里的任务不算，收件箱里还没取走的任务算
+    */
+    bool hasPendingTasks() const {
+        return m_taskCount > m_throttledTaskCount || m_inbox.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 距离最近一个被限流的调度组恢复还有多久(毫秒)
+     * @details idle线程睡眠不能超过这个时间，否则限流结束后没人去取这些组的任务
+     * @return 没有被限流的组时返回~0ull
+    */
+    uint64_t getThrottleTimeout();
+
+    /**
+     * @brief 当前工作线程是否应该退出
+     * @details 弹性模式下线程连续空闲超过时限、线程数多于下限，并且没有指定在本线程上的任务时返回真，
+     * 返回真时线程数已经减一，idle协程看到后应该结束，run随后退出，不再取新的任务
+    */
+    bool shouldRetire();
 private:
+    /**
+     * @brief 创建一个工作线程(无锁)
+    */
+    void spawnThreadNoLock();
+
+    /**
+     * @brief 过载持续时间足够长时扩容一个工作线程
+    */
+    void maybeGrow();
+
+    /**
+     * @brief 工作线程退出前把指定在本线程的任务交给其他线程(无锁)
+     * @details 决定退出时本线程上没有固定的任务，这之后别的线程指定过来的任务改为任意线程可运行
+    */
+    void retireThreadNoLock();
+
     /**
      * @brief 协程调度启动(无锁)
     */
     template<class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread) {
-        bool need_tickle = m_tasks.empty();
+    bool scheduleNoLock(FiberOrCb fc, int thread, Priority priority, int group, uint64_t deadline) {
         ScheduleTask ft(fc, thread);
-        if (ft.fiber || ft.cb) {
-            m_tasks.push_back(ft);
+        return scheduleTaskNoLock(ft, priority, group, deadline);
+    }
+
+    /**
+     * @brief 添加调度任务的公共实现
+     * @details 本调度器的线程加锁直接放进任务队列；其他线程不抢m_mutex，
+     * 放进无锁的收件箱，由工作线程找任务时批量取走
+    */
+    template<class FiberOrCb>
+    void scheduleImpl(FiberOrCb fc, int thread, Priority priority, int group, uint64_t deadline) {
+        bool need_tickle = false;
+        if (GetThis() != this) {
+            need_tickle = pushInbox(ScheduleTask(fc, thread), priority, group, deadline);
+        } else {
+            MutexType::Lock lock(m_mutex);
+            need_tickle = scheduleNoLock(fc, thread, priority, group, deadline);
+        }
+        if (need_tickle) {
+            tickle(); // 唤醒idle协程
+        }
+        if (m_elastic) {
+            maybeGrow();
         }
-        return need_tickle;
     }
 
+    /**
+     * @brief 线程号是否属于还在运行的调度线程(无锁)
+    */
+    bool isLiveThreadNoLock(int thread) const;
+
+    /**
+     * @brief 当前线程上是否有可以运行的任务(无锁)
+    */
+    bool hasRunnableTaskNoLock(int thread) const;
+
+    /**
+     * @brief 有没有指定在这个线程上的任务(无锁)
+     * @details 被限流的调度组里的任务也算，被抢占的协程就排在这些队列里等本线程回来
+    */
+    bool hasPinnedTaskNoLock(int thread) const;
+
+    /**
+     * @brief 任务协程回到调度协程后检查是否被抢占
+     * @details 被抢占的协程先等poll处理完到期的定时器和IO事件，再排到任务队列末尾，固定在本线程上运行
+    */
+    void handlePreempted(const Fiber::ptr& fiber);
+
+    /**
+     * @brief 任务执行完，活跃线程数减一
+     * @details 正在停止时最后一个活跃线程退出任务后已经满足停止条件，唤醒所有睡着的idle线程
+    */
+    void leaveActive();
+
 private:
     /**
      * @brief 调度任务，协程/函数二选一可指定在哪个线程上调度
@@ -130,6 +540,14 @@ private:
         Fiber::ptr fiber;
         std::function<void()> cb;
         int thread;
+        /// 所属调度组id
+        int group = DEFAULT_GROUP;
+        /// 截止时间(毫秒)，0表示没有
+        uint64_t deadline = 0;
+        /// submit加入的序号，0表示不是submit加入的任务
+        uint64_t admitSeq = 0;
+        /// submit加入的时间(毫秒)
+        uint64_t admitMs = 0;
 
         ScheduleTask(Fiber::ptr f, int thr): fiber(f), thread(thr) {}
 
@@ -149,8 +567,198 @@ private:
             fiber = nullptr;
             cb = nullptr;
             thread = -1;
+            group = DEFAULT_GROUP;
+            deadline = 0;
+            admitSeq = 0;
+            admitMs = 0;
+        }
+    };
+
+    /**
+     * @brief 截止时间堆里的任务
+    */
+    struct DeadlineTask {
+        /// 截止时间(毫秒)
+        uint64_t deadline;
+        /// 入堆序号，截止时间相同的任务先到先运行
+        uint64_t seq;
+        ScheduleTask task;
+
+        /// 堆顶是截止时间最早的任务
+        bool operator < (const DeadlineTask& rhs) const {
+            return deadline != rhs.deadline ? deadline > rhs.deadline : seq > rhs.seq;
         }
     };
+
+    /**
+     * @brief 调度组
+     * @details 队列、额度和限流状态在m_mutex保护下修改，
+     * 运行时间由各线程在任务切回调度协程后直接累加，不加锁
+    */
+    struct Group {
+        /// 名称
+        std::string name;
+        /// 权重
+        std::atomic<uint32_t> weight = {1024};
+        /// 每个周期可用的CPU时间(微秒)，0表示不限制
+        uint64_t quotaUs = 0;
+        /// 配额周期(微秒)
+        uint64_t periodUs = 100000;
+        /// 任务队列，每个优先级一个
+        std::list<ScheduleTask> tasks[PRIORITY_COUNT];
+        /// 各优先级本轮剩余的额度
+        uint32_t credits[PRIORITY_COUNT] = {8, 4, 1};
+        /// 排队中的任务数
+        size_t queued = 0;
+        /// 是否被限流
+        bool throttled = false;
+        /// 当前配额周期的开始时间(纳秒)
+        uint64_t periodStartNs = 0;
+        /// 被限流的次数
+        uint64_t throttledCount = 0;
+        /// 虚拟运行时间(纳秒)
+        std::atomic<uint64_t> vruntime = {0};
+        /// 累计运行时间(纳秒)
+        std::atomic<uint64_t> cpuTimeNs = {0};
+        /// 当前配额周期内的运行时间(纳秒)
+        std::atomic<uint64_t> periodUsedNs = {0};
+        /// 执行过的任务数
+        std::atomic<uint64_t> runCount = {0};
+    };
+
+    /**
+     * @brief 排队中的submit任务的位置，丢弃任务时用
+    */
+    struct AdmitEntry {
+        Group* group;
+        std::list<ScheduleTask>::iterator it;
+    };
+
+    /**
+     * @brief 阻塞在submit上等待空位的调用方，协程和线程二选一
+    */
+    struct AdmissionWaiter {
+        /// 等待的协程
+        Fiber::ptr fiber;
+        /// 协程所在的调度器，不一定是本调度器
+        Scheduler* scheduler;
+        /// 等待的线程用的信号量
+        Semaphore* sem;
+    };
+
+    /**
+     * @brief 收件箱节点
+    */
+    struct InboxNode {
+        /// 任务，截止时间已经填好
+        ScheduleTask task;
+        /// 优先级
+        Priority priority = NORMAL;
+        /// 调度组id，加入时已经确定
+        int group = DEFAULT_GROUP;
+        /// 收件箱里更早加入的节点
+        InboxNode* next = nullptr;
+    };
+
+    /**
+     * @brief 把任务放进任务队列(无锁)
+     * @return 是否需要tickle
+    */
+    bool scheduleTaskNoLock(ScheduleTask& task, Priority priority, int group, uint64_t deadline);
+
+    /**
+     * @brief 把任务放进收件箱
+     * @details 节点优先从本线程的节点缓存里取，取空了再把全局空闲链表整个拿过来，都没有时才分配
+     * @return 收件箱原来是不是空的，是的话需要tickle
+    */
+    bool pushInbox(ScheduleTask&& task, Priority priority, int group, uint64_t deadline);
+
+    /**
+     * @brief 把收件箱里的任务一次全部取出，按加入的顺序放进任务队列(无锁)
+    */
+    void drainInboxNoLock();
+
+    /**
+     * @brief 分配收件箱节点，优先复用回收的节点
+    */
+    static InboxNode* AllocInboxNode();
+
+    /**
+     * @brief 回收一串收件箱节点，挂回全局空闲链表
+    */
+    static void FreeInboxNodes(InboxNode* head);
+
+    /**
+     * @brief 确定任务所属的调度组(无锁)
+     * @details 协程第一次加入调度时记下所属的组，之后被唤醒、被抢占重新排队都回到这个组
+    */
+    int resolveGroupNoLock(Fiber* fiber, int group);
+
+    /**
+     * @brief 任务放进所属调度组的队列(无锁)
+    */
+    void enqueueNoLock(ScheduleTask& task, Priority priority);
+
+    /**
+     * @brief 是否饱和(无锁)
+    */
+    bool saturatedNoLock() const;
+
+    /**
+     * @brief 按丢弃策略从队列里摘掉一个submit任务(无锁)
+     * @param[in] action SHED_OLDEST或者SHED_LOWEST
+     * @param[in] incoming 新任务的优先级
+     * @param[out] victim 被丢弃的任务函数，在锁外析构
+     * @return 没有可以丢弃的任务时返回false
+    */
+    bool shedOneNoLock(OverflowAction action, Priority incoming, std::function<void()>& victim);
+
+    /**
+     * @brief 更新饱和状态，发生变化时调用回调
+    */
+    void updateSaturation(bool saturated);
+
+    /**
+     * @brief submit任务被取出后，有空位的话唤醒一个阻塞的调用方
+    */
+    void onAdmittedTaskTaken();
+
+    /**
+     * @brief 从公共堆和本线程的堆里取截止时间最早的任务(无锁)
+    */
+    bool takeDeadlineTaskNoLock(ScheduleTask& task, bool& tickle_me);
+
+    /**
+     * @brief 处理过了截止时间的任务
+     * @return 任务是否已被丢弃
+    */
+    bool dropExpired(ScheduleTask& task);
+
+    /**
+     * @brief 从一个调度组里按优先级权重轮转取一个本线程可以运行的任务(无锁)
+    */
+    bool takeFromGroupNoLock(Group* group, ScheduleTask& task, int& priority, bool& tickle_me);
+
+    /**
+     * @brief 更新各调度组的限流状态(无锁)
+     * @details 配额周期结束的组解除限流，当前周期用完配额的组开始限流
+    */
+    void refreshThrottleNoLock(uint64_t now_ns);
+
+    /**
+     * @brief 把任务的运行时间计入调度组
+    */
+    void chargeGroup(int group, uint64_t ns);
+
+    /**
+     * @brief 取一个本线程可以运行的任务(无锁)
+     * @details 按虚拟运行时间从小到大依次尝试有任务且没有被限流的调度组，组内按优先级权重轮转
+     * @param[out] task 取到的任务
+     * @param[out] priority 取到的任务的优先级
+     * @param[out] tickle_me 队列里还有任务或者有指定给其他线程的任务，需要通知其他线程
+     * @return 是否取到任务
+    */
+    bool takeTaskNoLock(ScheduleTask& task, int& priority, bool& tickle_me);
 private:
     /// 协程调度器名称
     std::string m_name;
@@ -158,16 +766,101 @@ private:
     MutexType m_mutex;
     /// 线程池，使用智能指针
     std::vector<Thread::ptr> m_threads;
-    /// 任务队列
-    std::list<ScheduleTask> m_tasks;
+    /// 调度组，下标就是组id，创建后直到调度器析构都不会释放
+    Group* m_groups[MAX_GROUPS] = {};
+    /// 调度组个数
+    std::atomic<int> m_groupCount = {0};
+    /// 设置了配额的调度组个数，为0时不用检查限流
+    std::atomic<int> m_quotaGroupCount = {0};
+    /// 挑选过的调度组里最大的虚拟运行时间，空闲后重新有任务的组从这里起步
+    uint64_t m_minVruntime = 0;
+    /// 各优先级的权重
+    uint32_t m_priorityWeights[PRIORITY_COUNT] = {8, 4, 1};
+    /// 所有任务队列中的任务数，可以不加锁读取
+    std::atomic<size_t> m_taskCount = {0};
+    /// 被限流的调度组里的任务数
+    std::atomic<size_t> m_throttledTaskCount = {0};
+    /// 有截止时间的任务，按线程号分堆，-1是不指定线程的公共堆
+    std::unordered_map<int, std::vector<DeadlineTask>> m_deadlineHeaps;
+    /// 所有截止时间堆里的任务数
+    size_t m_deadlineTaskCount = 0;
+    /// 截止时间堆的入堆序号
+    uint64_t m_deadlineSeq = 0;
+    /// 过期任务的处理回调
+    std::function<void(Fiber::ptr, uint64_t)> m_deadlineDropCb;
+    /// 是否设置了过期任务的处理回调
+    std::atomic<bool> m_hasDeadlineDropCb = {false};
+    /// 因为过期被丢弃或者取消的任务数
+    std::atomic<uint64_t> m_deadlineDropCount = {0};
+    /// 准入控制的限制
+    AdmissionPolicy m_admissionPolicy;
+    /// 排队中的submit任务，每个优先级一个，按序号排序
+    std::map<uint64_t, AdmitEntry> m_admitted[PRIORITY_COUNT];
+    /// 排队中的submit任务数
+    size_t m_admittedCount = 0;
+    /// submit任务的序号
+    uint64_t m_admitSeq = 0;
+    /// 最近一个取出的submit任务的排队时间(毫秒)
+    uint64_t m_queueDelayMs = 0;
+    /// 阻塞在submit上的调用方
+    std::list<AdmissionWaiter> m_admissionWaiters;
+    /// 阻塞在submit上的调用方个数，可以不加锁读取
+    std::atomic<size_t> m_admissionWaiterCount = {0};
+    /// 是否饱和
+    std::atomic<bool> m_saturated = {false};
+    /// 饱和状态变化的回调
+    std::function<void(bool)> m_saturationCb;
+    /// 接受、拒绝、丢弃的任务数和阻塞过的submit调用数
+    std::atomic<uint64_t> m_admittedTotal = {0};
+    std::atomic<uint64_t> m_rejectedTotal = {0};
+    std::atomic<uint64_t> m_shedTotal = {0};
+    std::atomic<uint64_t> m_blockedTotal = {0};
     /// 线程池的线程ID数组
     std::vector<int> m_threadIds;
     /// 工作线程数量，不包含use_caller的主线程
     size_t m_threadCount = 0;
+    /// 正在运行的工作线程数，不包含use_caller的主线程
+    std::atomic<size_t> m_liveThreadCount = {0};
+    /// 已经退出，等待join的工作线程
+    std::vector<Thread::ptr> m_retiredThreads;
+    /// 下一个工作线程的编号，用于线程命名和选择绑定的CPU
+    size_t m_nextThreadIndex = 0;
+    /// 工作线程绑定CPU的顺序，为空表示不绑定
+    std::vector<int> m_cpuList;
+    /// 是否开启弹性线程池
+    std::atomic<bool> m_elastic = {false};
+    /// 弹性策略的最少线程数，策略各项由工作线程不加锁读取，所以分别存成原子变量
+    std::atomic<size_t> m_elasticMinThreads = {1};
+    /// 弹性策略的最多线程数
+    std::atomic<size_t> m_elasticMaxThreads = {1};
+    /// 弹性策略中算过载的积压任务数
+    std::atomic<size_t> m_elasticGrowBacklog = {64};
+    /// 弹性策略中过载持续多久(毫秒)扩容
+    std::atomic<uint64_t> m_elasticGrowAfterMs = {10};
+    /// 弹性策略中空闲多久(毫秒)退出
+    std::atomic<uint64_t> m_elasticRetireIdleMs = {10000};
+    /// 开始过载的时间(毫秒)，0表示没有过载
+    std::atomic<uint64_t> m_overloadSince = {0};
+    /// 是否已经启动
+    bool m_started = false;
+    /// 抢占时间片(微秒)，0表示不抢占
+    std::atomic<uint64_t> m_preemptSliceUs = {0};
+    /// 协作预算，连续完成多少次没有阻塞的IO后让出，0表示不限制
+    std::atomic<uint32_t> m_coopOps = {128};
+    /// 协作预算，连续运行多久(微秒)后让出，0表示不限制
+    std::atomic<uint64_t> m_coopQuantumUs = {0};
     /// 活跃线程数
     std::atomic<size_t> m_activeThreadCount = {0};
     /// idle线程数
     std::atomic<size_t> m_idleThreadCount = {0};
+    /// 睡在futex上的idle线程数
+    std::atomic<size_t> m_parkedThreadCount = {0};
+    /// idle线程睡眠用的futex字，每次tickle加1
+    std::atomic<uint32_t> m_parkSeq = {0};
+    /// 收件箱，其他线程添加的任务先压到这个无锁栈上，取出时反转成加入的顺序
+    std::atomic<InboxNode*> m_inbox = {nullptr};
+    /// 收件箱里的任务数，弹性扩容时和任务队列一起算积压
+    std::atomic<size_t> m_inboxCount = {0};
 
     /// 是否use caller
     bool m_useCaller;
@@ -178,5 +871,5 @@ private:
 
 
     /// 是否正在停止
-    bool m_stopping = false;
+    std::atomic<bool> m_stopping = {false};
 };
\ No newline at end of file
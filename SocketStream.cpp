@@ -0,0 +1,317 @@
+#include "SocketStream.h"
+#include "hook.h"
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+/// 空闲列表最多留几个块
+static const size_t MAX_FREE_CHUNKS = 8;
+
+SocketStream::SocketStream(int fd, bool owner, size_t chunk_size)
+    : m_fd(fd)
+    , m_owner(owner)
+    , m_chunkSize(chunk_size ? chunk_size : DEFAULT_CHUNK_SIZE) {
+}
+
+SocketStream::~SocketStream() {
+    if (m_owner) {
+        close();
+    }
+    for (char* chunk : m_readBuf) {
+        delete[] chunk;
+    }
+    for (char* chunk : m_writeBuf) {
+        delete[] chunk;
+    }
+    for (char* chunk : m_freeChunks) {
+        delete[] chunk;
+    }
+}
+
+char* SocketStream::allocChunk() {
+    if (m_freeChunks.empty()) {
+        return new char[m_chunkSize];
+    }
+    char* chunk = m_freeChunks.back();
+    m_freeChunks.pop_back();
+    return chunk;
+}
+
+void SocketStream::freeChunk(char* chunk) {
+    if (m_freeChunks.size() < MAX_FREE_CHUNKS) {
+        m_freeChunks.push_back(chunk);
+    } else {
+        delete[] chunk;
+    }
+}
+
+ssize_t SocketStream::fill(size_t min) {
+    while (m_readable < min) {
+        size_t tail = m_readHead + m_readable;
+        size_t first = tail / m_chunkSize;
+        // 尾部至少留m_readChunks个块，而且要装得下min字节
+        size_t need = std::max(first + m_readChunks, (m_readHead + min + m_chunkSize - 1) / m_chunkSize);
+        while (m_readBuf.size() < need) {
+            m_readBuf.push_back(allocChunk());
+        }
+
+        iovec iov[MAX_IOV];
+        int cnt = 0;
+        size_t offset = tail % m_chunkSize;
+        for (size_t i = first; i < m_readBuf.size() && cnt < MAX_IOV; ++i) {
+            iov[cnt].iov_base = m_readBuf[i] + offset;
+            iov[cnt].iov_len = m_chunkSize - offset;
+            offset = 0;
+            ++cnt;
+        }
+        // hook的readv没有数据时挂起协程
+        ssize_t n = ::readv(m_fd, iov, cnt);
+        if (n <= 0) {
+            return n;
+        }
+        m_readable += n;
+    }
+    return m_readable;
+}
+
+ssize_t SocketStream::fillUntil(char delim, size_t max_len) {
+    size_t scanned = 0;
+    while (true) {
+        ssize_t pos = find(delim, scanned);
+        if (pos >= 0) {
+            if ((size_t)pos >= max_len) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            return pos + 1;
+        }
+        if (m_readable >= max_len) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        // 已经找过的部分不再重复找
+        scanned = m_readable;
+        ssize_t n = fill(m_readable + 1);
+        if (n <= 0) {
+            return n;
+        }
+    }
+}
+
+ssize_t SocketStream::find(char c, size_t from) const {
+    if (from >= m_readable) {
+        return -1;
+    }
+    size_t pos = m_readHead + from;
+    size_t end = m_readHead + m_readable;
+    while (pos < end) {
+        size_t offset = pos % m_chunkSize;
+        size_t len = std::min(m_chunkSize - offset, end - pos);
+        const char* base = m_readBuf[pos / m_chunkSize] + offset;
+        const char* p = (const char*)memchr(base, c, len);
+        if (p) {
+            return pos + (p - base) - m_readHead;
+        }
+        pos += len;
+    }
+    return -1;
+}
+
+void SocketStream::copyOut(char* buf, size_t n) const {
+    assert(n <= m_readable);
+    size_t pos = m_readHead;
+    while (n) {
+        size_t offset = pos % m_chunkSize;
+        size_t len = std::min(m_chunkSize - offset, n);
+        memcpy(buf, m_readBuf[pos / m_chunkSize] + offset, len);
+        buf += len;
+        pos += len;
+        n -= len;
+    }
+}
+
+const char* SocketStream::peek(size_t n) {
+    assert(n <= m_readable);
+    if (m_readBuf.empty()) {
+        return nullptr;
+    }
+    if (m_readHead + n <= m_chunkSize) {
+        return m_readBuf[0] + m_readHead;
+    }
+    m_linear.resize(n);
+    copyOut(&m_linear[0], n);
+    return &m_linear[0];
+}
+
+int SocketStream::peekv(struct iovec* iov, int iovcnt, size_t n) const {
+    n = std::min(n, m_readable);
+    size_t pos = m_readHead;
+    int cnt = 0;
+    while (n && cnt < iovcnt) {
+        size_t offset = pos % m_chunkSize;
+        size_t len = std::min(m_chunkSize - offset, n);
+        iov[cnt].iov_base = m_readBuf[pos / m_chunkSize] + offset;
+        iov[cnt].iov_len = len;
+        ++cnt;
+        pos += len;
+        n -= len;
+    }
+    return cnt;
+}
+
+void SocketStream::consume(size_t n) {
+    assert(n <= m_readable);
+    m_readHead += n;
+    m_readable -= n;
+    // 读完的块挂回尾部，下次readv接着用，多出来的还给空闲列表
+    while (m_readHead >= m_chunkSize) {
+        char* chunk = m_readBuf.front();
+        m_readBuf.pop_front();
+        m_readHead -= m_chunkSize;
+        if (m_readBuf.size() < m_readChunks) {
+            m_readBuf.push_back(chunk);
+        } else {
+            freeChunk(chunk);
+        }
+    }
+    if (!m_readable) {
+        m_readHead = 0;
+    }
+}
+
+ssize_t SocketStream::read(void* buf, size_t len) {
+    if (!len) {
+        return 0;
+    }
+    if (!m_readable) {
+        // 大块读直接进调用者的内存，省掉一次复制
+        if (len >= m_chunkSize) {
+            return ::read(m_fd, buf, len);
+        }
+        ssize_t n = fill(1);
+        if (n <= 0) {
+            return n;
+        }
+    }
+    size_t n = std::min(len, m_readable);
+    copyOut((char*)buf, n);
+    consume(n);
+    return n;
+}
+
+ssize_t SocketStream::readFixed(void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read((char*)buf + done, len - done);
+        if (n <= 0) {
+            return n;
+        }
+        done += n;
+    }
+    return len;
+}
+
+void SocketStream::pushWrite(const char* buf, size_t len) {
+    if (!len) {
+        return;
+    }
+    if (!m_writeQueue.empty()) {
+        iovec& back = m_writeQueue.back();
+        if ((const char*)back.iov_base + back.iov_len == buf) {
+            back.iov_len += len;
+            m_pending += len;
+            return;
+        }
+    }
+    m_writeQueue.push_back({(void*)buf, len});
+    m_pending += len;
+}
+
+void SocketStream::append(const char* buf, size_t len) {
+    while (len) {
+        if (m_writeBuf.empty() || m_writeTail == m_chunkSize) {
+            m_writeBuf.push_back(allocChunk());
+            m_writeTail = 0;
+        }
+        size_t n = std::min(len, m_chunkSize - m_writeTail);
+        char* dst = m_writeBuf.back() + m_writeTail;
+        memcpy(dst, buf, n);
+        pushWrite(dst, n);
+        m_writeTail += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+ssize_t SocketStream::write(const void* buf, size_t len) {
+    if (m_pending + len > m_writeLimit) {
+        // 大块数据和写队列一起发出去，flush返回之后才返回，所以不用复制
+        if (len >= m_chunkSize) {
+            writeRef(buf, len);
+            return flush() < 0 ? -1 : (ssize_t)len;
+        }
+        if (flush() < 0) {
+            return -1;
+        }
+    }
+    append((const char*)buf, len);
+    return len;
+}
+
+void SocketStream::writeRef(const void* buf, size_t len) {
+    pushWrite((const char*)buf, len);
+}
+
+void SocketStream::resetWrite() {
+    m_writeQueue.clear();
+    m_pending = 0;
+    while (m_writeBuf.size() > 1) {
+        freeChunk(m_writeBuf.back());
+        m_writeBuf.pop_back();
+    }
+    m_writeTail = 0;
+}
+
+ssize_t SocketStream::flush() {
+    ssize_t total = 0;
+    while (!m_writeQueue.empty()) {
+        iovec iov[MAX_IOV];
+        int cnt = 0;
+        for (auto it = m_writeQueue.begin(); it != m_writeQueue.end() && cnt < MAX_IOV; ++it) {
+            iov[cnt++] = *it;
+        }
+        // hook的writev在发送缓冲满时挂起协程
+        ssize_t n = ::writev(m_fd, iov, cnt);
+        if (n < 0) {
+            resetWrite();
+            return -1;
+        }
+        total += n;
+        m_pending -= n;
+        size_t left = n;
+        while (left) {
+            iovec& front = m_writeQueue.front();
+            if (front.iov_len <= left) {
+                left -= front.iov_len;
+                m_writeQueue.pop_front();
+            } else {
+                front.iov_base = (char*)front.iov_base + left;
+                front.iov_len -= left;
+                left = 0;
+            }
+        }
+    }
+    resetWrite();
+    return total;
+}
+
+int SocketStream::close() {
+    if (m_fd < 0) {
+        return 0;
+    }
+    int rt = ::close(m_fd);
+    m_fd = -1;
+    return rt;
+}
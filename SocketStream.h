@@ -0,0 +1,219 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <deque>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief 带缓冲的socket流
+ * @details 建立在hook的fd上，读写没就绪时挂起当前协程。
+ * 读缓冲是固定大小的块组成的环：一次readv把尾部所有空闲块都交给内核，读完的块从头部摘下挂回尾部复用，
+ * 小消息协议一次系统调用就能收进多条消息。解析时通过peek/peekv/find直接在缓冲区里看数据，
+ * 只有跨块的数据要连续访问时才复制一次。
+ * 写入先放进写队列，flush时用一次writev发出去：小块复制进写缓冲并和前一段合并，
+ * writeRef直接引用调用者的内存，不复制
+ * @attention 不是线程安全的，同一时间只能由一个协程使用
+*/
+class SocketStream {
+public:
+    using ptr = std::shared_ptr<SocketStream>;
+
+    /**
+     * @brief 构造函数
+     * @param[in] fd socket句柄
+     * @param[in] owner 析构时是否关闭fd
+     * @param[in] chunk_size 缓冲块大小
+    */
+    SocketStream(int fd, bool owner = true, size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    SocketStream(const SocketStream&) = delete;
+
+    SocketStream& operator = (const SocketStream&) = delete;
+
+    /**
+     * @brief 析构函数，不会flush写队列里没发出去的数据
+    */
+    ~SocketStream();
+
+    /**
+     * @brief 获取socket句柄
+    */
+    int getFd() const {return m_fd;}
+
+    /**
+     * @brief 设置一次readv最多填几个块，默认为4
+    */
+    void setReadChunks(size_t chunks) {m_readChunks = chunks ? chunks : 1;}
+
+    /**
+     * @brief 设置写队列的上限，write时超过上限先flush，默认为64KB
+    */
+    void setWriteLimit(size_t bytes) {m_writeLimit = bytes;}
+
+    /**
+     * @brief 读缓冲里可读的字节数
+    */
+    size_t readable() const {return m_readable;}
+
+    /**
+     * @brief 从socket读一次数据到读缓冲
+     * @details 缓冲里已经有至少min字节时不读；否则用readv一次填满尾部的空闲块，不够min再接着读
+     * @param[in] min 希望读缓冲里至少有多少字节
+     * @return 成功返回读缓冲里的可读字节数，读够之前对端关闭返回0(已经读到的数据留在缓冲里)，出错返回-1
+    */
+    ssize_t fill(size_t min = 1);
+
+    /**
+     * @brief 一直读直到读缓冲里出现分隔符
+     * @param[in] delim 分隔符
+     * @param[in] max_len 消息最大长度，超过时返回-1，errno为EMSGSIZE
+     * @return 到分隔符为止(包含分隔符)的长度，对端关闭返回0，出错返回-1
+    */
+    ssize_t fillUntil(char delim, size_t max_len);
+
+    /**
+     * @brief 查找字符
+     * @param[in] c 要找的字符
+     * @param[in] from 从第几个可读字节开始找
+     * @return 相对读缓冲开头的偏移，找不到返回-1
+    */
+    ssize_t find(char c, size_t from = 0) const;
+
+    /**
+     * @brief 获取读缓冲开头连续的n个字节
+     * @details 数据在同一个块里时直接返回块内的指针；跨块时复制到临时缓冲里。
+     * 返回的指针在下一次fill/consume/read之前有效
+     * @param[in] n 字节数，不能超过readable()
+    */
+    const char* peek(size_t n);
+
+    /**
+     * @brief 以分段的形式获取读缓冲开头的数据，不复制
+     * @details 返回的分段在下一次fill/consume/read之前有效
+     * @param[out] iov 分段数组
+     * @param[in] iovcnt 数组大小
+     * @param[in] n 最多取多少字节，默认全部可读数据
+     * @return 分段数
+    */
+    int peekv(struct iovec* iov, int iovcnt, size_t n = (size_t)-1) const;
+
+    /**
+     * @brief 丢弃读缓冲开头的n个字节，n不能超过readable()
+    */
+    void consume(size_t n);
+
+    /**
+     * @brief 读数据
+     * @details 读缓冲里有数据时从缓冲里复制；缓冲为空且len不小于一个块时直接读到buf里，不经过缓冲
+     * @return 读到的字节数，对端关闭返回0，出错返回-1
+    */
+    ssize_t read(void* buf, size_t len);
+
+    /**
+     * @brief 读满len个字节
+     * @return 读满返回len，中途对端关闭返回0，出错返回-1
+    */
+    ssize_t readFixed(void* buf, size_t len);
+
+    /**
+     * @brief 复制数据到写队列
+     * @details 写队列超过上限时先flush；len不小于一个块时和写队列一起直接发出去，不复制
+     * @return 成功返回len，flush出错返回-1
+    */
+    ssize_t write(const void* buf, size_t len);
+
+    /**
+     * @brief 把调用者的内存直接放进写队列，不复制
+     * @attention buf在flush返回之前必须有效
+    */
+    void writeRef(const void* buf, size_t len);
+
+    /**
+     * @brief 写队列里还没发出去的字节数
+    */
+    size_t pending() const {return m_pending;}
+
+    /**
+     * @brief 用writev把写队列全部发出去
+     * @details 一次writev最多带MAX_IOV个分段，只发出一部分时接着发
+     * @return 发出去的字节数，出错返回-1，出错时写队列被清空，连接应该关闭
+    */
+    ssize_t flush();
+
+    /**
+     * @brief 关闭socket，不会flush写队列
+    */
+    int close();
+
+public:
+    /// 默认缓冲块大小
+    static const size_t DEFAULT_CHUNK_SIZE = 4096;
+    /// 一次readv/writev最多带的分段数，分段数组放在协程栈上
+    static const int MAX_IOV = 64;
+
+private:
+    /**
+     * @brief 取一个空闲块，空闲列表为空时分配
+    */
+    char* allocChunk();
+
+    /**
+     * @brief 归还一个块，空闲列表满了就释放
+    */
+    void freeChunk(char* chunk);
+
+    /**
+     * @brief 把读缓冲开头的n个字节复制到buf，不消费
+    */
+    void copyOut(char* buf, size_t n) const;
+
+    /**
+     * @brief 清空写队列，写缓冲只留一个块
+    */
+    void resetWrite();
+
+    /**
+     * @brief 在写缓冲末尾追加数据
+    */
+    void append(const char* buf, size_t len);
+
+    /**
+     * @brief 把分段放进写队列，和上一段首尾相接时合并
+    */
+    void pushWrite(const char* buf, size_t len);
+
+private:
+    /// socket句柄
+    int m_fd;
+    /// 析构时是否关闭fd
+    bool m_owner;
+    /// 缓冲块大小
+    size_t m_chunkSize;
+    /// 一次readv最多填几个块
+    size_t m_readChunks = 4;
+    /// 写队列上限
+    size_t m_writeLimit = 64 * 1024;
+
+    /// 读缓冲的块，数据从第一个块的m_readHead处开始，连续存放m_readable字节，后面是空闲块
+    std::deque<char*> m_readBuf;
+    /// 第一个块里已经消费的字节数
+    size_t m_readHead = 0;
+    /// 可读字节数
+    size_t m_readable = 0;
+    /// peek跨块时使用的临时缓冲
+    std::vector<char> m_linear;
+
+    /// 写缓冲的块，write复制进来的数据存放在这里
+    std::deque<char*> m_writeBuf;
+    /// 最后一个写缓冲块里已经用掉的字节数
+    size_t m_writeTail = 0;
+    /// 写队列，分段指向写缓冲或者调用者的内存
+    std::deque<iovec> m_writeQueue;
+    /// 写队列里的字节数
+    size_t m_pending = 0;
+
+    /// 空闲块
+    std::vector<char*> m_freeChunks;
+};
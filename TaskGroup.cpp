@@ -0,0 +1,134 @@
+#include "TaskGroup.h"
+#include <assert.h>
+
+TaskGroup::TaskGroup(Scheduler* scheduler)
+    : m_scheduler(scheduler ? scheduler : Scheduler::GetThis()) {
+    assert(m_scheduler);
+    // 在子协程里创建的任务组挂到其所属任务组下面，父组取消时一并取消
+    m_parent = GetThis();
+    if (m_parent) {
+        MutexType::Lock lock(m_parent->m_mutex);
+        m_parent->m_subGroups.insert(this);
+        if (m_parent->m_cancelled) {
+            m_cancelled = true;
+        }
+    }
+}
+
+TaskGroup::~TaskGroup() {
+    wait();
+    if (m_parent) {
+        MutexType::Lock lock(m_parent->m_mutex);
+        m_parent->m_subGroups.erase(this);
+    }
+}
+
+TaskGroup* TaskGroup::GetThis() {
+    if (!Scheduler::GetThis()) {
+        return nullptr;
+    }
+    return Fiber::GetThis()->getTaskGroup();
+}
+
+Fiber::ptr TaskGroup::spawn(std::function<void()> cb, int thread) {
+    Fiber::ptr fiber(new Fiber([this, cb]() {
+        cb();
+        onChildDone(Fiber::GetFiberId());
+    }));
+    fiber->setTaskGroup(this);
+    {
+        MutexType::Lock lock(m_mutex);
+        m_children[fiber->getId()] = fiber;
+        if (m_cancelled) {
+            fiber->cancel();
+        }
+    }
+    m_scheduler->schedule(fiber, thread);
+    return fiber;
+}
+
+void TaskGroup::cancel() {
+    std::vector<Fiber::ptr> children;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_cancelled = true;
+        children.reserve(m_children.size());
+        for (auto& i: m_children) {
+            children.push_back(i.second);
+        }
+        // 子组析构时要拿本组的锁才能摘除自己，所以持锁期间子组指针一直有效
+        for (auto group: m_subGroups) {
+            group->cancel();
+        }
+    }
+    // 协程的取消回调会操作IOManager和调度器，放到锁外执行
+    for (auto& fiber: children) {
+        fiber->cancel();
+    }
+}
+
+void TaskGroup::wait() {
+    Fiber::ptr cur = Fiber::GetThis();
+    if (Scheduler::GetThis() && cur->isRunInScheduler()) {
+        PreemptGuard guard;
+        {
+            MutexType::Lock lock(m_mutex);
+            if (m_children.empty()) {
+                return;
+            }
+            // 同一时间只允许一个协程等待
+            assert(!m_waiter);
+            m_waiter = cur;
+            // 在本线程上唤醒时可以直接放进run next槽位
+            m_waiterThread = GetThreadId();
+        }
+        auto raw_ptr = cur.get();
+        cur.reset();
+        raw_ptr->yield();
+        return;
+    }
+
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_children.empty()) {
+            return;
+        }
+        ++m_threadWaiters;
+    }
+    m_semaphore.wait();
+    // 等通知者放锁之后再返回，否则调用者析构任务组时通知者可能还在访问信号量
+    MutexType::Lock lock(m_mutex);
+}
+
+size_t TaskGroup::getRunningCount() {
+    MutexType::Lock lock(m_mutex);
+    return m_children.size();
+}
+
+void TaskGroup::onChildDone(uint64_t id) {
+    Fiber::ptr waiter;
+    int waiter_thread = -1;
+    // 唤醒之后本任务组可能马上被析构，放锁之后不能再访问成员
+    Scheduler* scheduler = m_scheduler;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_children.erase(id);
+        if (!m_children.empty()) {
+            return;
+        }
+        waiter.swap(m_waiter);
+        waiter_thread = m_waiterThread;
+        // 持锁通知所有等待线程，它们醒来后要先拿一次锁，放锁之前任务组不会被析构
+        for (; m_threadWaiters > 0; --m_threadWaiters) {
+            m_semaphore.notify();
+        }
+    }
+    if (waiter) {
+        // 在等待者所在线程上结束的话直接放进run next槽位，马上就能运行
+        if (waiter_thread == GetThreadId()) {
+            scheduler->scheduleNext(waiter);
+        } else {
+            scheduler->schedule(waiter);
+        }
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include "Fiber.h"
+#include "Scheduler.h"
+#include "mutex.h"
+#include <set>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+
+/**
+ * @brief 任务组(结构化并发的作用域)
+ * @details 通过任务组spawn出来的子协程归属于这个任务组，可以整体取消和等待。
+ * 被取消的子协程如果阻塞在hook的IO/connect/sleep上，会被立即唤醒并返回ECANCELED。
+ * 在某个子协程里创建的任务组自动成为其所属任务组的子组，取消会向下传递。
+ * @attention 任务组必须比它的子协程活得久，析构时会等待所有子协程结束
+*/
+class TaskGroup {
+public:
+    using MutexType = Mutex;
+
+    /**
+     * @brief 构造函数
+     * @param[in] scheduler 子协程所在的调度器，默认为当前线程的调度器
+    */
+    TaskGroup(Scheduler* scheduler = nullptr);
+
+    TaskGroup(const TaskGroup&) = delete;
+
+    TaskGroup& operator = (const TaskGroup&) = delete;
+
+    /**
+     * @brief 析构函数，等待所有子协程结束
+    */
+    ~TaskGroup();
+
+    /**
+     * @brief 创建子协程并加入调度
+     * @param[in] cb 子协程入口函数
+     * @param[in] thread 指定运行的线程号，-1表示任意线程
+     * @return 子协程，任务组已被取消时子协程一开始就处于取消状态
+    */
+    Fiber::ptr spawn(std::function<void()> cb, int thread = -1);
+
+    /**
+     * @brief 取消任务组内所有子协程以及子组
+    */
+    void cancel();
+
+    /**
+     * @brief 任务组是否已被取消
+    */
+    bool isCancelled() const {return m_cancelled;}
+
+    /**
+     * @brief 等待所有子协程结束
+     * @details 在调度器的任务协程里调用时挂起当前协程，否则阻塞当前线程
+    */
+    void wait();
+
+    /**
+     * @brief 获取还没有结束的子协程数
+    */
+    size_t getRunningCount();
+
+    /**
+     * @brief 获取当前协程所属的任务组
+    */
+    static TaskGroup* GetThis();
+
+private:
+    /**
+     * @brief 子协程结束时调用，最后一个子协程结束时唤醒等待者
+    */
+    void onChildDone(uint64_t id);
+
+private:
+    /// 子协程所在的调度器
+    Scheduler* m_scheduler;
+    /// 父任务组
+    TaskGroup* m_parent = nullptr;
+    /// 互斥锁
+    MutexType m_mutex;
+    /// 还在运行的子协程，按协程id索引
+    std::unordered_map<uint64_t, Fiber::ptr> m_children;
+    /// 子任务组
+    std::set<TaskGroup*> m_subGroups;
+    /// 是否已被取消
+    std::atomic<bool> m_cancelled = {false};
+    /// 等待的协程
+    Fiber::ptr m_waiter;
+    /// 等待协程所在的线程
+    int m_waiterThread = -1;
+    /// 等待的线程数
+    size_t m_threadWaiters = 0;
+    /// 线程等待用的信号量
+    Semaphore m_semaphore;
+};
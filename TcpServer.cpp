@@ -0,0 +1,191 @@
+#include "TcpServer.h"
+#include "Fd_Manager.h"
+#include "hook.h"
+#include <netinet/in.h>
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+
+/**
+ * @brief 关闭监听socket
+ * @details 调用线程不一定开了hook，先注销FdCtx再关闭
+*/
+static void close_listener(int fd) {
+    FdMgr::GetInstance()->del(fd);
+    close(fd);
+}
+
+/**
+ * @brief 设置地址里的端口
+*/
+static void set_port(sockaddr_storage& addr, uint16_t port) {
+    if (addr.ss_family == AF_INET) {
+        ((sockaddr_in*)&addr)->sin_port = htons(port);
+    } else if (addr.ss_family == AF_INET6) {
+        ((sockaddr_in6*)&addr)->sin6_port = htons(port);
+    }
+}
+
+/**
+ * @brief 获取socket绑定的端口
+*/
+static uint16_t get_port(int fd) {
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (sockaddr*)&addr, &len)) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET) {
+        return ntohs(((sockaddr_in*)&addr)->sin_port);
+    } else if (addr.ss_family == AF_INET6) {
+        return ntohs(((sockaddr_in6*)&addr)->sin6_port);
+    }
+    return 0;
+}
+
+TcpServer::TcpServer(Handler handler, IOManager* iom, const std::string& name)
+    : m_handler(handler)
+    , m_iom(iom)
+    , m_name(name) {
+    assert(m_iom);
+}
+
+TcpServer::~TcpServer() {
+    MutexType::Lock lock(m_mutex);
+    if (!m_started) {
+        closeListeners();
+    }
+}
+
+void TcpServer::closeListeners() {
+    for (int fd : m_listeners) {
+        close_listener(fd);
+    }
+    m_listeners.clear();
+}
+
+bool TcpServer::bind(const sockaddr* addr, socklen_t addrlen, size_t listeners, int backlog) {
+    MutexType::Lock lock(m_mutex);
+    if (m_started || !m_listeners.empty() || addrlen > sizeof(sockaddr_storage)) {
+        errno = EINVAL;
+        return false;
+    }
+    if (!listeners) {
+        listeners = std::max<size_t>(m_iom->getThreadCount(), 1);
+    }
+    sockaddr_storage bind_addr;
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    memcpy(&bind_addr, addr, addrlen);
+
+    for (size_t i = 0; i < listeners; ++i) {
+        int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            int err = errno;
+            closeListeners();
+            errno = err;
+            return false;
+        }
+        // 登记之后accept走hook，没有连接时挂起协程
+        FdMgr::GetInstance()->get(fd, true);
+        m_listeners.push_back(fd);
+
+        int on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))
+                || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))
+                || ::bind(fd, (sockaddr*)&bind_addr, addrlen)
+                || listen(fd, backlog)) {
+            int err = errno;
+            closeListeners();
+            errno = err;
+            return false;
+        }
+        if (i == 0) {
+            // 端口为0时由第一个监听socket分配，其余的绑到同一个端口上
+            m_port = get_port(fd);
+            set_port(bind_addr, m_port);
+        }
+    }
+    return true;
+}
+
+bool TcpServer::start() {
+    MutexType::Lock lock(m_mutex);
+    if (m_started || m_listeners.empty() || m_stopping) {
+        return false;
+    }
+    m_started = true;
+    // 每个accept协程固定在一个工作线程上，被唤醒后还回到这个线程，接受的连接也交给这个线程处理
+    std::vector<int> threads = m_iom->getWorkerThreadIds();
+    for (size_t i = 0; i < m_listeners.size(); ++i) {
+        Fiber::ptr fiber(new Fiber(std::bind(&TcpServer::acceptLoop, shared_from_this(), m_listeners[i])));
+        int thread = threads.empty() ? -1 : threads[i % threads.size()];
+        fiber->setWakeThread(thread);
+        m_acceptFibers.push_back(fiber);
+        m_iom->schedule(fiber, thread);
+    }
+    return true;
+}
+
+void TcpServer::stop() {
+    m_stopping = true;
+    std::vector<Fiber::ptr> fibers;
+    {
+        MutexType::Lock lock(m_mutex);
+        fibers.swap(m_acceptFibers);
+        if (!m_started) {
+            closeListeners();
+        }
+    }
+    // 挂起在accept上的协程以ECANCELED返回，正在处理连接的协程下次accept前看到m_stopping退出
+    for (auto& fiber : fibers) {
+        fiber->cancel();
+    }
+}
+
+TcpServer::Stats TcpServer::getStats() const {
+    Stats stats;
+    {
+        MutexType::Lock lock(m_mutex);
+        stats.listeners = m_listeners.size();
+    }
+    stats.accepted = m_accepted;
+    stats.acceptErrors = m_acceptErrors;
+    return stats;
+}
+
+void TcpServer::acceptLoop(int listener) {
+    TcpServer::ptr self = shared_from_this();
+    while (!m_stopping) {
+        // 协程挂起之后可能在别的线程上恢复，hook是线程粒度的，每次accept前都打开
+        set_hook_enable(true);
+        // 队列里有连接时直接返回，取空了才挂起等监听socket可读
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            ++m_accepted;
+            // 处理协程先放在接受连接的线程上，这个线程正在运行，不会因为指定线程而卡住
+            m_iom->schedule([self, fd]() {
+                set_hook_enable(true);
+                self->m_handler(fd);
+            }, GetThreadId());
+            continue;
+        }
+        int err = errno;
+        if (err == ECANCELED || m_stopping) {
+            break;
+        }
+        // 连接在accept之前就被对端重置，或者被信号打断，接着取
+        if (err == EAGAIN || err == EINTR || err == ECONNABORTED) {
+            continue;
+        }
+        ++m_acceptErrors;
+        // 句柄或者内存用完时歇一会，不要空转，连接留在队列里等资源释放
+        if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+            usleep(10 * 1000);
+            continue;
+        }
+        std::cerr << "TcpServer " << m_name << " accept error: " << strerror(err) << std::endl;
+        break;
+    }
+    close_listener(listener);
+}
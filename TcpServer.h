@@ -0,0 +1,131 @@
+#pragma once
+#include "IOManager.h"
+#include "Fiber.h"
+#include "mutex.h"
+#include <sys/socket.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief TCP服务器
+ * @details 在同一个地址上打开多个SO_REUSEPORT监听socket，内核按四元组把新连接分散到各个监听socket上，
+ * 每个监听socket一个accept协程，不会所有连接都挤在一个accept队列上。
+ * accept协程用hook的accept4循环取连接，队列里有连接就一直取，取空了才挂起等下一次可读，
+ * 连接风暴时一次唤醒处理一批连接，epoll_ctl也只在挂起时做一次。
+ * accept协程按顺序固定在各个工作线程上，IO唤醒后总在自己的线程上恢复(见Fiber::setWakeThread)，
+ * 新连接交给处理函数，处理协程先放在接受它的线程上运行，之后的唤醒不再固定
+ * @attention 必须用shared_ptr创建，accept协程持有服务器的引用，stop之后协程退出时才会析构
+*/
+class TcpServer : public std::enable_shared_from_this<TcpServer> {
+public:
+    using ptr = std::shared_ptr<TcpServer>;
+    using MutexType = Mutex;
+    /// 连接处理函数，参数是新连接的句柄，由处理函数负责关闭
+    using Handler = std::function<void(int fd)>;
+
+    /**
+     * @brief 服务器统计信息
+    */
+    struct Stats {
+        /// 监听socket数
+        size_t listeners;
+        /// 接受的连接数
+        uint64_t accepted;
+        /// accept出错的次数，不算EAGAIN
+        uint64_t acceptErrors;
+    };
+
+    /**
+     * @brief 构造函数
+     * @param[in] handler 连接处理函数，在iom的协程里执行，开启了hook
+     * @param[in] iom 运行accept协程和处理协程的IOManager，默认为当前的IOManager
+     * @param[in] name 服务器名称
+    */
+    TcpServer(Handler handler, IOManager* iom = IOManager::GetThis(),
+              const std::string& name = "tcp_server");
+
+    TcpServer(const TcpServer&) = delete;
+
+    TcpServer& operator = (const TcpServer&) = delete;
+
+    /**
+     * @brief 析构函数，关闭还没启动的监听socket
+    */
+    ~TcpServer();
+
+    /**
+     * @brief 打开监听socket并绑定地址
+     * @details 端口为0时由第一个监听socket分配端口，其余的绑定到同一个端口
+     * @param[in] addr 监听地址
+     * @param[in] addrlen 地址长度
+     * @param[in] listeners 监听socket数，为0时取IOManager的线程数
+     * @param[in] backlog listen的队列长度
+     * @return 是否成功，失败时errno为出错原因，已经打开的监听socket会被关闭
+    */
+    bool bind(const sockaddr* addr, socklen_t addrlen, size_t listeners = 0, int backlog = SOMAXCONN);
+
+    /**
+     * @brief 启动accept协程
+     * @return 没有绑定过地址或者已经启动过返回false
+    */
+    bool start();
+
+    /**
+     * @brief 停止接受新连接
+     * @details 取消所有accept协程，监听socket由accept协程退出时关闭，已经接受的连接不受影响
+    */
+    void stop();
+
+    /**
+     * @brief 获取监听的端口，没有绑定时返回0
+    */
+    uint16_t getPort() const {return m_port;}
+
+    /**
+     * @brief 获取服务器名称
+    */
+    const std::string& getName() const {return m_name;}
+
+    /**
+     * @brief 获取统计信息
+    */
+    Stats getStats() const;
+
+private:
+    /**
+     * @brief accept协程，取连接直到服务器停止
+     * @param[in] listener 监听socket
+    */
+    void acceptLoop(int listener);
+
+    /**
+     * @brief 关闭还没交给accept协程的监听socket
+    */
+    void closeListeners();
+
+private:
+    /// 互斥锁
+    mutable MutexType m_mutex;
+    /// 连接处理函数
+    Handler m_handler;
+    /// 运行accept协程和处理协程的IOManager
+    IOManager* m_iom;
+    /// 服务器名称
+    std::string m_name;
+    /// 监听socket
+    std::vector<int> m_listeners;
+    /// accept协程
+    std::vector<Fiber::ptr> m_acceptFibers;
+    /// 监听的端口
+    uint16_t m_port = 0;
+    /// 是否已经启动
+    bool m_started = false;
+    /// 是否已经停止
+    std::atomic<bool> m_stopping = {false};
+    /// 统计
+    std::atomic<uint64_t> m_accepted = {0};
+    std::atomic<uint64_t> m_acceptErrors = {0};
+};
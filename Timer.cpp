@@ -1,5 +1,6 @@
 #include "Timer.h"
 #include <sys/time.h>
+#include <time.h>
 
 uint64_t GetCurrentMS() {
     struct timeval tv;
@@ -7,6 +8,18 @@ uint64_t GetCurrentMS() {
     return tv.tv_sec * 1000ul  + tv.tv_usec / 1000;
 }
 
+uint64_t GetCurrentUS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 * 1000ul  + tv.tv_usec;
+}
+
+uint64_t GetCurrentNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 * 1000 * 1000ul + ts.tv_nsec;
+}
+
 bool Timer::Comparator::operator() (const Timer::ptr& lhs
                         , const Timer::ptr& rhs) const {
     if (!lhs && !rhs) {
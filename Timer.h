@@ -162,4 +162,14 @@ private:
 /**
  * @brief 获取当前时间的毫秒
 */
-uint64_t GetCurrentMS();
\ No newline at end of file
+uint64_t GetCurrentMS();
+
+/**
+ * @brief 获取当前时间的微秒
+*/
+uint64_t GetCurrentUS();
+
+/**
+ * @brief 获取单调时钟的纳秒，只用于计算时间间隔
+*/
+uint64_t GetCurrentNS();
\ No newline at end of file
@@ -0,0 +1,271 @@
+#include "WriteCoalescer.h"
+#include "IOManager.h"
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+/// 复制数据用的块大小
+static const size_t CHUNK_SIZE = 16 * 1024;
+/// 一次writev最多带的分段数，分段数组放在协程栈上
+static const int MAX_IOV = 64;
+
+WriteCoalescer::WriteCoalescer(Writer writer, size_t max_bytes, uint64_t max_delay_ms)
+    : m_writer(writer)
+    , m_maxBytes(max_bytes)
+    , m_maxDelayMs(max_delay_ms) {
+}
+
+WriteCoalescer::~WriteCoalescer() {
+    if (m_timer) {
+        m_timer->cancel();
+    }
+}
+
+void WriteCoalescer::pushNoLock(const char* buf, size_t len) {
+    if (!len) {
+        return;
+    }
+    m_queuedSeq += len;
+    if (!m_queue.empty()) {
+        iovec& back = m_queue.back();
+        if ((const char*)back.iov_base + back.iov_len == buf) {
+            back.iov_len += len;
+            return;
+        }
+    }
+    m_queue.push_back({(void*)buf, len});
+}
+
+void WriteCoalescer::copyNoLock(const struct iovec* iov, int iovcnt, size_t total) {
+    if (m_chunks.empty() || m_chunks.back().size - m_chunks.back().used < total) {
+        size_t size = std::max(CHUNK_SIZE, total);
+        m_chunks.push_back({std::unique_ptr<char[]>(new char[size]), size, 0, 0});
+    }
+    Chunk& chunk = m_chunks.back();
+    char* dst = chunk.data.get() + chunk.used;
+    size_t left = total;
+    for (int i = 0; i < iovcnt && left; ++i) {
+        size_t len = std::min(iov[i].iov_len, left);
+        memcpy(dst, iov[i].iov_base, len);
+        dst += len;
+        left -= len;
+    }
+    pushNoLock(chunk.data.get() + chunk.used, total);
+    chunk.used += total;
+    chunk.endSeq = m_queuedSeq;
+}
+
+ssize_t WriteCoalescer::write(const struct iovec* iov, int iovcnt, bool nonblock) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+    ++m_writes;
+    MutexType::Lock lock(m_mutex);
+    if (m_error) {
+        errno = m_error;
+        return -1;
+    }
+    if (!total) {
+        return 0;
+    }
+    size_t pending = m_queuedSeq - m_sentSeq;
+    if (nonblock) {
+        // 调用者不能挂起，队列里放得下多少复制多少，和非阻塞socket发送缓冲满时一样可以只写一部分
+        size_t space = pending < m_maxBytes ? m_maxBytes - pending : 0;
+        if (!space) {
+            armNoLock(true);
+            errno = EAGAIN;
+            return -1;
+        }
+        size_t n = std::min(total, space);
+        copyNoLock(iov, iovcnt, n);
+        armNoLock(pending + n >= m_maxBytes);
+        return n;
+    }
+    if (total <= COPY_LIMIT && pending + total <= m_maxBytes) {
+        copyNoLock(iov, iovcnt, total);
+        // 攒够了就马上发，否则等本轮就绪任务跑完
+        armNoLock(pending + total >= m_maxBytes);
+        return total;
+    }
+    // 大块数据或者队列已满，引用调用者的内存，发完之前调用者不能返回
+    for (int i = 0; i < iovcnt; ++i) {
+        pushNoLock((const char*)iov[i].iov_base, iov[i].iov_len);
+    }
+    int err = waitNoLock(lock, m_queuedSeq, true);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return total;
+}
+
+int WriteCoalescer::flush(bool nonblock) {
+    MutexType::Lock lock(m_mutex);
+    if (m_error) {
+        errno = m_error;
+        return -1;
+    }
+    if (m_queuedSeq == m_sentSeq) {
+        return 0;
+    }
+    if (nonblock) {
+        armNoLock(true);
+        errno = EAGAIN;
+        return -1;
+    }
+    int err = waitNoLock(lock, m_queuedSeq, true);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void WriteCoalescer::close() {
+    MutexType::Lock lock(m_mutex);
+    if (!m_error) {
+        failNoLock(EBADF);
+    }
+}
+
+size_t WriteCoalescer::pending() {
+    MutexType::Lock lock(m_mutex);
+    return m_queuedSeq - m_sentSeq;
+}
+
+WriteCoalescer::Stats WriteCoalescer::getStats() const {
+    Stats stats;
+    stats.writes = m_writes;
+    stats.syscalls = m_syscalls;
+    stats.bytes = m_bytes;
+    return stats;
+}
+
+int WriteCoalescer::waitNoLock(MutexType::Lock& lock, uint64_t seq, bool urgent) {
+    PreemptGuard guard;
+    int error = 0;
+    Fiber::ptr fiber = Fiber::GetThis();
+    m_waiters.push_back({seq, fiber, Scheduler::GetThis(), &error});
+    armNoLock(urgent);
+    lock.unlock();
+    Fiber* raw_ptr = fiber.get();
+    fiber.reset();
+    raw_ptr->yield();
+    lock.lock();
+    return error;
+}
+
+void WriteCoalescer::armNoLock(bool urgent) {
+    // 正在发送的刷新任务会一直发到队列为空
+    if (m_flushing) {
+        return;
+    }
+    IOManager* iom = IOManager::GetThis();
+    if (urgent) {
+        if (!m_urgent) {
+            m_urgent = true;
+            iom->schedule(std::bind(&WriteCoalescer::runFlush, shared_from_this()),
+                          -1, Scheduler::HIGH);
+        }
+        return;
+    }
+    if (m_armed) {
+        return;
+    }
+    m_armed = true;
+    // 低优先级排在本线程上，本线程上已经就绪的协程先跑，它们的写也能合并进来
+    iom->schedule(std::bind(&WriteCoalescer::runFlush, shared_from_this()),
+                  GetThreadId(), Scheduler::LOW);
+    if (m_maxDelayMs) {
+        std::weak_ptr<WriteCoalescer> weak(shared_from_this());
+        m_timer = iom->addTimer(m_maxDelayMs, [weak]() {
+            WriteCoalescer::ptr self = weak.lock();
+            if (self) {
+                MutexType::Lock lock(self->m_mutex);
+                self->armNoLock(true);
+            }
+        });
+    }
+}
+
+void WriteCoalescer::runFlush() {
+    MutexType::Lock lock(m_mutex);
+    m_armed = false;
+    m_urgent = false;
+    if (m_timer) {
+        m_timer->cancel();
+        m_timer.reset();
+    }
+    if (m_flushing || m_error) {
+        return;
+    }
+    m_flushing = true;
+    while (!m_queue.empty()) {
+        iovec iov[MAX_IOV];
+        int cnt = 0;
+        for (auto it = m_queue.begin(); it != m_queue.end() && cnt < MAX_IOV; ++it) {
+            iov[cnt++] = *it;
+        }
+        // 发送时不持有锁，其他协程可以继续往队列末尾追加
+        lock.unlock();
+        ssize_t n = m_writer(iov, cnt);
+        int err = errno;
+        ++m_syscalls;
+        lock.lock();
+        if (m_error) {
+            break;
+        }
+        if (n < 0) {
+            failNoLock(err);
+            break;
+        }
+        m_sentSeq += n;
+        m_bytes += n;
+        size_t left = n;
+        while (left) {
+            iovec& front = m_queue.front();
+            if (front.iov_len <= left) {
+                left -= front.iov_len;
+                m_queue.pop_front();
+            } else {
+                front.iov_base = (char*)front.iov_base + left;
+                front.iov_len -= left;
+                left = 0;
+            }
+        }
+        // 发完的块释放掉，最后一个块留着继续复制
+        while (m_chunks.size() > 1 && m_chunks.front().endSeq <= m_sentSeq) {
+            m_chunks.pop_front();
+        }
+        if (m_queue.empty() && !m_chunks.empty()) {
+            m_chunks.front().used = 0;
+        }
+        wakeNoLock(0);
+    }
+    m_flushing = false;
+    if (m_error) {
+        m_chunks.clear();
+    }
+}
+
+void WriteCoalescer::wakeNoLock(int error) {
+    while (!m_waiters.empty() && (error || m_waiters.front().seq <= m_sentSeq)) {
+        Waiter& waiter = m_waiters.front();
+        *waiter.error = error;
+        waiter.scheduler->schedule(waiter.fiber);
+        m_waiters.pop_front();
+    }
+}
+
+void WriteCoalescer::failNoLock(int error) {
+    m_error = error;
+    m_queue.clear();
+    m_sentSeq = m_queuedSeq;
+    // 刷新任务的writev可能还在读块里的数据，由它退出时释放
+    if (!m_flushing) {
+        m_chunks.clear();
+    }
+    wakeNoLock(error);
+}
@@ -0,0 +1,189 @@
+#pragma once
+#include "Fiber.h"
+#include "Scheduler.h"
+#include "Timer.h"
+#include "mutex.h"
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+
+/**
+ * @brief socket的写合并器
+ * @details 多个协程在同一个连接上发响应，或者一个协程连续发很多小块时，每次send都是一次系统调用，
+ * 往往还是一个单独的TCP报文段。开启写合并后hook的write/send/writev先把数据放进待发送队列，
+ * 由一个低优先级的刷新任务在本轮就绪任务跑完之后用一次writev发出去；
+ * 攒够字节上限时立即刷新，刷新任务迟迟轮不到时由定时器在延迟上限到期时刷新。
+ * 小块写复制进合并器后立即返回；大块写或者队列满了的写直接引用调用者的内存，调用协程挂起到数据发完为止，
+ * 这就是反压。队列按调用顺序发送，顺序和直接调用send一样
+ * @attention 复制进来的数据是异步发送的，发送出错时由之后的写或者flush返回错误，和TCP本身的语义一致
+*/
+class WriteCoalescer : public std::enable_shared_from_this<WriteCoalescer> {
+public:
+    using ptr = std::shared_ptr<WriteCoalescer>;
+    using MutexType = Mutex;
+    /// 实际发送数据的函数，返回值和errno同writev
+    using Writer = std::function<ssize_t(const struct iovec* iov, int iovcnt)>;
+
+    /**
+     * @brief 写合并统计
+    */
+    struct Stats {
+        /// 进入合并器的写调用次数
+        uint64_t writes;
+        /// 刷新时发出的系统调用次数
+        uint64_t syscalls;
+        /// 发送的字节数
+        uint64_t bytes;
+    };
+
+    /**
+     * @brief 构造函数
+     * @param[in] writer 发送函数，在刷新任务的协程里调用，没有就绪时可以挂起协程
+     * @param[in] max_bytes 待发送字节数上限，攒够时立即刷新，超过时写调用挂起等待
+     * @param[in] max_delay_ms 数据最多攒多久(毫秒)
+    */
+    WriteCoalescer(Writer writer, size_t max_bytes, uint64_t max_delay_ms);
+
+    ~WriteCoalescer();
+
+    /**
+     * @brief 写数据
+     * @details 必须在调度器的协程里调用。不超过COPY_LIMIT而且队列放得下时复制后立即返回，
+     * 否则引用调用者的内存，挂起到这些数据发出去为止
+     * @param[in] nonblock 调用者不能挂起(fd被设成非阻塞或者带了MSG_DONTWAIT)，
+     * 这时不管大小都只复制队列放得下的部分，一个字节都放不下时返回EAGAIN
+     * @return 成功返回写入的字节数，之前的发送出过错返回-1，errno为当时的错误
+    */
+    ssize_t write(const struct iovec* iov, int iovcnt, bool nonblock = false);
+
+    /**
+     * @brief 立即刷新，挂起到调用前放进来的数据全部发出去为止
+     * @details 必须在调度器的协程里调用
+     * @param[in] nonblock 不挂起，还有没发完的数据时安排马上刷新并返回EAGAIN
+     * @return 成功返回0，出错返回-1
+    */
+    int flush(bool nonblock = false);
+
+    /**
+     * @brief fd关闭时调用，丢弃没发出去的数据，之后的写都返回EBADF
+    */
+    void close();
+
+    /**
+     * @brief 待发送的字节数
+    */
+    size_t pending();
+
+    /**
+     * @brief 获取统计信息
+    */
+    Stats getStats() const;
+
+public:
+    /// 不超过这个大小的写复制进合并器，调用方不用等待
+    static const size_t COPY_LIMIT = 4096;
+
+private:
+    /**
+     * @brief 存放复制进来的数据的块
+    */
+    struct Chunk {
+        /// 数据
+        std::unique_ptr<char[]> data;
+        /// 块的大小
+        size_t size;
+        /// 已经用掉的字节数
+        size_t used;
+        /// 块里最后一个字节的发送序号，发送序号超过它的块可以释放
+        uint64_t endSeq;
+    };
+
+    /**
+     * @brief 等待数据发完的协程
+    */
+    struct Waiter {
+        /// 等到发送序号到达seq为止
+        uint64_t seq;
+        /// 挂起的协程
+        Fiber::ptr fiber;
+        /// 协程所在的调度器
+        Scheduler* scheduler;
+        /// 出错时写入错误码，指向挂起协程栈上的变量
+        int* error;
+    };
+
+    /**
+     * @brief 把一段数据放进待发送队列，和上一段首尾相接时合并
+    */
+    void pushNoLock(const char* buf, size_t len);
+
+    /**
+     * @brief 复制iov开头的total个字节放进待发送队列
+    */
+    void copyNoLock(const struct iovec* iov, int iovcnt, size_t total);
+
+    /**
+     * @brief 登记等待者，挂起当前协程直到发送序号到达seq
+     * @return 成功返回0，出错返回错误码
+    */
+    int waitNoLock(MutexType::Lock& lock, uint64_t seq, bool urgent);
+
+    /**
+     * @brief 安排刷新任务
+     * @param[in] urgent 是否马上刷新，否则在本线程上按低优先级排队并启动延迟定时器
+    */
+    void armNoLock(bool urgent);
+
+    /**
+     * @brief 刷新任务，把队列发到空为止
+    */
+    void runFlush();
+
+    /**
+     * @brief 唤醒等待者
+     * @param[in] error 为0时唤醒发送序号已经到达的等待者，否则以这个错误码唤醒全部等待者
+    */
+    void wakeNoLock(int error);
+
+    /**
+     * @brief 发送出错，丢弃队列并唤醒所有等待者
+    */
+    void failNoLock(int error);
+
+private:
+    /// 互斥锁
+    mutable MutexType m_mutex;
+    /// 发送函数
+    Writer m_writer;
+    /// 待发送字节数上限
+    size_t m_maxBytes;
+    /// 延迟上限(毫秒)
+    uint64_t m_maxDelayMs;
+    /// 待发送队列，分段指向m_chunks或者挂起的调用者的内存
+    std::deque<iovec> m_queue;
+    /// 复制进来的数据
+    std::deque<Chunk> m_chunks;
+    /// 等待数据发完的协程，按发送序号排列
+    std::deque<Waiter> m_waiters;
+    /// 放进队列的字节总数，最后一个字节的发送序号
+    uint64_t m_queuedSeq = 0;
+    /// 已经发出去的字节总数
+    uint64_t m_sentSeq = 0;
+    /// 是否已经安排了低优先级的刷新任务
+    bool m_armed = false;
+    /// 是否已经安排了马上执行的刷新任务
+    bool m_urgent = false;
+    /// 是否有刷新任务正在发送
+    bool m_flushing = false;
+    /// 发送出错的错误码，出错之后的写都返回这个错误
+    int m_error = 0;
+    /// 延迟定时器
+    Timer::ptr m_timer;
+    /// 统计
+    std::atomic<uint64_t> m_writes = {0};
+    std::atomic<uint64_t> m_syscalls = {0};
+    std::atomic<uint64_t> m_bytes = {0};
+};
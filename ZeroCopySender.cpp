@@ -0,0 +1,144 @@
+#include "ZeroCopySender.h"
+#include "IOManager.h"
+#include "hook.h"
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+ZeroCopySender::ZeroCopySender(int fd, size_t min_bytes)
+    : m_fd(fd)
+    , m_minBytes(min_bytes) {
+}
+
+ssize_t ZeroCopySender::send(const void* buf, size_t len, int flags) {
+    if (len < m_minBytes || m_fallback) {
+        // hook的send，发送缓冲满时挂起协程
+        ssize_t n = ::send(m_fd, buf, len, flags);
+        if (n > 0) {
+            m_stats.copyBytes += n;
+        }
+        return n;
+    }
+    size_t sent = 0;
+    // 还没确认完成的第一个通知编号
+    uint32_t unwaited = m_nextId;
+    int err = 0;
+    while (sent < len) {
+        struct iovec iov = {(char*)buf + sent, len - sent};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        ssize_t n = ::sendmsg(m_fd, &msg, flags | MSG_ZEROCOPY);
+        if (n < 0) {
+            err = errno;
+            // 钉住的页面超过了optmem_max，先等在途的发送完成；没有在途的发送就复制发送
+            if (err == ENOBUFS) {
+                if (m_nextId != unwaited) {
+                    waitDone(unwaited, m_nextId - 1);
+                    unwaited = m_nextId;
+                    continue;
+                }
+                n = ::send(m_fd, (char*)buf + sent, len - sent, flags);
+                if (n > 0) {
+                    m_stats.copyBytes += n;
+                    sent += n;
+                    continue;
+                }
+                err = errno;
+            }
+            break;
+        }
+        // 每次成功的MSG_ZEROCOPY发送，内核按顺序分配一个通知编号，发出一部分也算
+        ++m_nextId;
+        ++m_stats.zerocopyCalls;
+        m_stats.zerocopyBytes += n;
+        sent += n;
+    }
+    // 出错时已经发出去的部分也还被内核引用着，同样要等完成才能返回
+    if (m_nextId != unwaited) {
+        waitDone(unwaited, m_nextId - 1);
+    }
+    if (!sent) {
+        errno = err;
+        return -1;
+    }
+    return sent;
+}
+
+void ZeroCopySender::reap() {
+    char control[128];
+    while (true) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        // 直接调用原生函数，错误队列为空时返回EAGAIN，不挂起
+        if (recvmsg_f(m_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // 一条通知表示编号[ee_info, ee_data]的发送都完成了
+            uint32_t lo = serr->ee_info;
+            uint32_t hi = serr->ee_data;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                m_stats.kernelCopied += hi - lo + 1;
+                m_fallback = true;
+            }
+            auto it = m_done.upper_bound(lo);
+            if (it != m_done.begin()) {
+                auto prev = std::prev(it);
+                if ((uint64_t)prev->second + 1 >= lo) {
+                    lo = prev->first;
+                    hi = std::max(hi, prev->second);
+                    m_done.erase(prev);
+                }
+            }
+            while (it != m_done.end() && it->first <= (uint64_t)hi + 1) {
+                hi = std::max(hi, it->second);
+                it = m_done.erase(it);
+            }
+            m_done[lo] = hi;
+        }
+    }
+}
+
+bool ZeroCopySender::isDone(uint32_t first, uint32_t last) const {
+    auto it = m_done.upper_bound(first);
+    if (it == m_done.begin()) {
+        return false;
+    }
+    --it;
+    return it->second >= last;
+}
+
+void ZeroCopySender::waitDone(uint32_t first, uint32_t last) {
+    IOManager* iom = IOManager::GetThis();
+    while (true) {
+        reap();
+        if (isDone(first, last)) {
+            return;
+        }
+        ++m_stats.waits;
+        PreemptGuard guard;
+        // 完成通知进入错误队列时内核报告EPOLLERR，ERROR事件的等待者都会被唤醒。
+        // 注册时epoll会重新检查就绪状态，读完队列之后、注册之前到达的通知不会丢
+        if (iom->addEvent(m_fd, IOManager::ERROR)) {
+            // fd已经被关闭，内核释放socket时会放掉钉住的页面
+            return;
+        }
+        Fiber* raw_ptr = Fiber::GetThis().get();
+        raw_ptr->yield();
+    }
+}
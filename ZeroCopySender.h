@@ -0,0 +1,104 @@
+#pragma once
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <memory>
+#include <atomic>
+
+/**
+ * @brief socket的MSG_ZEROCOPY发送
+ * @details 大块数据用MSG_ZEROCOPY发送时内核直接引用用户内存，不复制。发送返回之后页面还被内核钉住，
+ * 直到对端确认收到，内核把完成通知放进socket的错误队列，并通过EPOLLERR报告出来。
+ * send挂起当前协程等IOManager的ERROR事件，被唤醒后从错误队列里读完成通知，
+ * 这次发送的所有通知都到了才返回，返回之后缓冲区就可以复用。
+ * 小于minBytes的数据复制发送，钉住页面和处理通知的开销比复制还大；
+ * 内核报告它还是复制了(比如发往本机回环的数据)时，之后的发送也都改成复制发送
+ * @attention 不是线程安全的，同一时间只能由一个协程在这个socket上调用send
+*/
+class ZeroCopySender {
+public:
+    using ptr = std::shared_ptr<ZeroCopySender>;
+
+    /**
+     * @brief 零拷贝发送统计
+    */
+    struct Stats {
+        /// 零拷贝发出去的字节数
+        uint64_t zerocopyBytes;
+        /// 复制发出去的字节数
+        uint64_t copyBytes;
+        /// 带MSG_ZEROCOPY的sendmsg次数，每次对应一个完成通知编号
+        uint64_t zerocopyCalls;
+        /// 内核报告还是复制了的通知数
+        uint64_t kernelCopied;
+        /// 等待完成通知挂起的次数
+        uint64_t waits;
+    };
+
+    /**
+     * @brief 构造函数
+     * @param[in] fd 已经开启SO_ZEROCOPY的socket
+     * @param[in] min_bytes 小于这个大小的数据复制发送
+    */
+    ZeroCopySender(int fd, size_t min_bytes);
+
+    /**
+     * @brief 发送数据
+     * @details 必须在IOManager的协程里调用。零拷贝发送时挂起到内核不再引用buf为止
+     * @param[in] flags 附加的send标志
+     * @return 发出去的字节数，一个字节都没发出去时返回-1
+    */
+    ssize_t send(const void* buf, size_t len, int flags);
+
+    /**
+     * @brief 获取零拷贝的最小字节数
+    */
+    size_t getMinBytes() const {return m_minBytes;}
+
+    /**
+     * @brief 设置零拷贝的最小字节数
+     * @details set_zerocopy可能在其他线程上调用，和send同时进行
+    */
+    void setMinBytes(size_t v) {m_minBytes = v;}
+
+    /**
+     * @brief 内核报告复制之后是否已经改成复制发送
+    */
+    bool isFallback() const {return m_fallback;}
+
+    /**
+     * @brief 获取统计信息
+    */
+    const Stats& getStats() const {return m_stats;}
+
+private:
+    /**
+     * @brief 从错误队列里读出所有完成通知，不阻塞
+    */
+    void reap();
+
+    /**
+     * @brief 编号[first, last]的发送是否都完成了
+    */
+    bool isDone(uint32_t first, uint32_t last) const;
+
+    /**
+     * @brief 挂起到编号[first, last]的发送都完成为止
+    */
+    void waitDone(uint32_t first, uint32_t last);
+
+private:
+    /// socket句柄
+    int m_fd;
+    /// 零拷贝的最小字节数
+    std::atomic<size_t> m_minBytes;
+    /// 下一次零拷贝发送的通知编号，和内核的计数保持一致
+    uint32_t m_nextId = 0;
+    /// 已经完成的编号区间，起始编号 -> 结束编号(包含)，相邻的区间会合并
+    std::map<uint32_t, uint32_t> m_done;
+    /// 内核报告复制之后改成复制发送
+    bool m_fallback = false;
+    /// 统计
+    Stats m_stats = {0, 0, 0, 0, 0};
+};
@@ -2,9 +2,18 @@
 #include "IOManager.h"
 #include "Fd_Manager.h"
 #include "Fiber.h"
+#include "OffloadPool.h"
+#include "FileIo.h"
+#include "WriteCoalescer.h"
+#include "ZeroCopySender.h"
 #include <dlfcn.h>
 #include <iostream>
 #include <stdarg.h>
+#include <string.h>
+#include <poll.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
 
 /// 是否开启hook是线程粒度的
 static thread_local bool t_hook_enable = false;
@@ -16,22 +25,51 @@ static thread_local bool t_hook_enable = false;
     XX(socket) \
     XX(connect) \
     XX(accept) \
+    XX(accept4) \
     XX(read) \
     XX(readv) \
     XX(recv) \
     XX(recvfrom) \
     XX(recvmsg) \
+    XX(pread) \
     XX(write) \
     XX(writev) \
     XX(send) \
     XX(sendto) \
     XX(sendmsg) \
+    XX(pwrite) \
     XX(close) \
+    XX(shutdown) \
+    XX(dup) \
+    XX(dup2) \
+    XX(dup3) \
+    XX(pipe) \
+    XX(pipe2) \
+    XX(socketpair) \
+    XX(sendfile) \
+    XX(splice) \
+    XX(poll) \
+    XX(ppoll) \
+    XX(select) \
+    XX(epoll_wait) \
+    XX(open) \
+    XX(fsync) \
+    XX(stat) \
+    XX(getaddrinfo) \
     XX(fcntl) \
     XX(ioctl) \
     XX(getsockopt) \
     XX(setsockopt)
 
+#ifdef _STAT_VER
+typedef int (*xstat_fun)(int ver, const char *pathname, struct stat *statbuf);
+static xstat_fun xstat_f = nullptr;
+
+static int xstat_stat(const char *pathname, struct stat *statbuf) {
+    return xstat_f(_STAT_VER, pathname, statbuf);
+}
+#endif
+
 void hook_init() {
     static bool is_inited = false;
     if (is_inited) {
@@ -40,6 +78,15 @@ void hook_init() {
 #define XX(name) name ## _f = (name ## _fun)dlsym(RTLD_NEXT, #name);
     HOOK_FUN(XX)
 #undef XX
+#ifdef _STAT_VER
+    // glibc 2.33之前stat是头文件里调用__xstat的内联函数，libc里没有stat这个符号
+    if (!stat_f) {
+        xstat_f = (xstat_fun)dlsym(RTLD_NEXT, "__xstat");
+        if (xstat_f) {
+            stat_f = xstat_stat;
+        }
+    }
+#endif
 }
 
 static uint64_t s_connect_timeout = -1;
@@ -61,10 +108,440 @@ void set_hook_enable(bool flag) {
     t_hook_enable = flag;
 }
 
+/// 自动放到辅助线程上执行的阻塞调用
+static std::atomic<int> s_blocking_hooks = {0};
+
+void set_blocking_hooks(int hooks) {
+    s_blocking_hooks = hooks;
+}
+
+int get_blocking_hooks() {
+    return s_blocking_hooks;
+}
+
 struct timer_info {
-    int cancelled = 0;
+    /// 提前唤醒的原因，超时和取消在不同线程上抢着设置，只有设置成功的一方撤销事件
+    std::atomic<int> cancelled = {0};
+
+    /**
+     * @brief 设置提前唤醒的原因
+     * @return 之前没有设置过返回true
+    */
+    bool trySet(int reason) {
+        int expected = 0;
+        return cancelled.compare_exchange_strong(expected, reason);
+    }
+};
+
+/**
+ * @brief 设置errno
+ * @details errno是线程局部变量，而__errno_location被声明为const函数，编译器会把它的结果缓存起来。
+ * 协程挂起之后可能在另一个线程上恢复，挂起前缓存的地址指向的是原线程的errno，
+ * 所以可能跨越协程切换的地方统一通过这两个不内联的函数重新取地址来读写errno
+*/
+__attribute__((noinline)) static void set_errno(int err) {
+    errno = err;
+}
+
+/**
+ * @brief 读取errno，见set_errno
+*/
+__attribute__((noinline)) static int get_errno() {
+    return errno;
+}
+
+/**
+ * @brief 当前的阻塞调用是否放到辅助线程上执行
+ * @param[in] hook 调用对应的BlockingHook
+*/
+static bool use_blocking_pool(int hook) {
+    return t_hook_enable && (s_blocking_hooks & hook) && Scheduler::GetThis()
+            && Fiber::GetThis()->isRunInScheduler();
+}
+
+/**
+ * @brief 登记新创建的fd，socket和带O_CLOEXEC的管道会被设置成非阻塞
+ * @param[in] user_nonblock 创建时用户是否要求了非阻塞(SOCK_NONBLOCK/O_NONBLOCK)
+*/
+static void register_fd(int fd, bool user_nonblock) {
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd, true);
+    if(ctx && user_nonblock) {
+        ctx->setUserNonblock(true);
+    }
+}
+
+/**
+ * @brief fd关闭前撤销它在IOManager上的事件并注销FdCtx
+*/
+static void release_fd(int fd) {
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+    if(ctx) {
+        // 合并着还没发出去的数据在关闭前发完，不能在协程里等待的话只能丢弃
+        WriteCoalescer::ptr coalescer = ctx->getCoalescer();
+        if(coalescer) {
+            if(Scheduler::GetThis() && Fiber::GetThis()->isRunInScheduler()) {
+                coalescer->flush();
+            }
+            coalescer->close();
+        }
+        auto iom = IOManager::GetThis();
+        if(iom) {
+            iom->cancelAll(fd);
+        }
+        FdMgr::GetInstance()->del(fd);
+    }
+}
+
+bool is_peer_closed(int fd) {
+    IOManager* iom = IOManager::GetThis();
+    return iom && iom->isPeerClosed(fd);
+}
+
+/**
+ * @brief 在辅助线程池上执行阻塞调用，并把辅助线程上的errno带回来
+ * @param[in] pool 辅助线程池
+*/
+template<class F>
+static auto call_in_pool(OffloadPool* pool, F fn) -> decltype(fn()) {
+    int err = 0;
+    auto rt = pool->offload([&fn, &err]() {
+        auto r = fn();
+        err = errno;
+        return r;
+    });
+    set_errno(err);
+    return rt;
+}
+
+/**
+ * @brief 挂起当前协程，直到fd上的event事件就绪
+ * @details 超时或者当前协程被取消时提前唤醒，并撤销事件注册
+ * @param[in] iom 当前IOManager
+ * @param[in] fd 文件句柄
+ * @param[in] event 等待的事件
+ * @param[in] timeout_ms 超时时间毫秒，-1表示不超时
+ * @return 事件就绪返回0，注册事件失败返回-1，超时或取消返回对应的错误码ETIMEDOUT/ECANCELED
+*/
+static int wait_fd_event(IOManager* iom, int fd, IOManager::Event event, uint64_t timeout_ms) {
+    // 注册事件到yield之间禁止抢占，原因见PreemptGuard
+    PreemptGuard guard;
+    Fiber::ptr fiber = Fiber::GetThis();
+    if(fiber->isCancelled()) {
+        return ECANCELED;
+    }
+    // 协程有截止时间的话，等待时间不超过截止时间
+    uint64_t deadline = fiber->getDeadline();
+    if(deadline) {
+        uint64_t now = GetCurrentMS();
+        if(now >= deadline) {
+            return ETIMEDOUT;
+        }
+        timeout_ms = std::min(timeout_ms, deadline - now);
+    }
+
+    // 未指定回调函数，因此事件就绪时是回到当前协程继续执行。
+    // 同一个fd上可能还有别的等待者，超时和取消只处理自己这一个
+    uint64_t id = 0;
+    int rt = iom->addEvent(fd, event, nullptr, IOManager::WAKE_ONE, &id);
+    if(rt) {
+        return -1;
+    }
+
+    Timer::ptr timer;
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+    // 传递弱引用是为了避免额外增加引用次数？我们需要的只是一个观察者
+    std::weak_ptr<timer_info> winfo(tinfo);
+
+    if(timeout_ms != (uint64_t)-1) {
+        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom, event, id]() {
+            auto t = winfo.lock();
+            if(!t || !t->trySet(ETIMEDOUT)) {
+                return;
+            }
+            iom->cancelEvent(fd, event, id);
+        }, winfo);
+    }
+    // 被取消时和超时一样，通过cancelEvent触发事件把协程唤醒
+    bool armed = fiber->setCancelCallback([winfo, fd, iom, event, id]() {
+        auto t = winfo.lock();
+        if(!t || !t->trySet(ECANCELED)) {
+            return;
+        }
+        iom->cancelEvent(fd, event, id);
+    });
+    // 登记之前就已经被取消，删除事件即可，不用挂起；
+    // 删除失败说明事件已经被触发，当前协程已经进入调度队列，必须yield一次
+    if(armed || !iom->delEvent(fd, event, id)) {
+        fiber->yield();
+        fiber->clearCancelCallback();
+    }
+    if(!armed) {
+        tinfo->trySet(ECANCELED);
+    }
+    if(timer) {
+        timer->cancel();
+    }
+    return tinfo->cancelled;
+}
+
+/**
+ * @brief 挂起当前协程ms毫秒
+ * @details 当前协程被取消时取消定时器并立即唤醒
+ * @return 睡满返回0，被取消返回ECANCELED
+*/
+static int sleep_ms(uint64_t ms) {
+    // 同wait_fd_event，定时器登记之后到yield之前不能被抢占
+    PreemptGuard guard;
+    Fiber::ptr fiber = Fiber::GetThis();
+    if(fiber->isCancelled()) {
+        return ECANCELED;
+    }
+    IOManager* iom = IOManager::GetThis();
+    Timer::ptr timer = iom->addTimer(ms, std::bind((void(Scheduler::*)
+            (Fiber::ptr, int thread, Scheduler::Priority, int))&IOManager::schedule
+            ,iom, fiber, -1, Scheduler::NORMAL, -1));
+    Fiber* raw_ptr = fiber.get();
+    bool armed = fiber->setCancelCallback([timer, iom, raw_ptr]() {
+        if(timer->cancel()) {
+            iom->schedule(raw_ptr->shared_from_this());
+        }
+    });
+    if(armed || !timer->cancel()) {
+        fiber->yield();
+        fiber->clearCancelCallback();
+    }
+    return fiber->isCancelled() ? ECANCELED : 0;
+}
+
+/**
+ * @brief 多个fd一起等待时的共享状态
+ * @details 事件回调、定时器和取消回调谁先到谁唤醒协程，其他的什么都不做
+*/
+struct fds_waiter {
+    /// 是否已经唤醒
+    std::atomic<bool> woken = {false};
+    /// 唤醒原因，0表示事件就绪，或者ETIMEDOUT/ECANCELED
+    int reason = 0;
+    /// 等待的协程
+    Fiber::ptr fiber;
+    /// 协程所在的IOManager
+    IOManager* iom = nullptr;
 };
 
+/**
+ * @brief 唤醒等待多个fd的协程，只有第一次调用生效
+*/
+static void wake_fds_waiter(const std::shared_ptr<fds_waiter>& w, int reason) {
+    if(w->woken.exchange(true)) {
+        return;
+    }
+    w->reason = reason;
+    Fiber::ptr fiber;
+    fiber.swap(w->fiber);
+    w->iom->schedule(fiber);
+}
+
+/**
+ * @brief 挂起当前协程，直到任意一个fd上的事件就绪
+ * @details 给每个fd注册WAKE_ALL的回调事件，再加一个超时定时器，唤醒之后撤销所有还没触发的事件。
+ * 同一个fd的同一个事件只注册一次
+ * @param[in] iom 当前IOManager
+ * @param[in] regs 要等待的fd和事件
+ * @param[in] timeout_ms 超时时间毫秒，-1表示不超时
+ * @return 有事件就绪返回0，注册事件失败返回-1，超时或取消返回对应的错误码ETIMEDOUT/ECANCELED
+*/
+static int wait_fds(IOManager* iom, const std::vector<std::pair<int, IOManager::Event>>& regs,
+                    uint64_t timeout_ms) {
+    // 同wait_fd_event，注册之后到yield之前不能被抢占
+    PreemptGuard guard;
+    Fiber::ptr fiber = Fiber::GetThis();
+    if(fiber->isCancelled()) {
+        return ECANCELED;
+    }
+    uint64_t deadline = fiber->getDeadline();
+    if(deadline) {
+        uint64_t now = GetCurrentMS();
+        if(now >= deadline) {
+            return ETIMEDOUT;
+        }
+        timeout_ms = std::min(timeout_ms, deadline - now);
+    }
+
+    std::shared_ptr<fds_waiter> w(new fds_waiter);
+    w->fiber = fiber;
+    w->iom = iom;
+    // 和别的协程一起等同一个fd时不能抢走它们的唤醒
+    std::vector<uint64_t> ids(regs.size());
+    size_t added = 0;
+    for(; added < regs.size(); ++added) {
+        if(iom->addEvent(regs[added].first, regs[added].second,
+                         [w]() { wake_fds_waiter(w, 0); }, IOManager::WAKE_ALL, &ids[added])) {
+            break;
+        }
+    }
+    bool failed = added < regs.size();
+    Timer::ptr timer;
+    bool armed = false;
+    if(!failed) {
+        if(timeout_ms != (uint64_t)-1) {
+            timer = iom->addTimer(timeout_ms, [w]() { wake_fds_waiter(w, ETIMEDOUT); });
+        }
+        armed = fiber->setCancelCallback([w]() { wake_fds_waiter(w, ECANCELED); });
+    }
+    // 注册失败或者登记前已经被取消时自己把唤醒权抢过来，不用挂起；
+    // 抢不到说明已经有事件触发，协程已经进入调度队列，必须yield一次
+    if(armed || w->woken.exchange(true)) {
+        Fiber* raw_ptr = fiber.get();
+        fiber.reset();
+        raw_ptr->yield();
+        if(armed) {
+            raw_ptr->clearCancelCallback();
+        }
+    } else {
+        w->fiber.reset();
+        w->reason = ECANCELED;
+    }
+    if(timer) {
+        timer->cancel();
+    }
+    // 已经触发的等待者不在IOManager上了，删除对它们不起作用
+    for(size_t i = 0; i < added; ++i) {
+        iom->delEvent(regs[i].first, regs[i].second, ids[i]);
+    }
+    return failed ? -1 : w->reason;
+}
+
+/**
+ * @brief 把秒加上不足一秒的毫秒数换算成poll用的毫秒超时
+ * @details 用64位计算，超过INT_MAX的按INT_MAX算，不能溢出成负数变成无限等待
+*/
+static int to_timeout_ms(uint64_t sec, uint64_t ms) {
+    if(sec > (uint64_t)INT_MAX / 1000) {
+        return INT_MAX;
+    }
+    return (int)std::min<uint64_t>(sec * 1000 + ms, INT_MAX);
+}
+
+/**
+ * @brief hook的poll/ppoll/select/epoll_wait共用的实现
+ * @details 先不阻塞地poll一次，没有就绪的fd再把它们注册到IOManager上挂起协程，
+ * 唤醒之后重新poll一次得到就绪集合。POLLPRI对应PRIORITY，POLLRDHUP对应PEER_CLOSED；
+ * 不注册ERROR，否则同一个fd上别的等待者会收不到出错，出错时其他事件的等待者都会被唤醒，
+ * 只关心错误的fd只在唤醒后的poll里检查
+ * @param[in] timeout_ms 超时时间毫秒，小于0表示不超时
+ * @return 同poll
+*/
+static int do_poll(IOManager* iom, struct pollfd* fds, nfds_t nfds, int timeout_ms) {
+    int n = poll_f(fds, nfds, 0);
+    if(n != 0 || timeout_ms == 0) {
+        return n;
+    }
+    // 同一个fd出现多次时只注册一次
+    std::vector<std::pair<int, IOManager::Event>> regs;
+    for(nfds_t i = 0; i < nfds; ++i) {
+        if(fds[i].fd < 0) {
+            continue;
+        }
+        int event = IOManager::NONE;
+        if(fds[i].events & (POLLIN | POLLRDNORM | POLLRDBAND)) {
+            event |= IOManager::READ;
+        }
+        if(fds[i].events & (POLLOUT | POLLWRNORM | POLLWRBAND)) {
+            event |= IOManager::WRITE;
+        }
+        if(fds[i].events & POLLPRI) {
+            event |= IOManager::PRIORITY;
+        }
+        if(fds[i].events & POLLRDHUP) {
+            event |= IOManager::PEER_CLOSED;
+        }
+        if(event == IOManager::NONE) {
+            continue;
+        }
+        auto it = std::find_if(regs.begin(), regs.end(),
+                [&fds, i](const std::pair<int, IOManager::Event>& r) {
+                    return r.first == fds[i].fd;
+                });
+        if(it != regs.end()) {
+            it->second = (IOManager::Event)(it->second | event);
+        } else {
+            regs.emplace_back(fds[i].fd, (IOManager::Event)event);
+        }
+    }
+    // 一个fd的多个事件拆开注册
+    static const IOManager::Event kinds[] = {
+        IOManager::READ, IOManager::WRITE, IOManager::PRIORITY, IOManager::PEER_CLOSED
+    };
+    size_t count = regs.size();
+    for(size_t i = 0; i < count; ++i) {
+        int event = regs[i].second;
+        bool first = true;
+        for(IOManager::Event kind : kinds) {
+            if(!(event & kind)) {
+                continue;
+            }
+            if(first) {
+                regs[i].second = kind;
+                first = false;
+            } else {
+                regs.emplace_back(regs[i].first, kind);
+            }
+        }
+    }
+
+    uint64_t start = GetCurrentMS();
+    while(true) {
+        uint64_t remain = -1;
+        if(timeout_ms > 0) {
+            uint64_t elapsed = GetCurrentMS() - start;
+            if(elapsed >= (uint64_t)timeout_ms) {
+                return 0;
+            }
+            remain = timeout_ms - elapsed;
+        }
+        int rt = 0;
+        if(regs.empty()) {
+            // 没有能等的fd，poll只是当sleep用
+            if(remain == (uint64_t)-1) {
+                return poll_f(fds, nfds, timeout_ms);
+            }
+            rt = sleep_ms(remain);
+            if(!rt) {
+                rt = ETIMEDOUT;
+            }
+        } else {
+            rt = wait_fds(iom, regs, remain);
+        }
+        if(rt == -1) {
+            // 注册失败的fd不能用epoll等，退回原生poll阻塞线程
+            return poll_f(fds, nfds, remain == (uint64_t)-1 ? -1 : (int)remain);
+        }
+        if(rt == ECANCELED) {
+            set_errno(ECANCELED);
+            return -1;
+        }
+        n = poll_f(fds, nfds, 0);
+        if(n != 0 || rt == ETIMEDOUT) {
+            return n;
+        }
+        // 边缘触发的事件被别的协程先消费掉了，接着等
+    }
+}
+
+/**
+ * @brief 当前调用能否挂起协程等待，不能的话直接调用原生函数
+*/
+static IOManager* poll_iomanager(int timeout_ms) {
+    if(!t_hook_enable || timeout_ms == 0) {
+        return nullptr;
+    }
+    IOManager* iom = IOManager::GetThis();
+    if(!iom || !Fiber::GetThis()->isRunInScheduler()) {
+        return nullptr;
+    }
+    return iom;
+}
+
 template<typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
         uint32_t event, int timeout_so, Args&&... args) {
@@ -82,61 +559,168 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
         return -1;
     }
 
-    if(!ctx->isSocket() || ctx->getUserNonblock()) {
+    // 普通文件没有就绪的概念，读写磁盘时整个调用交给文件IO线程池
+    if(ctx->isFile() && use_blocking_pool(BLOCKING_HOOK_FILE_IO)) {
+        return call_in_pool(FileIoPoolMgr::GetInstance(), [&]() {
+            return fun(fd, std::forward<Args>(args)...);
+        });
+    }
+
+    if(!ctx->isPollable() || ctx->getUserNonblock()) {
         return fun(fd, std::forward<Args>(args)...);
     }
 
     uint64_t to = ctx->getTimeout(timeout_so);
-    std::shared_ptr<timer_info> tinfo(new timer_info);
 
 retry:
     ssize_t n = fun(fd, std::forward<Args>(args)...);
-    while(n == -1 && errno == EINTR) {
+    while(n == -1 && get_errno() == EINTR) {
         n = fun(fd, std::forward<Args>(args)...);
     }
     // 没就绪那么就加定时器等待
-    if(n == -1 && errno == EAGAIN) {
+    if(n == -1 && get_errno() == EAGAIN) {
         IOManager* iom = IOManager::GetThis();
-        Timer::ptr timer;
-        std::weak_ptr<timer_info> winfo(tinfo);
-
-        if(to != (uint64_t)-1) {
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {
-                auto t = winfo.lock();
-                if(!t || t->cancelled) {
-                    return;
-                }
-                t->cancelled = ETIMEDOUT;
-                iom->cancelEvent(fd, (IOManager::Event)(event));
-            }, winfo);
-        }
         // 调度后回到当前协程继续执行
-        int rt = iom->addEvent(fd, (IOManager::Event)(event));
-        if(rt) {
+        int rt = wait_fd_event(iom, fd, (IOManager::Event)(event), to);
+        if(rt == -1) {
             // std::cout << hook_fun_name << " addEvent("
             //     << fd << ", " << event << ")";
-            if(timer) {
-                timer->cancel();
-            }
             return -1;
-        } else {
-            Fiber::GetThis()->yield();
-            if(timer) {
-                timer->cancel();
-            }
-            // 如果超时，那么后续调度会回到这里，然后发现设置了cancelled标志，那么返回-1
-            // 未超时的话，回到这里不会发现cancelled标志被设置，不会返回-1，而是返回retry重新进行I/O事件
-            if(tinfo->cancelled) {
-                errno = tinfo->cancelled;
-                return -1;
-            }
-            goto retry;
+        }
+        // 超时或被取消的话，后续调度会回到这里，然后发现设置了错误码，那么返回-1
+        // 否则回到这里返回retry重新进行I/O事件
+        if(rt) {
+            set_errno(rt);
+            return -1;
+        }
+        goto retry;
+    }
+    // 没有阻塞直接完成的IO消耗协作预算，预算用完时让出，避免数据一直就绪的协程独占线程
+    if(n >= 0) {
+        Scheduler* scheduler = Scheduler::GetThis();
+        if(scheduler) {
+            scheduler->consumeBudget();
         }
     }
-    
     return n;
 }
 
+/**
+ * @brief 获取fd的写合并器
+ * @param[out] nonblock 用户把fd设成了非阻塞，合并器不能挂起调用者
+ * @return 没有开启写合并，或者当前不在IOManager的协程里不能挂起时返回空
+*/
+static WriteCoalescer::ptr get_coalescer(int fd, bool& nonblock) {
+    if(!t_hook_enable) {
+        return nullptr;
+    }
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+    if(!ctx || ctx->isClose()) {
+        return nullptr;
+    }
+    WriteCoalescer::ptr coalescer = ctx->getCoalescer();
+    if(!coalescer || !IOManager::GetThis() || !Fiber::GetThis()->isRunInScheduler()) {
+        return nullptr;
+    }
+    nonblock = ctx->getUserNonblock();
+    return coalescer;
+}
+
+/**
+ * @brief 不能合并的发送之前先等合并的数据发完，保证顺序
+ * @details 非阻塞的fd或者带MSG_DONTWAIT的调用不等待，还有合并的数据没发完时返回EAGAIN
+ * @param[in] flags 调用带的send标志
+ * @return 成功返回0，合并的数据发送出错或者不能等待时返回-1
+*/
+static int flush_coalescer(int fd, int flags = 0) {
+    bool nonblock = false;
+    WriteCoalescer::ptr coalescer = get_coalescer(fd, nonblock);
+    return coalescer ? coalescer->flush(nonblock || (flags & MSG_DONTWAIT)) : 0;
+}
+
+int set_write_coalescing(int fd, size_t max_bytes, uint64_t max_delay_ms) {
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+    if(!ctx || ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+    if(!ctx->isSocket()) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+    // 换掉或者关掉之前先把已经合并的数据发完，否则后面直接发的数据会插到前面
+    WriteCoalescer::ptr old = ctx->getCoalescer();
+    if(old && old->pending()) {
+        if(!Scheduler::GetThis() || !Fiber::GetThis()->isRunInScheduler()) {
+            errno = EBUSY;
+            return -1;
+        }
+        if(old->flush()) {
+            return -1;
+        }
+    }
+    if(!max_bytes) {
+        ctx->setCoalescer(nullptr);
+        return 0;
+    }
+    // 刷新任务在后台发送，用MSG_NOSIGNAL避免对端关闭时在不相干的地方触发SIGPIPE
+    ctx->setCoalescer(WriteCoalescer::ptr(new WriteCoalescer(
+        [fd](const struct iovec* iov, int iovcnt) -> ssize_t {
+            // 刷新任务可能跑在还没开过hook的线程上
+            set_hook_enable(true);
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = (struct iovec*)iov;
+            msg.msg_iovlen = iovcnt;
+            return do_io(fd, sendmsg_f, "sendmsg", IOManager::WRITE, SO_SNDTIMEO, &msg, MSG_NOSIGNAL);
+        }, max_bytes, max_delay_ms)));
+    return 0;
+}
+
+int flush_write_coalescing(int fd) {
+    // 显式刷新，非阻塞的fd也挂起等待
+    bool nonblock = false;
+    WriteCoalescer::ptr coalescer = get_coalescer(fd, nonblock);
+    return coalescer ? coalescer->flush() : 0;
+}
+
+int set_zerocopy(int fd, bool enable, size_t min_bytes) {
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+    if(!ctx || ctx->isClose()) {
+        errno = EBADF;
+        return -1;
+    }
+    if(!ctx->isSocket()) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+    // 内核的通知编号不会重置，已经有发送器时只调整阈值，关闭就是让所有数据都复制发送
+    ZeroCopySender::ptr sender = ctx->getZeroCopy();
+    if(sender) {
+        sender->setMinBytes(enable ? min_bytes : (size_t)-1);
+        return 0;
+    }
+    if(!enable) {
+        return 0;
+    }
+    int on = 1;
+    if(setsockopt_f(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on))) {
+        return -1;
+    }
+    ctx->setZeroCopy(ZeroCopySender::ptr(new ZeroCopySender(fd, min_bytes)));
+    return 0;
+}
+
+ssize_t send_zerocopy(int fd, const void* buf, size_t len, int flags) {
+    if(t_hook_enable && IOManager::GetThis() && Fiber::GetThis()->isRunInScheduler()) {
+        FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+        ZeroCopySender::ptr sender = ctx ? ctx->getZeroCopy() : nullptr;
+        if(sender && !ctx->isClose()) {
+            return sender->send(buf, len, flags);
+        }
+    }
+    return send(fd, buf, len, flags);
+}
 
 extern "C" {
 #define XX(name) name ## _fun name ## _f = nullptr;
@@ -148,12 +732,10 @@ unsigned int sleep(unsigned int seconds) {
         return sleep_f(seconds);
     }
 
-    Fiber::ptr fiber = Fiber::GetThis();
-    IOManager* iom = IOManager::GetThis();
-    iom->addTimer(seconds * 1000, std::bind((void(Scheduler::*)
-            (Fiber::ptr, int thread))&IOManager::schedule
-            ,iom, fiber, -1));
-    Fiber::GetThis()->yield();
+    // 被取消时无法得知剩余时间，按没有睡眠返回
+    if(sleep_ms(seconds * 1000)) {
+        return seconds;
+    }
     return 0;
 }
 
@@ -161,12 +743,11 @@ int usleep(useconds_t usec) {
     if(!t_hook_enable) {
         return usleep_f(usec);
     }
-    Fiber::ptr fiber = Fiber::GetThis();
-    IOManager* iom = IOManager::GetThis();
-    iom->addTimer(usec / 1000, std::bind((void(Scheduler::*)
-            (Fiber::ptr, int thread))&IOManager::schedule
-            ,iom, fiber, -1));
-    Fiber::GetThis()->yield();
+    int rt = sleep_ms(usec / 1000);
+    if(rt) {
+        set_errno(rt);
+        return -1;
+    }
     return 0;
 }
 
@@ -176,12 +757,11 @@ int nanosleep(const struct timespec *req, struct timespec *rem) {
     }
 
     int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 /1000;
-    Fiber::ptr fiber = Fiber::GetThis();
-    IOManager* iom = IOManager::GetThis();
-    iom->addTimer(timeout_ms, std::bind((void(Scheduler::*)
-            (Fiber::ptr, int thread))&IOManager::schedule
-            ,iom, fiber, -1));
-    Fiber::GetThis()->yield();
+    int rt = sleep_ms(timeout_ms);
+    if(rt) {
+        set_errno(rt);
+        return -1;
+    }
     return 0;
 }
 
@@ -193,10 +773,19 @@ int socket(int domain, int type, int protocol) {
     if(fd == -1) {
         return fd;
     }
-    FdMgr::GetInstance()->get(fd, true);
+    register_fd(fd, type & SOCK_NONBLOCK);
     return fd;
 }
 
+int socketpair(int domain, int type, int protocol, int sv[2]) {
+    int rt = socketpair_f(domain, type, protocol, sv);
+    if(rt == 0 && t_hook_enable) {
+        register_fd(sv[0], type & SOCK_NONBLOCK);
+        register_fd(sv[1], type & SOCK_NONBLOCK);
+    }
+    return rt;
+}
+
 int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen, uint64_t timeout_ms) {
     if(!t_hook_enable) {
         return connect_f(fd, addr, addrlen);
@@ -223,36 +812,12 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     }
 
     IOManager* iom = IOManager::GetThis();
-    Timer::ptr timer;
-    std::shared_ptr<timer_info> tinfo(new timer_info);
-    // 传递弱引用是为了避免额外增加引用次数？我们需要的只是一个观察者
-    std::weak_ptr<timer_info> winfo(tinfo);
-
-    if(timeout_ms != (uint64_t)-1) {
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
-                auto t = winfo.lock();
-                if(!t || t->cancelled) {
-                    return;
-                }
-                t->cancelled = ETIMEDOUT;
-                iom->cancelEvent(fd, IOManager::WRITE);
-        }, winfo);
-    }
     // 未指定回调函数，因此任务被调度时是回到当前协程继续执行
-    int rt = iom->addEvent(fd, IOManager::WRITE);
-    if(rt == 0) {
-        Fiber::GetThis()->yield();
-        if(timer) {
-            timer->cancel();
-        }
-        if(tinfo->cancelled) {
-            errno = tinfo->cancelled;
-            return -1;
-        }
-    } else {
-        if(timer) {
-            timer->cancel();
-        }
+    int rt = wait_fd_event(iom, fd, IOManager::WRITE, timeout_ms);
+    if(rt > 0) {
+        set_errno(rt);
+        return -1;
+    } else if(rt) {
         // std::cout << "connect addEvent(" << fd << ", WRITE) error";
     }
 
@@ -264,7 +829,7 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     if(!error) {
         return 0;
     } else {
-        errno = error;
+        set_errno(error);
         return -1;
     }
 }
@@ -281,6 +846,14 @@ int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
     return fd;
 }
 
+int accept4(int s, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+    int fd = do_io(s, accept4_f, "accept4", IOManager::READ, SO_RCVTIMEO, addr, addrlen, flags);
+    if(fd >= 0 && t_hook_enable) {
+        register_fd(fd, flags & SOCK_NONBLOCK);
+    }
+    return fd;
+}
+
 ssize_t read(int fd, void *buf, size_t count) {
     return do_io(fd, read_f, "read", IOManager::READ, SO_RCVTIMEO, buf, count);
 }
@@ -301,40 +874,423 @@ ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
     return do_io(sockfd, recvmsg_f, "recvmsg", IOManager::READ, SO_RCVTIMEO, msg, flags);
 }
 
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+    return do_io(fd, pread_f, "pread", IOManager::READ, SO_RCVTIMEO, buf, count, offset);
+}
+
 ssize_t write(int fd, const void *buf, size_t count) {
+    bool nonblock = false;
+    WriteCoalescer::ptr coalescer = get_coalescer(fd, nonblock);
+    if(coalescer) {
+        struct iovec iov = {(void*)buf, count};
+        return coalescer->write(&iov, 1, nonblock);
+    }
     return do_io(fd, write_f, "write", IOManager::WRITE, SO_SNDTIMEO, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    bool nonblock = false;
+    WriteCoalescer::ptr coalescer = get_coalescer(fd, nonblock);
+    if(coalescer) {
+        return coalescer->write(iov, iovcnt, nonblock);
+    }
     return do_io(fd, writev_f, "writev", IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags) {
+    bool nonblock = false;
+    WriteCoalescer::ptr coalescer = get_coalescer(s, nonblock);
+    if(coalescer) {
+        nonblock |= (flags & MSG_DONTWAIT) != 0;
+        // 带MSG_OOB、MSG_MORE等标志的发送不能合并，先等前面的数据发完
+        if(flags & ~(MSG_NOSIGNAL | MSG_DONTWAIT)) {
+            if(coalescer->flush(nonblock)) {
+                return -1;
+            }
+        } else {
+            struct iovec iov = {(void*)msg, len};
+            return coalescer->write(&iov, 1, nonblock);
+        }
+    }
     return do_io(s, send_f, "send", IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
 }
 
 ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    if(!to) {
+        return send(s, msg, len, flags);
+    }
+    if(flush_coalescer(s, flags)) {
+        return -1;
+    }
     return do_io(s, sendto_f, "sendto", IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
 }
 
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    return do_io(fd, pwrite_f, "pwrite", IOManager::WRITE, SO_SNDTIMEO, buf, count, offset);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    if(flush_coalescer(out_fd)) {
+        return -1;
+    }
+    // 输入是普通文件，只有输出端会阻塞
+    return do_io(out_fd, sendfile_f, "sendfile", IOManager::WRITE, SO_SNDTIMEO, in_fd, offset, count);
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+    IOManager* iom = IOManager::GetThis();
+    if(!t_hook_enable || !iom) {
+        return splice_f(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+    if(flush_coalescer(fd_out)) {
+        return -1;
+    }
+    FdCtx::ptr in = FdMgr::GetInstance()->get(fd_in);
+    FdCtx::ptr out = FdMgr::GetInstance()->get(fd_out);
+    if((in && in->isClose()) || (out && out->isClose())) {
+        errno = EBADF;
+        return -1;
+    }
+    // 只有hook接管了非阻塞的一端需要挂起等待，用户自己设成非阻塞的照常返回EAGAIN
+    bool wait_in = in && in->isPollable() && !in->getUserNonblock();
+    bool wait_out = out && out->isPollable() && !out->getUserNonblock();
+    if(!wait_in && !wait_out) {
+        return splice_f(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+    int retries = 0;
+    while(true) {
+        ssize_t n = splice_f(fd_in, off_in, fd_out, off_out, len, flags);
+        if(n >= 0) {
+            iom->consumeBudget();
+            return n;
+        }
+        int err = get_errno();
+        if(err == EINTR) {
+            continue;
+        }
+        if(err != EAGAIN) {
+            return -1;
+        }
+        // EAGAIN分不出是哪一端没就绪，用不阻塞的poll看一下，等没就绪的那一端
+        struct pollfd pfds[2] = {{fd_in, POLLIN, 0}, {fd_out, POLLOUT, 0}};
+        poll_f(pfds, 2, 0);
+        int fd = -1;
+        IOManager::Event event = IOManager::NONE;
+        uint64_t to = -1;
+        if(wait_in && !(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            fd = fd_in;
+            event = IOManager::READ;
+            to = in->getTimeout(SO_RCVTIMEO);
+        } else if(wait_out && !(pfds[1].revents & (POLLOUT | POLLHUP | POLLERR))) {
+            fd = fd_out;
+            event = IOManager::WRITE;
+            to = out->getTimeout(SO_SNDTIMEO);
+        } else if(++retries < 3) {
+            // 两端看起来都就绪了，可能是刚变化，重试几次
+            continue;
+        } else {
+            // 没有hook接管的那一端没就绪，和原来一样返回EAGAIN
+            set_errno(EAGAIN);
+            return -1;
+        }
+        retries = 0;
+        int rt = wait_fd_event(iom, fd, event, to);
+        if(rt == -1) {
+            return -1;
+        }
+        if(rt) {
+            set_errno(rt);
+            return -1;
+        }
+    }
+}
+
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
+    bool nonblock = false;
+    WriteCoalescer::ptr coalescer = get_coalescer(s, nonblock);
+    if(coalescer) {
+        nonblock |= (flags & MSG_DONTWAIT) != 0;
+        // 带地址、控制信息或者特殊标志的消息不能合并，先等前面的数据发完
+        if(msg->msg_name || msg->msg_controllen || (flags & ~(MSG_NOSIGNAL | MSG_DONTWAIT))) {
+            if(coalescer->flush(nonblock)) {
+                return -1;
+            }
+        } else {
+            return coalescer->write(msg->msg_iov, msg->msg_iovlen, nonblock);
+        }
+    }
     return do_io(s, sendmsg_f, "sendmsg", IOManager::WRITE, SO_SNDTIMEO, msg, flags);
 }
 
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    IOManager* iom = poll_iomanager(timeout);
+    if(!iom) {
+        return poll_f(fds, nfds, timeout);
+    }
+    return do_poll(iom, fds, nfds, timeout);
+}
+
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask) {
+    int timeout = -1;
+    // 不合法的超时交给原生调用返回EINVAL
+    bool invalid = tmo_p && (tmo_p->tv_sec < 0 || tmo_p->tv_nsec < 0 || tmo_p->tv_nsec >= 1000000000);
+    if(tmo_p && !invalid) {
+        timeout = to_timeout_ms(tmo_p->tv_sec, (tmo_p->tv_nsec + 999999) / 1000000);
+    }
+    // 临时替换信号掩码和等待是原子的，协程里做不到，带掩码的调用不接管
+    IOManager* iom = sigmask || invalid ? nullptr : poll_iomanager(timeout);
+    if(!iom) {
+        return ppoll_f(fds, nfds, tmo_p, sigmask);
+    }
+    return do_poll(iom, fds, nfds, timeout);
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+    int timeout_ms = -1;
+    bool invalid = timeout && (timeout->tv_sec < 0 || timeout->tv_usec < 0 || timeout->tv_usec >= 1000000);
+    if(timeout && !invalid) {
+        timeout_ms = to_timeout_ms(timeout->tv_sec, (timeout->tv_usec + 999) / 1000);
+    }
+    IOManager* iom = invalid ? nullptr : poll_iomanager(timeout_ms);
+    if(!iom || nfds < 0 || nfds > FD_SETSIZE) {
+        return select_f(nfds, readfds, writefds, exceptfds, timeout);
+    }
+    // 转成pollfd，就绪条件和内核select一致
+    std::vector<struct pollfd> pfds;
+    for(int fd = 0; fd < nfds; ++fd) {
+        short events = 0;
+        if(readfds && FD_ISSET(fd, readfds)) {
+            events |= POLLIN;
+        }
+        if(writefds && FD_ISSET(fd, writefds)) {
+            events |= POLLOUT;
+        }
+        if(exceptfds && FD_ISSET(fd, exceptfds)) {
+            events |= POLLPRI;
+        }
+        if(events) {
+            pfds.push_back({fd, events, 0});
+        }
+    }
+    uint64_t start = GetCurrentMS();
+    int rt = do_poll(iom, pfds.data(), pfds.size(), timeout_ms);
+    if(rt < 0) {
+        return rt;
+    }
+    for(auto& pfd : pfds) {
+        if(pfd.revents & POLLNVAL) {
+            set_errno(EBADF);
+            return -1;
+        }
+    }
+    if(readfds) {
+        FD_ZERO(readfds);
+    }
+    if(writefds) {
+        FD_ZERO(writefds);
+    }
+    if(exceptfds) {
+        FD_ZERO(exceptfds);
+    }
+    int count = 0;
+    for(auto& pfd : pfds) {
+        if((pfd.events & POLLIN) && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            FD_SET(pfd.fd, readfds);
+            ++count;
+        }
+        if((pfd.events & POLLOUT) && (pfd.revents & (POLLOUT | POLLERR))) {
+            FD_SET(pfd.fd, writefds);
+            ++count;
+        }
+        if((pfd.events & POLLPRI) && (pfd.revents & POLLPRI)) {
+            FD_SET(pfd.fd, exceptfds);
+            ++count;
+        }
+    }
+    // 和Linux的select一样，把剩余时间写回timeout
+    if(timeout) {
+        uint64_t elapsed = GetCurrentMS() - start;
+        uint64_t remain = elapsed < (uint64_t)timeout_ms ? timeout_ms - elapsed : 0;
+        timeout->tv_sec = remain / 1000;
+        timeout->tv_usec = remain % 1000 * 1000;
+    }
+    return count;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    IOManager* iom = poll_iomanager(timeout);
+    if(!iom) {
+        return epoll_wait_f(epfd, events, maxevents, timeout);
+    }
+    // epoll实例有就绪事件时自己可读，等它可读之后再不阻塞地取事件
+    uint64_t start = GetCurrentMS();
+    while(true) {
+        int n = epoll_wait_f(epfd, events, maxevents, 0);
+        if(n != 0) {
+            return n;
+        }
+        int remain = -1;
+        if(timeout > 0) {
+            uint64_t elapsed = GetCurrentMS() - start;
+            if(elapsed >= (uint64_t)timeout) {
+                return 0;
+            }
+            remain = timeout - elapsed;
+        }
+        struct pollfd pfd = {epfd, POLLIN, 0};
+        int rt = do_poll(iom, &pfd, 1, remain);
+        if(rt < 0) {
+            return rt;
+        }
+        if(rt == 0) {
+            return epoll_wait_f(epfd, events, maxevents, 0);
+        }
+    }
+}
+
 int close(int fd) {
     if(!t_hook_enable) {
         return close_f(fd);
     }
 
-    FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
-    if(ctx) {
-        auto iom = IOManager::GetThis();
-        if(iom) {
-            iom->cancelAll(fd);
+    release_fd(fd);
+    return close_f(fd);
+}
+
+int shutdown(int sockfd, int how) {
+    // 合并着的数据要在FIN之前发出去，否则刷新任务之后发送会拿到EPIPE，数据就丢了
+    if(how != SHUT_RD && flush_coalescer(sockfd)) {
+        return -1;
+    }
+    return shutdown_f(sockfd, how);
+}
+
+int dup(int oldfd) {
+    int fd = dup_f(oldfd);
+    if(fd >= 0 && t_hook_enable) {
+        FdMgr::GetInstance()->dup(oldfd, fd);
+    }
+    return fd;
+}
+
+/**
+ * @brief dup2/dup3的公共实现
+ * @details newfd原来打开着的话会被隐式关闭，要先像close一样撤销事件，
+ * 否则epoll里留着newfd对应旧文件描述的注册
+*/
+static int do_dup2(int oldfd, int newfd, int flags, bool is_dup3) {
+    if(!t_hook_enable) {
+        return is_dup3 ? dup3_f(oldfd, newfd, flags) : dup2_f(oldfd, newfd);
+    }
+    // oldfd无效时dup2不会关闭newfd，不能提前注销
+    if(oldfd != newfd && fcntl_f(oldfd, F_GETFD) != -1) {
+        release_fd(newfd);
+    }
+    int fd = is_dup3 ? dup3_f(oldfd, newfd, flags) : dup2_f(oldfd, newfd);
+    if(fd < 0 || oldfd == newfd) {
+        return fd;
+    }
+    // 管道放到标准输入输出上基本都是要交给exec的子进程，恢复阻塞模式，整个打开文件描述不再由hook管理。
+    // 父进程里同一端的其他句柄也跟着变成阻塞的，通常父进程会关掉它
+    FdCtx::ptr ctx = FdMgr::GetInstance()->get(oldfd);
+    if(fd <= STDERR_FILENO && ctx && ctx->isFifo() && ctx->isPollable() && !ctx->getUserNonblock()) {
+        fcntl_f(fd, F_SETFL, fcntl_f(fd, F_GETFL) & ~O_NONBLOCK);
+        release_fd(oldfd);
+    } else {
+        FdMgr::GetInstance()->dup(oldfd, fd);
+    }
+    return fd;
+}
+
+int dup2(int oldfd, int newfd) {
+    return do_dup2(oldfd, newfd, 0, false);
+}
+
+int dup3(int oldfd, int newfd, int flags) {
+    return do_dup2(oldfd, newfd, flags, true);
+}
+
+int pipe(int pipefd[2]) {
+    // 不带O_CLOEXEC，登记之后也保持阻塞，见FdCtx::isPollable
+    int rt = pipe_f(pipefd);
+    if(rt == 0 && t_hook_enable) {
+        register_fd(pipefd[0], false);
+        register_fd(pipefd[1], false);
+    }
+    return rt;
+}
+
+int pipe2(int pipefd[2], int flags) {
+    int rt = pipe2_f(pipefd, flags);
+    if(rt == 0 && t_hook_enable) {
+        register_fd(pipefd[0], flags & O_NONBLOCK);
+        register_fd(pipefd[1], flags & O_NONBLOCK);
+    }
+    return rt;
+}
+
+int open(const char *pathname, int flags, ...) {
+    mode_t mode = 0;
+    // O_TMPFILE里包含O_DIRECTORY位，只打开目录时没有mode参数，要整个比较
+    if((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+        va_list va;
+        va_start(va, flags);
+        mode = va_arg(va, int);
+        va_end(va);
+    }
+    int fd = -1;
+    if(!use_blocking_pool(BLOCKING_HOOK_OPEN)) {
+        fd = open_f(pathname, flags, mode);
+    } else {
+        fd = call_in_pool(BlockingPoolMgr::GetInstance(), [=]() {
+            return open_f(pathname, flags, mode);
+        });
+    }
+    // 登记之后普通文件的读写才会经过do_io交给文件IO线程池
+    if(fd >= 0 && t_hook_enable && (s_blocking_hooks & BLOCKING_HOOK_FILE_IO)) {
+        FdMgr::GetInstance()->get(fd, true);
+    }
+    return fd;
+}
+
+int fsync(int fd) {
+    if(use_blocking_pool(BLOCKING_HOOK_FILE_IO)) {
+        FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
+        if(ctx && ctx->isFile()) {
+            return call_in_pool(FileIoPoolMgr::GetInstance(), [=]() {
+                return fsync_f(fd);
+            });
         }
-        FdMgr::GetInstance()->del(fd);
     }
-    return close_f(fd);
+    if(!use_blocking_pool(BLOCKING_HOOK_FSYNC)) {
+        return fsync_f(fd);
+    }
+    return call_in_pool(BlockingPoolMgr::GetInstance(), [=]() {
+        return fsync_f(fd);
+    });
+}
+
+int stat(const char *pathname, struct stat *statbuf) {
+    if(!stat_f) {
+        errno = ENOSYS;
+        return -1;
+    }
+    if(!use_blocking_pool(BLOCKING_HOOK_STAT)) {
+        return stat_f(pathname, statbuf);
+    }
+    return call_in_pool(BlockingPoolMgr::GetInstance(), [=]() {
+        return stat_f(pathname, statbuf);
+    });
+}
+
+int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res) {
+    if(!use_blocking_pool(BLOCKING_HOOK_GETADDRINFO)) {
+        return getaddrinfo_f(node, service, hints, res);
+    }
+    // 错误码是EAI_SYSTEM时具体原因在errno里
+    return call_in_pool(BlockingPoolMgr::GetInstance(), [=]() {
+        return getaddrinfo_f(node, service, hints, res);
+    });
 }
 
 int fcntl(int fd, int cmd, ... /* arg */ ) {
@@ -346,7 +1302,7 @@ int fcntl(int fd, int cmd, ... /* arg */ ) {
                 int arg = va_arg(va, int);
                 va_end(va);
                 FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
-                if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+                if(!ctx || ctx->isClose() || !ctx->isPollable()) {
                     return fcntl_f(fd, cmd, arg);
                 }
                 ctx->setUserNonblock(arg & O_NONBLOCK);
@@ -363,7 +1319,7 @@ int fcntl(int fd, int cmd, ... /* arg */ ) {
                 va_end(va);
                 int arg = fcntl_f(fd, cmd);
                 FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
-                if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+                if(!ctx || ctx->isClose() || !ctx->isPollable()) {
                     return arg;
                 }
                 if(ctx->getUserNonblock()) {
@@ -375,6 +1331,16 @@ int fcntl(int fd, int cmd, ... /* arg */ ) {
             break;
         case F_DUPFD:
         case F_DUPFD_CLOEXEC:
+            {
+                int arg = va_arg(va, int);
+                va_end(va);
+                int newfd = fcntl_f(fd, cmd, arg);
+                if(newfd >= 0 && t_hook_enable) {
+                    FdMgr::GetInstance()->dup(fd, newfd);
+                }
+                return newfd;
+            }
+            break;
         case F_SETFD:
         case F_SETOWN:
         case F_SETSIG:
@@ -433,7 +1399,7 @@ int ioctl(int d, unsigned long int request, ...) {
     if(FIONBIO == request) {
         bool user_nonblock = !!*(int*)arg;
         FdCtx::ptr ctx = FdMgr::GetInstance()->get(d);
-        if(!ctx || ctx->isClose() || !ctx->isSocket()) {
+        if(!ctx || ctx->isClose() || !ctx->isPollable()) {
             return ioctl_f(d, request, arg);
         }
         ctx->setUserNonblock(user_nonblock);
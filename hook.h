@@ -6,6 +6,13 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <signal.h>
 
 /**
  * @brief 当前线程是否hook
@@ -17,6 +24,86 @@ bool is_hook_enable();
 */
 void set_hook_enable(bool flag);
 
+/**
+ * @brief 不发系统调用判断当前IOManager是否已经发现fd的对端关闭
+ * @details 连接池里的空闲连接可以挂一个IOManager::PEER_CLOSED等待者，
+ * 对端关闭时在回调里回收，或者取用前用这个函数检查一下，见IOManager::isPeerClosed
+*/
+bool is_peer_closed(int fd);
+
+/**
+ * @brief 开启或关闭socket的写合并
+ * @details 开启之后，在IOManager的协程里对这个fd调用write/writev/send/sendmsg(不带地址、控制信息和特殊标志)时，
+ * 数据交给WriteCoalescer，多次小块写合并成一次writev发出去，见WriteCoalescer。
+ * 不能合并的发送(带MSG_OOB等标志、sendfile、splice)和shutdown关闭写先等合并的数据发完，顺序不变。
+ * 非阻塞的fd和带MSG_DONTWAIT的调用不挂起：写只复制队列放得下的部分，放不下或者要等合并的数据发完时返回EAGAIN。
+ * 合并的数据用MSG_NOSIGNAL发送，对端关闭时返回EPIPE，不会在刷新任务里触发SIGPIPE。
+ * close时先发完合并的数据。只对这个句柄生效，dup出来的句柄不合并
+ * @param[in] fd hook登记过的socket
+ * @param[in] max_bytes 攒到多少字节立即发送，为0时关闭写合并
+ * @param[in] max_delay_ms 数据最多攒多久(毫秒)，本线程一直有任务、刷新任务轮不到时由定时器发送
+ * @return 成功返回0，失败返回-1，errno为EBADF(没有登记)、ENOTSOCK(不是socket)，
+ * 或者还有没发完的数据而当前不在协程里无法等待时为EBUSY
+ * @attention 换掉或者关闭写合并时不能有别的协程同时在写这个fd
+*/
+int set_write_coalescing(int fd, size_t max_bytes, uint64_t max_delay_ms = 1);
+
+/**
+ * @brief 立即发送fd上合并的数据，挂起当前协程直到发完
+ * @details 只能在开启了hook的IOManager协程里等待，其他情况直接返回0。非阻塞的fd也会等待，
+ * 可以在shutdown之前调用
+ * @return 成功或者没有开启写合并返回0，发送出错返回-1
+*/
+int flush_write_coalescing(int fd);
+
+/**
+ * @brief 开启或关闭socket的零拷贝发送
+ * @details 开启时设置SO_ZEROCOPY，之后send_zerocopy不小于min_bytes的数据用MSG_ZEROCOPY发送，见ZeroCopySender。
+ * 已经开启过的socket只调整阈值；关闭之后send_zerocopy全部复制发送
+ * @param[in] fd hook登记过的socket
+ * @param[in] enable 是否开启
+ * @param[in] min_bytes 小于这个大小的数据复制发送
+ * @return 成功返回0，失败返回-1，errno为EBADF(没有登记)、ENOTSOCK(不是socket)，
+ * 或者内核不支持SO_ZEROCOPY时setsockopt的错误码
+*/
+int set_zerocopy(int fd, bool enable, size_t min_bytes = 16 * 1024);
+
+/**
+ * @brief 零拷贝发送
+ * @details 开启了零拷贝而且在IOManager的协程里时，挂起当前协程直到数据发出去、内核不再引用buf为止，
+ * 返回之后buf可以立即复用；其他情况等同于send
+ * @attention 同一时间只能有一个协程在这个socket上调用send_zerocopy
+ * @return 发出去的字节数，出错返回-1
+*/
+ssize_t send_zerocopy(int fd, const void* buf, size_t len, int flags = 0);
+
+/**
+ * @brief 可以自动放到辅助线程上执行的阻塞调用
+*/
+enum BlockingHook {
+    BLOCKING_HOOK_OPEN = 0x1,
+    BLOCKING_HOOK_FSYNC = 0x2,
+    BLOCKING_HOOK_STAT = 0x4,
+    BLOCKING_HOOK_GETADDRINFO = 0x8,
+    /// 普通文件上的read/write/readv/writev/pread/pwrite/fsync，交给FileIoPool执行，
+    /// 只对开启之后由hook的open打开的文件生效
+    BLOCKING_HOOK_FILE_IO = 0x10,
+    BLOCKING_HOOK_ALL = 0x1f,
+};
+
+/**
+ * @brief 设置哪些阻塞调用自动放到辅助线程上执行
+ * @details 开启hook的线程上，调度器协程里调用这些函数时挂起协程，
+ * 调用在BlockingPool的辅助线程上执行，其他情况仍然直接调用。默认都不开启
+ * @param[in] hooks BlockingHook的组合
+*/
+void set_blocking_hooks(int hooks);
+
+/**
+ * @brief 获取自动放到辅助线程上执行的阻塞调用
+*/
+int get_blocking_hooks();
+
 extern "C" {
 
 // sleep
@@ -39,6 +126,12 @@ extern connect_fun connect_f;
 typedef int (*accept_fun)(int s, struct sockaddr *addr, socklen_t *addrlen);
 extern accept_fun accept_f;
 
+typedef int (*accept4_fun)(int s, struct sockaddr *addr, socklen_t *addrlen, int flags);
+extern accept4_fun accept4_f;
+
+typedef int (*socketpair_fun)(int domain, int type, int protocol, int sv[2]);
+extern socketpair_fun socketpair_f;
+
 // read
 typedef ssize_t (*read_fun)(int fd, void *buf, size_t count);
 extern read_fun read_f;
@@ -55,6 +148,9 @@ extern recvfrom_fun recvfrom_f;
 typedef ssize_t (*recvmsg_fun)(int sockfd, struct msghdr *msg, int flags);
 extern recvmsg_fun recvmsg_f;
 
+typedef ssize_t (*pread_fun)(int fd, void *buf, size_t count, off_t offset);
+extern pread_fun pread_f;
+
 // write
 typedef ssize_t (*write_fun)(int fd, const void *buf, size_t count);
 extern write_fun write_f;
@@ -71,9 +167,64 @@ extern sendto_fun sendto_f;
 typedef ssize_t (*sendmsg_fun)(int s, const struct msghdr *msg, int flags);
 extern sendmsg_fun sendmsg_f;
 
+typedef ssize_t (*pwrite_fun)(int fd, const void *buf, size_t count, off_t offset);
+extern pwrite_fun pwrite_f;
+
 typedef int (*close_fun)(int fd);
 extern close_fun close_f;
 
+typedef int (*shutdown_fun)(int sockfd, int how);
+extern shutdown_fun shutdown_f;
+
+// fd
+typedef int (*dup_fun)(int oldfd);
+extern dup_fun dup_f;
+
+typedef int (*dup2_fun)(int oldfd, int newfd);
+extern dup2_fun dup2_f;
+
+typedef int (*dup3_fun)(int oldfd, int newfd, int flags);
+extern dup3_fun dup3_f;
+
+typedef int (*pipe_fun)(int pipefd[2]);
+extern pipe_fun pipe_f;
+
+typedef int (*pipe2_fun)(int pipefd[2], int flags);
+extern pipe2_fun pipe2_f;
+
+// zero copy
+typedef ssize_t (*sendfile_fun)(int out_fd, int in_fd, off_t *offset, size_t count);
+extern sendfile_fun sendfile_f;
+
+typedef ssize_t (*splice_fun)(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags);
+extern splice_fun splice_f;
+
+// poll
+typedef int (*poll_fun)(struct pollfd *fds, nfds_t nfds, int timeout);
+extern poll_fun poll_f;
+
+typedef int (*ppoll_fun)(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask);
+extern ppoll_fun ppoll_f;
+
+typedef int (*select_fun)(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+extern select_fun select_f;
+
+typedef int (*epoll_wait_fun)(int epfd, struct epoll_event *events, int maxevents, int timeout);
+extern epoll_wait_fun epoll_wait_f;
+
+// blocking
+typedef int (*open_fun)(const char *pathname, int flags, ...);
+extern open_fun open_f;
+
+typedef int (*fsync_fun)(int fd);
+extern fsync_fun fsync_f;
+
+typedef int (*stat_fun)(const char *pathname, struct stat *statbuf);
+extern stat_fun stat_f;
+
+typedef int (*getaddrinfo_fun)(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res);
+extern getaddrinfo_fun getaddrinfo_f;
+
 // ctl
 typedef int (*fcntl_fun)(int fd, int cmd, ... /* arg */ );
 extern fcntl_fun fcntl_f;
@@ -1,12 +1,21 @@
 #include "IOManager.h"
+#include "TcpServer.h"
+#include "SocketStream.h"
+#include "hook.h"
+#include "Fd_Manager.h"
+#include "ZeroCopySender.h"
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <iostream>
 #include <stack>
 #include <cstring>
+#include <string>
+#include <vector>
 
 // void test_fiber(int i) {
 //     std::cout << "hello world " << i << std::endl;
@@ -31,82 +40,426 @@
 //     return 0;
 // }
 
-static int sock_listen_fd = -1;
-
-void test_accept();
-
 void error(const char* msg) {
     perror(msg);
     printf("erreur...\n");
     exit(1);
 }
 
-void watch_io_read() {
-    IOManager::GetThis() ->
-        addEvent(sock_listen_fd, IOManager::READ, test_accept);
+void handle_client(int fd) {
+    SocketStream stream(fd);
+    // 一次readv收进缓冲的数据原样引用进写队列，一次writev发回去，不复制
+    while (stream.fill() > 0) {
+        iovec iov[SocketStream::MAX_IOV];
+        int cnt = stream.peekv(iov, SocketStream::MAX_IOV);
+        size_t len = 0;
+        for (int i = 0; i < cnt; ++i) {
+            stream.writeRef(iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        if (stream.flush() < 0) {
+            break;
+        }
+        stream.consume(len);
+    }
+}
+
+void test_iomanager() {
+    int portno = 8080;
+    struct sockaddr_in server_addr;
+
+    memset((char*)&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(portno);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    IOManager iom(4, true);
+    // 每个工作线程一个SO_REUSEPORT监听socket，连接交给handle_client协程
+    TcpServer::ptr server(new TcpServer(handle_client, &iom, "echo"));
+    if (!server->bind((struct sockaddr *)&server_addr, sizeof(server_addr))) {
+        error("Error binding socket...\n");
+    }
+    printf("epoll echo server listening for connections on port: %d\n", portno);
+    server->start();
+}
+
+/**
+ * @brief 16个外部线程往8个工作线程的调度器提交空任务，测收件箱的提交吞吐
+*/
+void bench_inbox() {
+    const int producers = 16;
+    const int per_producer = 200000;
+    const int total = producers * per_producer;
+    Scheduler sc(8, false, "bench");
+    sc.start();
+    std::atomic<int> done{0};
+    uint64_t start = GetCurrentUS();
+    std::vector<Thread::ptr> threads;
+    for (int i = 0; i < producers; ++i) {
+        threads.push_back(std::make_shared<Thread>([&sc, &done]() {
+            for (int j = 0; j < per_producer; ++j) {
+                sc.schedule([&done]() { ++done; });
+            }
+        }, "producer_" + std::to_string(i)));
+    }
+    for (auto& i: threads) {
+        i->join();
+    }
+    uint64_t submitted = GetCurrentUS();
+    while (done < total) {
+        usleep(1000);
+    }
+    uint64_t finished = GetCurrentUS();
+    sc.stop();
+    printf("inbox: %d producers -> 8 workers, %d tasks, submit %.2f Mops/s, run %.2f Mops/s\n",
+           producers, total, total / (double)(submitted - start),
+           total / (double)(finished - start));
+}
+
+/**
+ * @brief 64个协程在2个工作线程上并发读同一个文件，返回耗时(微秒)
+ * @details 另有一个每毫秒醒一次的协程，它的最大迟到时间就是工作线程被读文件卡住的时间
+*/
+static uint64_t run_file_read(const std::string& path, size_t file_size, int hooks,
+                              uint64_t& max_lag_us) {
+    const int readers = 64;
+    const size_t block = 64 * 1024;
+    set_blocking_hooks(hooks);
+    // 先把文件从页缓存里清掉，两种方式都从磁盘读
+    int fd = open(path.c_str(), O_RDONLY);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    std::atomic<int> done{0};
+    std::atomic<uint64_t> lag{0};
+    uint64_t start = GetCurrentUS();
+    IOManager iom(2, false, "bench");
+    for (int i = 0; i < readers; ++i) {
+        iom.schedule([&, i]() {
+            set_hook_enable(true);
+            int fd = open(path.c_str(), O_RDONLY);
+            std::vector<char> buf(block);
+            size_t part = file_size / readers;
+            for (size_t off = 0; off < part; off += block) {
+                // 读完可能在另一个线程上恢复，hook是线程粒度的
+                set_hook_enable(true);
+                pread(fd, buf.data(), block, i * part + off);
+            }
+            close(fd);
+            ++done;
+        });
+    }
+    iom.schedule([&]() {
+        set_hook_enable(true);
+        while (done < readers) {
+            set_hook_enable(true);
+            uint64_t before = GetCurrentUS();
+            usleep(1000);
+            uint64_t slept = GetCurrentUS() - before;
+            if (slept > 1000 + lag) {
+                lag = slept - 1000;
+            }
+        }
+    });
+    iom.stop();
+    max_lag_us = lag;
+    return GetCurrentUS() - start;
+}
+
+/**
+ * @brief 并发读文件：直接在工作线程上阻塞读，对比BLOCKING_HOOK_FILE_IO交给FileIoPool读
+*/
+void bench_file_read() {
+    const size_t file_size = 256 * 1024 * 1024;
+    std::string path = "bench_file_read.tmp";
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        error("open");
+    }
+    std::vector<char> chunk(1024 * 1024, 'x');
+    for (size_t i = 0; i < file_size; i += chunk.size()) {
+        write(fd, chunk.data(), chunk.size());
+    }
+    fsync(fd);
+    close(fd);
+
+    uint64_t lag = 0;
+    uint64_t us = run_file_read(path, file_size, 0, lag);
+    printf("file read blocking: %.1f MB/s, timer max lag %lu us\n",
+           file_size / (double)us, lag);
+    us = run_file_read(path, file_size, BLOCKING_HOOK_FILE_IO, lag);
+    printf("file read offload:  %.1f MB/s, timer max lag %lu us\n",
+           file_size / (double)us, lag);
+    set_blocking_hooks(0);
+    unlink(path.c_str());
 }
 
-void test_accept() {
+/**
+ * @brief 建连速率：客户端协程在回环上不停建连、断开，服务器接受后立即关闭
+ * @details 客户端用SO_LINGER为0的close发RST断开，避免大量TIME_WAIT耗尽本地端口
+*/
+void bench_accept() {
+    const int clients = 32;
+    const int per_client = 1000;
+    const uint64_t total = clients * per_client;
+    IOManager server_iom(4, false, "server");
+    TcpServer::ptr server(new TcpServer([](int fd) { close(fd); }, &server_iom, "bench"));
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
-    socklen_t len = sizeof(addr);
-    int fd = accept(sock_listen_fd, (struct sockaddr*)&addr, &len);
-    if (fd < 0) {
-        std::cout << "fd = " << fd << "accept false" << std::endl;
-    } else {
-        fcntl(fd, F_SETFL, O_NONBLOCK);
-        IOManager::GetThis()->
-            addEvent(fd, IOManager::READ, [fd]() {
-                char buffer[1024];
-                memset(buffer, 0, sizeof(buffer));
-                while (true) {
-                    int ret = recv(fd, buffer, sizeof(buffer), 0);
-                    if (ret > 0) {
-                        ret = send(fd, buffer, ret, 0);
-                    }
-                    if (ret <= 0) {
-                        // if (errno == EAGAIN) continue;
-                        close(fd);
-                        break;
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (!server->bind((struct sockaddr *)&addr, sizeof(addr))) {
+        error("bind");
+    }
+    server->start();
+    addr.sin_port = htons(server->getPort());
+
+    std::atomic<uint64_t> failed{0};
+    uint64_t start = GetCurrentUS();
+    {
+        IOManager client_iom(2, false, "client");
+        for (int i = 0; i < clients; ++i) {
+            client_iom.schedule([&]() {
+                set_hook_enable(true);
+                struct linger lg = {1, 0};
+                for (int j = 0; j < per_client; ++j) {
+                    int fd = socket(AF_INET, SOCK_STREAM, 0);
+                    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                        ++failed;
                     }
+                    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                    close(fd);
                 }
             });
+        }
+    }
+    uint64_t connected = GetCurrentUS();
+    while (server->getStats().accepted + failed < total && GetCurrentUS() - connected < 5000000) {
+        usleep(1000);
     }
-    IOManager::GetThis()->schedule(watch_io_read);
+    uint64_t accepted = GetCurrentUS();
+    TcpServer::Stats stats = server->getStats();
+    server->stop();
+    printf("accept: %d clients, %lu connects (%lu failed), %.0f conn/s, server accepted %lu on %zu listeners, "
+           "%.0f accept/s\n", clients, total, (uint64_t)failed, total * 1e6 / (connected - start),
+           stats.accepted, stats.listeners, stats.accepted * 1e6 / (accepted - start));
 }
 
-void test_iomanager() {
-    int portno = 8080;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+/**
+ * @brief 小消息的原始处理方式：栈上缓冲recv，每条消息send一次
+*/
+static void raw_line_echo(int fd) {
+    char buffer[1024];
+    std::string partial;
+    while (true) {
+        int ret = recv(fd, buffer, sizeof(buffer), 0);
+        if (ret <= 0) {
+            break;
+        }
+        partial.append(buffer, ret);
+        size_t begin = 0;
+        size_t end;
+        while ((end = partial.find('\n', begin)) != std::string::npos) {
+            send(fd, partial.data() + begin, end + 1 - begin, 0);
+            begin = end + 1;
+        }
+        partial.erase(0, begin);
+    }
+    close(fd);
+}
 
-    sock_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_listen_fd < 0) {
-        error("Error creating socket...\n");
+/**
+ * @brief 用SocketStream处理小消息：一次readv收进多条，回复攒在写队列里，收完的消息处理完才flush
+*/
+static void stream_line_echo(int fd) {
+    SocketStream stream(fd);
+    while (true) {
+        ssize_t len = stream.fillUntil('\n', 1024);
+        if (len <= 0) {
+            break;
+        }
+        stream.write(stream.peek(len), len);
+        stream.consume(len);
+        if (stream.find('\n') < 0 && stream.flush() < 0) {
+            break;
+        }
     }
-    int yes = 1;
-    setsockopt(sock_listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+}
 
-    memset((char*)&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(portno);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+/**
+ * @brief 回环上的行回显压测，每个连接一次发出一批消息再收齐回复
+ * @return 每秒处理的消息数
+*/
+static double run_line_echo(TcpServer::Handler handler) {
+    const int conns = 16;
+    const int batch = 16;
+    const int rounds = 2000;
+    const std::string msg = std::string(31, 'm') + "\n";
+    // hook是线程粒度的，协程挂起后换到没开hook的线程上恢复会直接调用原生函数，所以两边各用一个线程
+    IOManager server_iom(1, false, "server");
+    // 关掉Nagle，否则逐条send的回复会被延迟确认卡住，比的就不是系统调用次数了
+    TcpServer::ptr server(new TcpServer([handler](int fd) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        handler(fd);
+    }, &server_iom, "bench"));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (!server->bind((struct sockaddr *)&addr, sizeof(addr))) {
+        error("bind");
+    }
+    server->start();
+    addr.sin_port = htons(server->getPort());
 
-    if (bind(sock_listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-        error("Error binding socket...\n");
+    std::string request;
+    for (int i = 0; i < batch; ++i) {
+        request += msg;
+    }
+    uint64_t start = GetCurrentUS();
+    {
+        IOManager client_iom(1, false, "client");
+        for (int i = 0; i < conns; ++i) {
+            client_iom.schedule([&]() {
+                set_hook_enable(true);
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                    error("connect");
+                }
+                std::vector<char> reply(request.size());
+                for (int j = 0; j < rounds; ++j) {
+                    send(fd, request.data(), request.size(), 0);
+                    size_t got = 0;
+                    while (got < reply.size()) {
+                        int ret = recv(fd, reply.data() + got, reply.size() - got, 0);
+                        if (ret <= 0) {
+                            error("recv");
+                        }
+                        got += ret;
+                    }
+                }
+                close(fd);
+            });
+        }
+    }
+    uint64_t us = GetCurrentUS() - start;
+    server->stop();
+    return (double)conns * batch * rounds * 1e6 / us;
+}
 
-    if (listen(sock_listen_fd, 2048) < 0) {
-        error("Error listening..\n");
+/**
+ * @brief 小消息协议：SocketStream对比原始的recv/send
+*/
+void bench_socket_stream() {
+    printf("line echo raw recv/send: %.0f msg/s\n", run_line_echo(raw_line_echo));
+    printf("line echo SocketStream:  %.0f msg/s\n", run_line_echo(stream_line_echo));
+}
+
+/**
+ * @brief 往回环上的丢弃服务发送大块数据
+ * @param[in] zerocopy 是否用send_zerocopy发送
+ * @param[out] cpu_ns_per_byte 整个进程每发送一个字节消耗的CPU时间(纳秒)
+ * @return 吞吐(MB/s)
+*/
+static double run_bulk_send(bool zerocopy, double& cpu_ns_per_byte) {
+    const size_t blob = 4 * 1024 * 1024;
+    const int count = 256;
+    // 同bench_socket_stream，各用一个线程，避免协程在没开hook的线程上恢复
+    IOManager server_iom(1, false, "server");
+    TcpServer::ptr server(new TcpServer([](int fd) {
+        std::vector<char> buf(256 * 1024);
+        while (recv(fd, buf.data(), buf.size(), 0) > 0);
+        close(fd);
+    }, &server_iom, "bench"));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (!server->bind((struct sockaddr *)&addr, sizeof(addr))) {
+        error("bind");
     }
-    printf("epoll echo server listening for connections on port: %d\n", portno);
-    fcntl(sock_listen_fd, F_SETFL, O_NONBLOCK);
+    server->start();
+    addr.sin_port = htons(server->getPort());
 
-    IOManager iom(4, true);
-    iom.addEvent(sock_listen_fd, IOManager::READ, test_accept);
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    uint64_t start = GetCurrentUS();
+    {
+        IOManager client_iom(1, false, "client");
+        client_iom.schedule([&]() {
+            set_hook_enable(true);
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                error("connect");
+            }
+            if (zerocopy && set_zerocopy(fd, true)) {
+                perror("set_zerocopy");
+            }
+            std::vector<char> data(blob, 'z');
+            for (int i = 0; i < count; ++i) {
+                size_t sent = 0;
+                while (sent < blob) {
+                    ssize_t n = zerocopy ? send_zerocopy(fd, data.data() + sent, blob - sent)
+                                         : send(fd, data.data() + sent, blob - sent, 0);
+                    if (n < 0) {
+                        error("send");
+                    }
+                    sent += n;
+                }
+            }
+            ZeroCopySender::ptr sender = FdMgr::GetInstance()->get(fd)->getZeroCopy();
+            if (sender) {
+                const ZeroCopySender::Stats& st = sender->getStats();
+                printf("  zerocopy bytes %lu, copied bytes %lu, notifications copied by kernel %lu\n",
+                       st.zerocopyBytes, st.copyBytes, st.kernelCopied);
+            }
+            close(fd);
+        });
+    }
+    uint64_t us = GetCurrentUS() - start;
+    getrusage(RUSAGE_SELF, &after);
+    server->stop();
+    double total = (double)blob * count;
+    uint64_t cpu_us = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000000
+                    + (after.ru_utime.tv_usec - before.ru_utime.tv_usec)
+                    + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000
+                    + (after.ru_stime.tv_usec - before.ru_stime.tv_usec);
+    cpu_ns_per_byte = cpu_us * 1000.0 / total;
+    return total / us;
+}
+
+/**
+ * @brief 零拷贝发送的吞吐和每字节CPU消耗，对比普通send
+ * @details 发往本机回环的数据内核总是会复制，发送器发现后改为复制发送，要看真实收益得发往其他机器
+*/
+void bench_zerocopy() {
+    double cpu = 0;
+    double mbps = run_bulk_send(false, cpu);
+    printf("bulk send copy:     %.0f MB/s, %.3f cpu ns/byte\n", mbps, cpu);
+    mbps = run_bulk_send(true, cpu);
+    printf("bulk send zerocopy: %.0f MB/s, %.3f cpu ns/byte\n", mbps, cpu);
 }
 
 int main(int argc, char *argv[]) {
-    test_iomanager();
+    // 不带参数时运行echo服务器，带参数时运行对应的性能测试
+    std::string name = argc > 1 ? argv[1] : "";
+    if (name == "inbox") {
+        bench_inbox();
+    } else if (name == "file_read") {
+        bench_file_read();
+    } else if (name == "accept") {
+        bench_accept();
+    } else if (name == "socket_stream") {
+        bench_socket_stream();
+    } else if (name == "zerocopy") {
+        bench_zerocopy();
+    } else {
+        test_iomanager();
+    }
     return 0;
 }
 
@@ -1,6 +1,8 @@
 #include "mutex.h"
 #include <stdexcept>
 
+thread_local int t_preempt_disable = 0;
+
 Semaphore::Semaphore(uint32_t count) {
     if (sem_init(&m_semaphore, 0, count)) {
         throw std::logic_error("sem_init eorror");
@@ -3,6 +3,37 @@
 #include <semaphore.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <atomic>
+
+/**
+ * @brief 当前线程禁止抢占的嵌套深度
+ * @details 持有Mutex/RWMutex或者处于PreemptGuard作用域内时大于0，抢占信号看到大于0时不会切走协程，
+ * 避免被切走的协程带着锁排队时，同一线程上的其他协程去拿这把锁造成死锁。
+ * 协程切换时由Fiber随协程一起保存和恢复，所以可以跨yield持有
+*/
+extern thread_local int t_preempt_disable;
+
+/**
+ * @brief 禁止抢占的作用域
+ * @details 先登记唤醒再yield的代码(addEvent之后yield、把自己交给定时器之后yield等)必须放在作用域内，
+ * 否则协程在登记之后、yield之前被抢占，会同时被抢占和唤醒两次放进任务队列
+*/
+class PreemptGuard {
+public:
+    PreemptGuard() {
+        ++t_preempt_disable;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+
+    PreemptGuard(const PreemptGuard&) = delete;
+
+    PreemptGuard& operator = (const PreemptGuard&) = delete;
+
+    ~PreemptGuard() {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        --t_preempt_disable;
+    }
+};
 
 /**
  * @brief 信号量
@@ -215,6 +246,7 @@ public:
      * @brief 加锁
      */
     void lock() {
+        ++t_preempt_disable;
         pthread_mutex_lock(&m_mutex);
     }
 
@@ -223,6 +255,7 @@ public:
      */
     void unlock() {
         pthread_mutex_unlock(&m_mutex);
+        --t_preempt_disable;
     }
 private:
     /// mutex
@@ -263,6 +296,7 @@ public:
      * @brief 上读锁
      */
     void rdlock() {
+        ++t_preempt_disable;
         pthread_rwlock_rdlock(&m_lock);
     }
 
@@ -270,6 +304,7 @@ public:
      * @brief 上写锁
      */
     void wrlock() {
+        ++t_preempt_disable;
         pthread_rwlock_wrlock(&m_lock);
     }
 
@@ -278,6 +313,7 @@ public:
      */
     void unlock() {
         pthread_rwlock_unlock(&m_lock);
+        --t_preempt_disable;
     }
 private:
     /// 读写锁
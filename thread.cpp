@@ -1,7 +1,11 @@
 #include "thread.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <unistd.h>
 #include <syscall.h>
+#include <sched.h>
+#include <ctype.h>
 
 static thread_local Thread* t_thread = nullptr;
 static thread_local std::string t_thread_name = "UNKNOWN";
@@ -61,10 +65,126 @@ void Thread::join() {
     }
 }
 
+bool Thread::setAffinity(int cpu) {
+    if (!m_thread || cpu < 0 || cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rt = pthread_setaffinity_np(m_thread, sizeof(set), &set);
+    if (rt) {
+        std::cerr << "pthread_setaffinity_np fail, rt=" << rt << " cpu=" << cpu << " name=" << m_name << std::endl;
+        return false;
+    }
+    return true;
+}
+
 pid_t GetThreadId() {
     return syscall(SYS_gettid);
 }
 
+/**
+ * @brief 解析sysfs里的编号列表
+ * @details 格式形如 0-3,8-11
+*/
+static std::vector<int> ParseIdList(const std::string& list) {
+    std::vector<int> ids;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || !isdigit((unsigned char)range[0])) {
+            continue;
+        }
+        size_t pos = range.find('-');
+        int first = std::stoi(range.substr(0, pos));
+        int last = pos == std::string::npos ? first : std::stoi(range.substr(pos + 1));
+        for (int id = first; id <= last && id < CPU_SETSIZE; ++id) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+/**
+ * @brief NUMA拓扑
+ * @details 从/sys/devices/system/node读取在线节点和每个节点的CPU列表，只保留本进程可用的CPU，
+ * 读不到的话(非NUMA内核或者容器里)所有可用CPU都归到节点0。
+ * 节点编号可能不连续(比如0和2)，nodeCpus按节点编号索引，不存在的节点CPU列表为空
+*/
+struct NumaTopology {
+    /// 每个节点上的CPU
+    std::vector<std::vector<int>> nodeCpus;
+    /// CPU所在的节点
+    std::vector<int> cpuNode;
+
+    NumaTopology() {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+            for (int i = 0; i < sysconf(_SC_NPROCESSORS_ONLN) && i < CPU_SETSIZE; ++i) {
+                CPU_SET(i, &allowed);
+            }
+        }
+        cpuNode.assign(CPU_SETSIZE, 0);
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string list;
+        if (online) {
+            std::getline(online, list);
+        }
+        for (int node: ParseIdList(list)) {
+            std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!ifs) {
+                continue;
+            }
+            std::getline(ifs, list);
+            std::vector<int> cpus;
+            for (int cpu: ParseIdList(list)) {
+                cpuNode[cpu] = node;
+                if (CPU_ISSET(cpu, &allowed)) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if ((int)nodeCpus.size() <= node) {
+                nodeCpus.resize(node + 1);
+            }
+            nodeCpus[node] = cpus;
+        }
+        if (nodeCpus.empty()) {
+            nodeCpus.resize(1);
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    nodeCpus[0].push_back(cpu);
+                }
+            }
+        }
+    }
+
+    static NumaTopology& GetInstance() {
+        static NumaTopology topology;
+        return topology;
+    }
+};
+
+int GetNumaNodeCount() {
+    return NumaTopology::GetInstance().nodeCpus.size();
+}
+
+const std::vector<std::vector<int>>& GetNumaCpus() {
+    return NumaTopology::GetInstance().nodeCpus;
+}
+
+int GetCpuNumaNode(int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return 0;
+    }
+    return NumaTopology::GetInstance().cpuNode[cpu];
+}
+
+int GetCurrentNumaNode() {
+    return GetCpuNumaNode(sched_getcpu());
+}
+
 void* Thread::run(void* arg) {
     Thread* thread = (Thread*) arg;
     t_thread = thread;
@@ -2,6 +2,7 @@
 
 #include "mutex.h"
 #include <memory>
+#include <vector>
 #include <functional>
 #include <pthread.h>
 
@@ -43,6 +44,13 @@ public:
     */
     void join();
 
+    /**
+     * @brief 把线程绑定到指定CPU上
+     * @param[in] cpu CPU编号
+     * @return 是否绑定成功
+    */
+    bool setAffinity(int cpu);
+
     /**
      * @brief 获取当前线程指针
     */
@@ -75,4 +83,25 @@ private:
     Semaphore m_semaphore;
 };
 
-pid_t GetThreadId();
\ No newline at end of file
+pid_t GetThreadId();
+
+/**
+ * @brief 获取NUMA节点数(最大节点编号+1)，读不到拓扑信息时按一个节点处理
+ * @details 节点编号可能不连续，中间缺的节点没有CPU
+*/
+int GetNumaNodeCount();
+
+/**
+ * @brief 获取每个NUMA节点上本进程可用的CPU
+*/
+const std::vector<std::vector<int>>& GetNumaCpus();
+
+/**
+ * @brief 获取CPU所在的NUMA节点
+*/
+int GetCpuNumaNode(int cpu);
+
+/**
+ * @brief 获取当前线程所在CPU的NUMA节点
+*/
+int GetCurrentNumaNode();
\ No newline at end of file